@@ -0,0 +1,270 @@
+//===-- IRGen.cpp - synthetic modules for the compile-time benchmark ------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// obf-irgen writes a module whose size is set on the command line, so the
+/// time of the passes can be measured against each dimension:
+///
+///   obf-irgen -functions=10 -blocks=1000 -strings=500 -switch-depth=50
+///             -phi-depth=50 -o big.bc
+///
+/// Each function is a chain of blocks with forward branches and short loops,
+/// followed by a nest of switches, each one in the first case of the
+/// previous one, and a nest of diamonds merged by PHIs. The locals live in
+/// allocas like in the output of clang -O0, except the values of the PHIs.
+///
+//===----------------------------------------------------------------------===//
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <random>
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumFunctions("functions",
+                                      cl::desc("Number of functions"),
+                                      cl::init(1));
+
+static cl::opt<unsigned>
+    NumBlocks("blocks", cl::desc("Blocks in the chain of each function"),
+              cl::init(100));
+
+static cl::opt<unsigned>
+    NumStrings("strings",
+               cl::desc("String literals, spread over the functions"),
+               cl::init(0));
+
+static cl::opt<unsigned>
+    SwitchDepth("switch-depth",
+                cl::desc("Depth of the switch nest of each function"),
+                cl::init(0));
+
+static cl::opt<unsigned>
+    PhiDepth("phi-depth", cl::desc("Depth of the PHI nest of each function"),
+             cl::init(0));
+
+static cl::opt<unsigned> Seed("seed", cl::desc("Seed of the generator"),
+                              cl::init(1));
+
+static cl::opt<std::string> OutputFilename("o",
+                                           cl::desc("Output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write output as LLVM assembly"));
+
+namespace {
+
+class Generator {
+public:
+  explicit Generator(Module &M)
+      : M(M), Ctx(M.getContext()), Builder(Ctx), rng(Seed) {
+    Int32Ty = Type::getInt32Ty(Ctx);
+    UseString = M.getOrInsertFunction(
+        "puts", FunctionType::get(Int32Ty, {Type::getInt8PtrTy(Ctx)}, false));
+  }
+
+  void generate() {
+    for (unsigned i = 0; i < NumFunctions; i++) {
+      // The first functions get one more string when they do not divide
+      unsigned Strings = NumStrings / NumFunctions +
+                         (i < NumStrings % NumFunctions ? 1 : 0);
+      generateFunction(i, Strings);
+    }
+  }
+
+private:
+  Module &M;
+  LLVMContext &Ctx;
+  IRBuilder<> Builder;
+  std::mt19937 rng;
+  Type *Int32Ty;
+  FunctionCallee UseString;
+  /// The local holding the result of the function being generated
+  AllocaInst *Acc;
+  unsigned StringCount = 0;
+
+  Value *randomConstant() { return Builder.getInt32(rng() % 1000 + 1); }
+
+  /// Update the accumulator with one operation, \return the new value.
+  Value *emitUpdate(Value *Operand) {
+    Value *V = Builder.CreateLoad(Int32Ty, Acc);
+    static const Instruction::BinaryOps Ops[] = {
+        Instruction::Add, Instruction::Sub, Instruction::Xor,
+        Instruction::And, Instruction::Or,  Instruction::Mul};
+    V = Builder.CreateBinOp(Ops[rng() % array_lengthof(Ops)], V, Operand);
+    Builder.CreateStore(V, Acc);
+    return V;
+  }
+
+  void emitString() {
+    std::string Text = "string " + std::to_string(StringCount++) +
+                       " of the synthetic module";
+    Builder.CreateCall(UseString, {Builder.CreateGlobalStringPtr(Text)});
+  }
+
+  void generateFunction(unsigned Index, unsigned Strings) {
+    FunctionType *FTy = FunctionType::get(Int32Ty, {Int32Ty, Int32Ty}, false);
+    Function *F = Function::Create(FTy, GlobalValue::ExternalLinkage,
+                                   "f" + std::to_string(Index), &M);
+    Argument *A = &*F->arg_begin();
+    Argument *B = &*std::next(F->arg_begin());
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+    Builder.SetInsertPoint(Entry);
+    Acc = Builder.CreateAlloca(Int32Ty, nullptr, "acc");
+    Builder.CreateStore(A, Acc);
+
+    SmallVector<BasicBlock *, 0> Chain;
+    for (unsigned i = 0; i < std::max(1u, NumBlocks.getValue()); i++) {
+      Chain.push_back(BasicBlock::Create(Ctx, "chain", F));
+    }
+    BasicBlock *SwitchNest = BasicBlock::Create(Ctx, "switch", F);
+    Builder.CreateBr(Chain.front());
+
+    // Each block branches forward by one or two blocks, and every 16th one
+    // may loop back to the start of its group
+    for (unsigned i = 0; i < Chain.size(); i++) {
+      Builder.SetInsertPoint(Chain[i]);
+      Value *V = emitUpdate(rng() % 2 ? B : randomConstant());
+      for (unsigned s = i; s < Strings; s += Chain.size()) {
+        emitString();
+      }
+      BasicBlock *Next = i + 1 < Chain.size() ? Chain[i + 1] : SwitchNest;
+      BasicBlock *Other = i + 2 < Chain.size() ? Chain[i + 2] : SwitchNest;
+      if (i % 16 == 15) {
+        Other = Chain[i - 15];
+      }
+      Value *Cond = Builder.CreateICmpSLT(V, randomConstant());
+      Builder.CreateCondBr(Cond, Next, Other);
+    }
+
+    Builder.SetInsertPoint(SwitchNest);
+    BasicBlock *PhiNest = BasicBlock::Create(Ctx, "phi", F);
+    generateSwitchNest(F, SwitchNest, PhiNest);
+    Builder.SetInsertPoint(PhiNest);
+    Value *Result = generatePhiNest(F, PhiNest, B);
+    Value *V = Builder.CreateLoad(Int32Ty, Acc);
+    Builder.CreateRet(Builder.CreateAdd(V, Result));
+  }
+
+  /// Fill \p Head with SwitchDepth nested switches, which all end up in
+  /// \p Exit.
+  void generateSwitchNest(Function *F, BasicBlock *Head, BasicBlock *Exit) {
+    if (SwitchDepth == 0) {
+      Builder.CreateBr(Exit);
+      return;
+    }
+    // The join block of each level goes to the join block of the outer one
+    SmallVector<BasicBlock *, 0> Joins;
+    for (unsigned Level = 0; Level < SwitchDepth; Level++) {
+      Joins.push_back(BasicBlock::Create(Ctx, "join", F));
+      Builder.SetInsertPoint(Joins.back());
+      emitUpdate(randomConstant());
+      Builder.CreateBr(Level == 0 ? Exit : Joins[Level - 1]);
+    }
+    BasicBlock *Current = Head;
+    for (unsigned Level = 0; Level < SwitchDepth; Level++) {
+      Builder.SetInsertPoint(Current);
+      Value *V = Builder.CreateLoad(Int32Ty, Acc);
+      SwitchInst *SI = Builder.CreateSwitch(V, Joins[Level], 4);
+      BasicBlock *Inner = BasicBlock::Create(Ctx, "case", F);
+      SI->addCase(Builder.getInt32(0), Inner);
+      for (unsigned Case = 1; Case < 4; Case++) {
+        BasicBlock *BB = BasicBlock::Create(Ctx, "case", F);
+        SI->addCase(Builder.getInt32(Case), BB);
+        Builder.SetInsertPoint(BB);
+        emitUpdate(randomConstant());
+        Builder.CreateBr(Joins[Level]);
+      }
+      Current = Inner;
+    }
+    Builder.SetInsertPoint(Current);
+    emitUpdate(randomConstant());
+    Builder.CreateBr(Joins.back());
+  }
+
+  /// Fill \p Head with PhiDepth nested diamonds, each one in the true side
+  /// of the previous one. \return the value of the outermost PHI, the
+  /// builder is left at the end of its block.
+  Value *generatePhiNest(Function *F, BasicBlock *Head, Value *Arg) {
+    SmallVector<BasicBlock *, 0> Merges;
+    SmallVector<std::pair<BasicBlock *, Value *>, 0> FalseSides;
+    BasicBlock *Current = Head;
+    for (unsigned Level = 0; Level < PhiDepth; Level++) {
+      BasicBlock *Inner = BasicBlock::Create(Ctx, "then", F);
+      BasicBlock *Else = BasicBlock::Create(Ctx, "else", F);
+      Merges.push_back(BasicBlock::Create(Ctx, "merge", F));
+      Builder.SetInsertPoint(Current);
+      Value *V = Builder.CreateLoad(Int32Ty, Acc);
+      Builder.CreateCondBr(Builder.CreateICmpSGT(V, randomConstant()), Inner,
+                           Else);
+      Builder.SetInsertPoint(Else);
+      FalseSides.emplace_back(Else, Builder.CreateXor(Arg, randomConstant()));
+      Builder.CreateBr(Merges.back());
+      Current = Inner;
+    }
+    // Merge from the innermost diamond out
+    Builder.SetInsertPoint(Current);
+    Value *Result = Builder.CreateMul(Arg, randomConstant());
+    BasicBlock *Pred = Current;
+    for (unsigned Level = PhiDepth; Level-- > 0;) {
+      Builder.CreateBr(Merges[Level]);
+      Builder.SetInsertPoint(Merges[Level]);
+      PHINode *Phi = Builder.CreatePHI(Int32Ty, 2);
+      Phi->addIncoming(Result, Pred);
+      Phi->addIncoming(FalseSides[Level].second, FalseSides[Level].first);
+      Result = Builder.CreateAdd(Phi, randomConstant());
+      Pred = Merges[Level];
+    }
+    return Result;
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv,
+                              "synthetic modules for the compile-time "
+                              "benchmark\n");
+
+  LLVMContext Ctx;
+  Module M("synthetic", Ctx);
+  if (NumFunctions != 0) {
+    Generator(M).generate();
+  }
+  if (verifyModule(M, &errs())) {
+    WithColor::error(errs(), argv[0]) << "generated an invalid module\n";
+    return 1;
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_None);
+  if (EC) {
+    WithColor::error(errs(), argv[0]) << EC.message() << "\n";
+    return 1;
+  }
+  if (OutputAssembly) {
+    M.print(Out.os(), nullptr);
+  } else {
+    WriteBitcodeToFile(M, Out.os());
+  }
+  Out.keep();
+  return 0;
+}
@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+"""Measure how the compile time of the obfuscation passes scales.
+
+Each sweep grows one dimension of the synthetic modules written by obf-irgen.
+Each pass runs alone on each module in its own opt process, and the script
+records its wall time and peak RSS. The time of an opt run without a pass
+(parsing and writing the module) is subtracted. The growth exponent of each
+pass along each sweep is the slope of log(time) against log(size), over the
+sizes where the pass takes long enough to be timed. Each run is repeated
+--repeat times and the fastest is kept, so that a busy machine does not make
+a pass look super-linear. A sweep where the exponent exceeds --max-exponent
+is reported as super-linear, and the script then exits with an error.
+"""
+
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+PASSES = ["obfstr", "boguscf", "subobf", "flattening", "obfuscate"]
+
+# name, obf-irgen flags shared by the sizes, swept flag, sizes
+SWEEPS = [
+    ("blocks", ["-functions=1"], "-blocks", [500, 1000, 2000, 4000]),
+    ("functions", ["-blocks=50"], "-functions", [100, 200, 400, 800]),
+    ("strings", ["-functions=10", "-blocks=20"], "-strings",
+     [1000, 2000, 4000, 8000]),
+    ("switch-depth", ["-functions=1", "-blocks=10"], "-switch-depth",
+     [100, 200, 400, 800]),
+    ("phi-depth", ["-functions=1", "-blocks=10"], "-phi-depth",
+     [100, 200, 400, 800]),
+]
+
+# Times below this are noise, they are not used for the exponent
+MIN_TIME = 0.02
+
+
+def run_measured(cmd):
+    """Run cmd, return its wall time, its peak RSS in KiB and its error, the
+    first line of its diagnostics, or None."""
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    stderr = proc.stderr.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    if os.WIFSIGNALED(status):
+        proc.returncode = -os.WTERMSIG(status)
+    else:
+        proc.returncode = os.WEXITSTATUS(status)
+    error = None
+    if proc.returncode != 0:
+        # The first diagnostic, without the crash report of LLVM
+        lines = [line for line in stderr.splitlines() if line.strip()
+                 and not re.match(r"PLEASE submit|Stack dump|\s*#?\d", line)]
+        error = lines[0] if lines else "exit code %d" % proc.returncode
+    return elapsed, usage.ru_maxrss, error
+
+
+def run_fastest(cmd, repeat):
+    """run_measured repeated, return the fastest wall time, the highest peak
+    RSS and the first error."""
+    best, peak = None, 0
+    for _ in range(repeat):
+        elapsed, rss, error = run_measured(cmd)
+        if error:
+            return elapsed, rss, error
+        best = elapsed if best is None else min(best, elapsed)
+        peak = max(peak, rss)
+    return best, peak, None
+
+
+def exponent(points):
+    """Least squares slope of log(time) against log(size), or None with
+    fewer than two usable points."""
+    points = [(s, t) for s, t in points if t is not None and t >= MIN_TIME]
+    if len(points) < 2:
+        return None
+    xs = [math.log(s) for s, _ in points]
+    ys = [math.log(t) for _, t in points]
+    mx = sum(xs) / len(xs)
+    my = sum(ys) / len(ys)
+    den = sum((x - mx) ** 2 for x in xs)
+    return round(sum((x - mx) * (y - my) for x, y in zip(xs, ys)) / den, 2)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--plugin", required=True,
+                        help="path of libObfuscator.so")
+    parser.add_argument("--irgen", required=True, help="path of obf-irgen")
+    parser.add_argument("--opt", default="opt")
+    parser.add_argument("--legacy-pm", action="store_true",
+                        help="opt needs -enable-new-pm=0 to load the plugin")
+    parser.add_argument("--scale", type=float, default=1.0,
+                        help="multiply the sizes of the sweeps")
+    parser.add_argument("--max-exponent", type=float, default=1.5)
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs of each measurement, the fastest is kept")
+    parser.add_argument("-p", "--pass-filter", default="",
+                        help="only the passes matching this regex")
+    parser.add_argument("-s", "--sweep-filter", default="",
+                        help="only the sweeps matching this regex")
+    parser.add_argument("-o", "--output", default="-")
+    args = parser.parse_args()
+
+    opt = [args.opt] + (["-enable-new-pm=0"] if args.legacy_pm else [])
+    passes = [p for p in PASSES if re.search(args.pass_filter, p)]
+    sweeps = []
+    superlinear = []
+    with tempfile.TemporaryDirectory() as tmp:
+        module = os.path.join(tmp, "synthetic.bc")
+        output = os.path.join(tmp, "out.bc")
+        for name, fixed, flag, sizes in SWEEPS:
+            if not re.search(args.sweep_filter, name):
+                continue
+            points = []
+            for size in sizes:
+                size = max(1, int(size * args.scale))
+                subprocess.run([args.irgen] + fixed +
+                               ["%s=%d" % (flag, size), "-o", module],
+                               check=True)
+                base, base_rss, error = run_fastest(
+                    opt + [module, "-o", output], args.repeat)
+                if error:
+                    sys.exit("opt: %s" % error)
+                point = {"size": size, "opt_time_s": round(base, 4),
+                         "opt_peak_rss_kib": base_rss, "passes": {}}
+                for p in passes:
+                    elapsed, rss, error = run_fastest(
+                        opt + ["-load", args.plugin, "-" + p, "-obf-seed=1",
+                               module, "-o", output], args.repeat)
+                    result = {"peak_rss_kib": rss}
+                    if error:
+                        result["error"] = error
+                    else:
+                        result["time_s"] = round(max(0.0, elapsed - base), 4)
+                    point["passes"][p] = result
+                    print("%-13s %6d %-11s %s" %
+                          (name, size, p, error or "%.3fs %d KiB" %
+                           (result["time_s"], rss)), file=sys.stderr)
+                points.append(point)
+
+            exponents = {}
+            for p in passes:
+                exponents[p] = exponent(
+                    [(pt["size"], pt["passes"][p].get("time_s"))
+                     for pt in points])
+                if exponents[p] is not None and \
+                        exponents[p] > args.max_exponent:
+                    superlinear.append("%s along %s: %.2f" %
+                                       (p, name, exponents[p]))
+            sweeps.append({"sweep": name, "fixed": fixed, "flag": flag,
+                           "points": points, "exponents": exponents})
+
+    report = {"max_exponent": args.max_exponent, "sweeps": sweeps,
+              "superlinear": superlinear}
+    text = json.dumps(report, indent=2) + "\n"
+    if args.output == "-":
+        sys.stdout.write(text)
+    else:
+        with open(args.output, "w") as f:
+            f.write(text)
+    for line in superlinear:
+        print("super-linear: " + line, file=sys.stderr)
+    return 1 if superlinear else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,70 @@
+// Hashing: FNV-1a and a multiplicative mixer over a buffer, and an open
+// addressing hash table.
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BUFFER_SIZE (1 << 16)
+#define TABLE_SIZE (1 << 15)
+
+static unsigned fnv1a(const unsigned char *data, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h ^= data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static unsigned mix(unsigned h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+static unsigned keys[TABLE_SIZE];
+static unsigned values[TABLE_SIZE];
+
+static void insert(unsigned key, unsigned value) {
+  unsigned slot = mix(key) & (TABLE_SIZE - 1);
+  while (keys[slot] != 0 && keys[slot] != key) {
+    slot = (slot + 1) & (TABLE_SIZE - 1);
+  }
+  keys[slot] = key;
+  values[slot] += value;
+}
+
+static unsigned find(unsigned key) {
+  unsigned slot = mix(key) & (TABLE_SIZE - 1);
+  while (keys[slot] != 0) {
+    if (keys[slot] == key) {
+      return values[slot];
+    }
+    slot = (slot + 1) & (TABLE_SIZE - 1);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 120;
+  unsigned char *buffer = malloc(BUFFER_SIZE);
+  for (int i = 0; i < BUFFER_SIZE; i++) {
+    buffer[i] = (unsigned char)(i * 7 + (i >> 5));
+  }
+  unsigned result = 0;
+  for (int r = 0; r < rounds; r++) {
+    buffer[r % BUFFER_SIZE] ^= (unsigned char)r;
+    result ^= fnv1a(buffer, BUFFER_SIZE);
+    for (int i = 0; i < TABLE_SIZE / 2; i++) {
+      insert(mix((unsigned)(i + r)) | 1, (unsigned)i);
+    }
+    for (int i = 0; i < TABLE_SIZE / 2; i++) {
+      result += find(mix((unsigned)(i * 3)) | 1);
+    }
+  }
+  printf("%u\n", result);
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Byte-code interpreter: a stack machine dispatched by a switch in a loop,
+// running a program which counts the primes below a bound.
+#include <stdio.h>
+#include <stdlib.h>
+
+enum Opcode {
+  PUSH, // push the next byte
+  LOAD, // push the variable of the next byte
+  STORE, // pop into the variable of the next byte
+  ADD,
+  SUB,
+  MOD,
+  LT,
+  JZ, // pop, jump to the next byte if zero
+  JMP, // jump to the next byte
+  HALT
+};
+
+static int run(const unsigned char *code, int *vars) {
+  int stack[64];
+  int sp = 0;
+  int pc = 0;
+  for (;;) {
+    switch (code[pc++]) {
+    case PUSH:
+      stack[sp++] = code[pc++];
+      break;
+    case LOAD:
+      stack[sp++] = vars[code[pc++]];
+      break;
+    case STORE:
+      vars[code[pc++]] = stack[--sp];
+      break;
+    case ADD:
+      sp--;
+      stack[sp - 1] += stack[sp];
+      break;
+    case SUB:
+      sp--;
+      stack[sp - 1] -= stack[sp];
+      break;
+    case MOD:
+      sp--;
+      stack[sp - 1] %= stack[sp];
+      break;
+    case LT:
+      sp--;
+      stack[sp - 1] = stack[sp - 1] < stack[sp];
+      break;
+    case JZ:
+      if (stack[--sp] == 0) {
+        pc = code[pc];
+      } else {
+        pc++;
+      }
+      break;
+    case JMP:
+      pc = code[pc];
+      break;
+    case HALT:
+      return vars[2];
+    default:
+      return -1;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 3;
+  // vars: 0 = n, 1 = d, 2 = count, 3 = bound
+  static const unsigned char program[] = {
+      /* 0 */ PUSH, 2, STORE, 0,
+      /* 4 */ LOAD, 0, LOAD, 3, LT, JZ, 54,
+      /* 11 */ PUSH, 2, STORE, 1,
+      /* 15 */ LOAD, 1, LOAD, 0, LT, JZ, 38,
+      /* 22 */ LOAD, 0, LOAD, 1, MOD, JZ, 45,
+      /* 29 */ LOAD, 1, PUSH, 1, ADD, STORE, 1, JMP, 15,
+      /* 38 */ LOAD, 2, PUSH, 1, ADD, STORE, 2,
+      /* 45 */ LOAD, 0, PUSH, 1, ADD, STORE, 0, JMP, 4,
+      /* 54 */ HALT};
+  int result = 0;
+  for (int r = 0; r < rounds; r++) {
+    int vars[4] = {0, 0, 0, 6000 + r};
+    result += run(program, vars);
+  }
+  printf("%d\n", result);
+  return 0;
+}
@@ -0,0 +1,100 @@
+// String parsing: tokenize and evaluate lines of "name = value op value"
+// assignments held in a text buffer.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINES 20000
+
+static int isSpace(char c) { return c == ' ' || c == '\t'; }
+static int isDigit(char c) { return c >= '0' && c <= '9'; }
+static int isAlpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static const char *skipSpaces(const char *p) {
+  while (isSpace(*p)) {
+    p++;
+  }
+  return p;
+}
+
+static const char *parseNumber(const char *p, int *value) {
+  int v = 0;
+  while (isDigit(*p)) {
+    v = v * 10 + (*p - '0');
+    p++;
+  }
+  *value = v;
+  return p;
+}
+
+static const char *parseName(const char *p, unsigned *hash) {
+  unsigned h = 5381;
+  while (isAlpha(*p) || isDigit(*p)) {
+    h = h * 33 + (unsigned char)*p;
+    p++;
+  }
+  *hash = h;
+  return p;
+}
+
+/// Parse one line, \return the position after it or NULL on a syntax error
+static const char *parseLine(const char *p, unsigned *hash, int *value) {
+  int lhs, rhs;
+  p = parseName(skipSpaces(p), hash);
+  p = skipSpaces(p);
+  if (*p++ != '=') {
+    return NULL;
+  }
+  p = parseNumber(skipSpaces(p), &lhs);
+  p = skipSpaces(p);
+  char op = *p++;
+  p = parseNumber(skipSpaces(p), &rhs);
+  switch (op) {
+  case '+':
+    *value = lhs + rhs;
+    break;
+  case '-':
+    *value = lhs - rhs;
+    break;
+  case '*':
+    *value = lhs * rhs;
+    break;
+  case '/':
+    *value = rhs != 0 ? lhs / rhs : 0;
+    break;
+  default:
+    return NULL;
+  }
+  p = skipSpaces(p);
+  return *p == '\n' ? p + 1 : NULL;
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 60;
+  static const char ops[] = "+-*/";
+  char *text = malloc(LINES * 40);
+  char *end = text;
+  for (int i = 0; i < LINES; i++) {
+    end += sprintf(end, "var_%d = %d %c %d\n", i % 97, i * 13 % 1000,
+                   ops[i % 4], i % 31 + 1);
+  }
+  unsigned result = 0;
+  for (int r = 0; r < rounds; r++) {
+    const char *p = text;
+    while (p != NULL && p < end) {
+      unsigned hash;
+      int value;
+      p = parseLine(p, &hash, &value);
+      result = result * 31 + (hash ^ (unsigned)value);
+    }
+    if (p == NULL) {
+      puts("syntax error");
+      return 1;
+    }
+  }
+  printf("%u %d\n", result, (int)strlen(text));
+  free(text);
+  return 0;
+}
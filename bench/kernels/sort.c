@@ -0,0 +1,119 @@
+// Sorting: quicksort with an insertion sort cutoff, and a bottom-up merge
+// sort, on pseudo-random integers.
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 100000
+
+static unsigned seed = 12345;
+
+static unsigned next() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static void insertionSort(int *a, int lo, int hi) {
+  for (int i = lo + 1; i <= hi; i++) {
+    int v = a[i];
+    int j = i - 1;
+    while (j >= lo && a[j] > v) {
+      a[j + 1] = a[j];
+      j--;
+    }
+    a[j + 1] = v;
+  }
+}
+
+static void quickSort(int *a, int lo, int hi) {
+  while (hi - lo > 16) {
+    int pivot = a[lo + (hi - lo) / 2];
+    int i = lo, j = hi;
+    while (i <= j) {
+      while (a[i] < pivot) {
+        i++;
+      }
+      while (a[j] > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        int t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+        i++;
+        j--;
+      }
+    }
+    // Recurse into the smaller half
+    if (j - lo < hi - i) {
+      quickSort(a, lo, j);
+      lo = i;
+    } else {
+      quickSort(a, i, hi);
+      hi = j;
+    }
+  }
+  insertionSort(a, lo, hi);
+}
+
+static void mergeSort(int *a, int *tmp, int n) {
+  for (int width = 1; width < n; width *= 2) {
+    for (int lo = 0; lo < n; lo += 2 * width) {
+      int mid = lo + width < n ? lo + width : n;
+      int hi = lo + 2 * width < n ? lo + 2 * width : n;
+      int i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        tmp[k++] = a[i] <= a[j] ? a[i++] : a[j++];
+      }
+      while (i < mid) {
+        tmp[k++] = a[i++];
+      }
+      while (j < hi) {
+        tmp[k++] = a[j++];
+      }
+    }
+    int *t = a;
+    a = tmp;
+    tmp = t;
+  }
+}
+
+static unsigned checksum(const int *a, int n) {
+  unsigned sum = 0;
+  for (int i = 0; i < n; i++) {
+    if (i > 0 && a[i - 1] > a[i]) {
+      return 0;
+    }
+    sum = sum * 31 + (unsigned)a[i];
+  }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 4;
+  int *a = malloc(N * sizeof(int));
+  int *b = malloc(N * sizeof(int));
+  int *tmp = malloc(N * sizeof(int));
+  unsigned result = 0;
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < N; i++) {
+      a[i] = b[i] = (int)(next() % 1000000);
+    }
+    quickSort(a, 0, N - 1);
+    mergeSort(b, tmp, N);
+    // An odd number of passes leaves the result in tmp
+    int *sorted = b;
+    int passes = 0;
+    for (int width = 1; width < N; width *= 2) {
+      passes++;
+    }
+    if (passes % 2 == 1) {
+      sorted = tmp;
+    }
+    result ^= checksum(a, N) + checksum(sorted, N) * 7;
+  }
+  printf("%u\n", result);
+  free(a);
+  free(b);
+  free(tmp);
+  return 0;
+}
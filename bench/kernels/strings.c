@@ -0,0 +1,58 @@
+// Many strings: classify words against a table of keywords and format
+// messages, so each iteration touches many string literals.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *classify(const char *word) {
+  if (strcmp(word, "if") == 0 || strcmp(word, "else") == 0 ||
+      strcmp(word, "while") == 0 || strcmp(word, "for") == 0 ||
+      strcmp(word, "return") == 0 || strcmp(word, "switch") == 0) {
+    return "keyword";
+  }
+  if (strcmp(word, "int") == 0 || strcmp(word, "char") == 0 ||
+      strcmp(word, "long") == 0 || strcmp(word, "unsigned") == 0) {
+    return "type";
+  }
+  if (strcmp(word, "printf") == 0 || strcmp(word, "malloc") == 0 ||
+      strcmp(word, "free") == 0 || strcmp(word, "memcpy") == 0) {
+    return "library function";
+  }
+  if (strncmp(word, "__", 2) == 0) {
+    return "reserved identifier";
+  }
+  return "identifier";
+}
+
+static const char *severity(int level) {
+  switch (level % 4) {
+  case 0:
+    return "note";
+  case 1:
+    return "remark";
+  case 2:
+    return "warning";
+  default:
+    return "error";
+  }
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+  static const char *words[] = {"while", "count", "unsigned", "printf",
+                                "__init", "buffer", "return", "long",
+                                "memcpy", "index", "switch", "free"};
+  const int numWords = sizeof(words) / sizeof(words[0]);
+  char message[128];
+  unsigned result = 0;
+  for (int r = 0; r < rounds; r++) {
+    const char *word = words[r % numWords];
+    int len = snprintf(message, sizeof(message), "%s: '%s' is a %s (line %d)",
+                       severity(r), word, classify(word), r);
+    for (int i = 0; i < len; i++) {
+      result = result * 131 + (unsigned char)message[i];
+    }
+  }
+  printf("%u\n", result);
+  return 0;
+}
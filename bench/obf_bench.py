@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+"""Measure the run-time cost of the obfuscation passes.
+
+Each kernel of kernels/ is compiled to bitcode once, obfuscated with each
+configuration, optimized, and run. The wall time, the instructions retired
+(when perf is available), the .text size and the largest stack frame of the
+kernel are written as JSON, with the ratios to the unobfuscated build.
+
+The obf-bench target of the CMake build runs this script with the tools it
+found; run it directly to pass -k / -c filters.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+# name, opt flags
+CONFIGS = [
+    ("baseline", []),
+    ("obfstr", ["-obfstr"]),
+    ("boguscf-p30", ["-boguscf", "-bcf_prob=30"]),
+    ("boguscf-p70", ["-boguscf", "-bcf_prob=70"]),
+    ("boguscf-p100", ["-boguscf", "-bcf_prob=100"]),
+    ("subobf-l1-p50", ["-subobf", "-sub_loop=1", "-sub_prob=50"]),
+    ("subobf-l1-p100", ["-subobf", "-sub_loop=1", "-sub_prob=100"]),
+    ("subobf-l3-p50", ["-subobf", "-sub_loop=3", "-sub_prob=50"]),
+    ("subobf-l3-p100", ["-subobf", "-sub_loop=3", "-sub_prob=100"]),
+    ("flattening", ["-flattening"]),
+    ("boguscf+subobf", ["-boguscf", "-subobf"]),
+    ("subobf+flattening", ["-subobf", "-flattening"]),
+    ("boguscf+subobf+flattening", ["-boguscf", "-subobf", "-flattening"]),
+    ("all", ["-obfstr", "-boguscf", "-subobf", "-flattening"]),
+]
+
+
+class StepError(Exception):
+    pass
+
+
+def run(cmd, **kwargs):
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True, **kwargs)
+    if proc.returncode != 0:
+        # The first diagnostic, without the crash report of LLVM
+        message = [line for line in proc.stderr.splitlines() if line.strip()
+                   and not re.match(r"PLEASE submit|Stack dump|\s*#?\d", line)]
+        raise StepError("%s failed: %s" % (os.path.basename(cmd[0]),
+                                           message[0] if message else
+                                           "exit code %d" % proc.returncode))
+    return proc.stdout
+
+
+def text_size(tools, obj):
+    """Size of the code sections of an object, from llvm-size -A."""
+    size = 0
+    for line in run([tools.size, "-A", obj]).splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and re.match(r"\.text(\.|$)", fields[0]):
+            size += int(fields[1])
+    return size
+
+
+def max_stack_size(tools, obj, tmp):
+    """Largest stack frame from the .stack_sizes section emitted by llc, or
+    None if it can not be read. Each entry is a function address followed
+    by its frame size in ULEB128."""
+    dump = os.path.join(tmp, "stack_sizes")
+    try:
+        run([tools.objcopy, "--dump-section", ".stack_sizes=" + dump, obj,
+             os.path.join(tmp, "stack_sizes.o")])
+    except StepError:
+        return None
+    with open(dump, "rb") as f:
+        data = f.read()
+    largest = 0
+    pos = 0
+    while pos + 8 < len(data):
+        pos += 8
+        value = shift = 0
+        while True:
+            byte = data[pos]
+            pos += 1
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            if byte < 0x80:
+                break
+        largest = max(largest, value)
+    return largest
+
+
+def instructions_retired(tools, exe, tmp):
+    """Instructions retired in user mode, or None without perf counters."""
+    if not tools.perf:
+        return None
+    out = os.path.join(tmp, "perf.csv")
+    try:
+        run([tools.perf, "stat", "-x", ",", "-e", "instructions:u", "-o", out,
+             "--", exe], stdin=subprocess.DEVNULL)
+    except StepError:
+        return None
+    with open(out) as f:
+        for line in f:
+            fields = line.split(",")
+            if len(fields) > 2 and fields[2].startswith("instructions"):
+                return int(fields[0]) if fields[0].isdigit() else None
+    return None
+
+
+def build(tools, args, bitcode, flags, tmp):
+    """Obfuscate, optimize and link the bitcode, return the object and the
+    executable."""
+    obf = os.path.join(tmp, "obf.bc")
+    opt = os.path.join(tmp, "opt.bc")
+    obj = os.path.join(tmp, "kernel.o")
+    exe = os.path.join(tmp, "kernel")
+    if flags:
+        run([tools.opt] + tools.legacy_pm + ["-load", args.plugin] + flags +
+            ["-obf-seed=%d" % args.seed, bitcode, "-o", obf])
+    else:
+        shutil.copy(bitcode, obf)
+    run([tools.opt, "-O2", obf, "-o", opt])
+    run([tools.llc, "-O2", "-filetype=obj", "-relocation-model=pic",
+         "-stack-size-section", opt, "-o", obj])
+    run([tools.cc, obj, args.encrypt, "-o", exe])
+    return obj, exe
+
+
+def measure(tools, args, bitcode, flags, tmp):
+    obj, exe = build(tools, args, bitcode, flags, tmp)
+    times = []
+    output = None
+    for _ in range(args.repeat):
+        start = time.perf_counter()
+        output = run([exe], stdin=subprocess.DEVNULL)
+        times.append(time.perf_counter() - start)
+    return {
+        "output": output,
+        "wall_time_s": statistics.median(times),
+        "instructions": instructions_retired(tools, exe, tmp),
+        "text_bytes": text_size(tools, obj),
+        "max_stack_bytes": max_stack_size(tools, obj, tmp),
+    }
+
+
+def ratio(value, base):
+    if value is None or not base:
+        return None
+    return round(value / base, 3)
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--plugin", required=True,
+                        help="path of libObfuscator.so")
+    parser.add_argument("--clang", default="clang")
+    parser.add_argument("--opt", default="opt")
+    parser.add_argument("--llc", default="llc")
+    parser.add_argument("--cc", default="cc",
+                        help="C compiler linking the kernels")
+    parser.add_argument("--llvm-size", default="llvm-size")
+    parser.add_argument("--llvm-objcopy", default="llvm-objcopy")
+    parser.add_argument("--perf", default=shutil.which("perf"))
+    parser.add_argument("--legacy-pm", action="store_true",
+                        help="opt needs -enable-new-pm=0 to load the plugin")
+    parser.add_argument("--kernels", default=os.path.join(here, "kernels"))
+    parser.add_argument("--encrypt",
+                        default=os.path.join(here, "..", "test", "encrypt.c"))
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs per build, the median is reported")
+    parser.add_argument("--seed", type=int, default=1,
+                        help="-obf-seed of the passes")
+    parser.add_argument("-k", "--kernel-filter", default="",
+                        help="only the kernels matching this regex")
+    parser.add_argument("-c", "--config-filter", default="",
+                        help="only the configurations matching this regex")
+    parser.add_argument("-o", "--output", default="-")
+    args = parser.parse_args()
+
+    class Tools:
+        clang = args.clang
+        opt = args.opt
+        llc = args.llc
+        cc = args.cc
+        size = args.llvm_size
+        objcopy = args.llvm_objcopy
+        perf = args.perf
+        legacy_pm = ["-enable-new-pm=0"] if args.legacy_pm else []
+
+    kernels = sorted(f for f in os.listdir(args.kernels) if f.endswith(".c")
+                     and re.search(args.kernel_filter, f))
+    configs = [c for c in CONFIGS
+               if c[0] == "baseline" or re.search(args.config_filter, c[0])]
+    results = []
+    for kernel in kernels:
+        with tempfile.TemporaryDirectory() as tmp:
+            # Unoptimized bitcode, so the passes see the code as written
+            bitcode = os.path.join(tmp, "kernel.bc")
+            try:
+                run([args.clang, "-O0", "-Xclang", "-disable-O0-optnone",
+                     "-emit-llvm", "-c", os.path.join(args.kernels, kernel),
+                     "-o", bitcode])
+            except StepError as e:
+                print("%s: %s" % (kernel, e), file=sys.stderr)
+                continue
+            base = None
+            for name, flags in configs:
+                result = {"kernel": os.path.splitext(kernel)[0],
+                          "config": name, "flags": flags}
+                try:
+                    m = measure(Tools, args, bitcode, flags, tmp)
+                except StepError as e:
+                    result["error"] = str(e)
+                    print("%s %s: %s" % (kernel, name, e), file=sys.stderr)
+                    results.append(result)
+                    continue
+                if base is None:
+                    base = m
+                result["output_matches"] = m["output"] == base["output"]
+                result.update((k, v) for k, v in m.items() if k != "output")
+                result["slowdown"] = ratio(m["wall_time_s"],
+                                           base["wall_time_s"])
+                result["instructions_ratio"] = ratio(m["instructions"],
+                                                     base["instructions"])
+                result["text_growth"] = ratio(m["text_bytes"],
+                                              base["text_bytes"])
+                results.append(result)
+                print("%-10s %-26s %8.3fs x%-7s .text %7d" %
+                      (kernel, name, m["wall_time_s"], result["slowdown"],
+                       m["text_bytes"]), file=sys.stderr)
+
+    report = {"seed": args.seed, "repeat": args.repeat, "results": results}
+    text = json.dumps(report, indent=2) + "\n"
+    if args.output == "-":
+        sys.stdout.write(text)
+    else:
+        with open(args.output, "w") as f:
+            f.write(text)
+    failed = [r for r in results
+              if "error" in r or not r.get("output_matches", True)]
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,29 +1,83 @@
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Timer.h"
 
+#include "Budget.h"
+#include "Hotness.h"
+#include "OpaquePredicate.h"
+#include "Passes.h"
+#include "Policy.h"
+#include "Profile.h"
+#include "Transforms.h"
+#include "Utils.h"
 #include <random>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "boguscf"
+
+STATISTIC(NumFunctions, "Number of functions with bogus control flow");
+STATISTIC(NumBlocksCloned, "Number of bogus blocks created");
+STATISTIC(NumInstructionsCloned, "Number of instructions cloned");
+STATISTIC(NumOpaquePredicates, "Number of opaque predicates inserted");
+
 static cl::opt<int>
     ObfProbRate("bcf_prob",
                 cl::desc("Choose the probability [%] each basic blocks will be "
                          "obfuscated by the -bcf pass"),
                 cl::value_desc("probability rate"), cl::init(70), cl::Optional);
 
-struct BongusFlowPass : public FunctionPass {
-  static char ID;
-  std::mt19937 rng;
+static cl::opt<unsigned> CloneSize(
+    "bcf_clone_size",
+    cl::desc("Clone at most this many instructions of a block into a bogus "
+             "block (0 clones the whole block)"),
+    cl::value_desc("instructions"), cl::init(0), cl::Optional);
+
+static cl::opt<unsigned> PoolSize(
+    "bcf_pool_size",
+    cl::desc("Share this many bogus blocks between the opaque predicates of "
+             "a function (0 gives each block its own)"),
+    cl::value_desc("blocks"), cl::init(0), cl::Optional);
+
+/// -bcf_prob, or its override for \p F.
+static unsigned getProbability(const Function &F) {
+  return obf::Policy::get().getValue(F, "bcf_prob",
+                                     std::max(ObfProbRate.getValue(), 0));
+}
+
+struct BogusFlow {
+  /// A bogus block shared by several opaque predicates, filled once they all
+  /// branch to it.
+  struct PoolEntry {
+    BasicBlock *Block;
+    /// The block it is cloned from, split in a head and a body
+    BasicBlock *Head;
+    BasicBlock *Body = nullptr;
+    /// Number of instructions of the body, before its predicate
+    unsigned BodySize = 0;
+  };
+
+  std::mt19937 &rng;
+  ArrayRef<BasicBlock *> blocks;
   SmallVector<unsigned int, 13> integerOp;
   SmallVector<unsigned int, 5> floatOp;
-  SmallVector<AllocaInst *, 0> allocaInsts;
+  SmallVector<PoolEntry, 8> pool;
+  unsigned clonedInstructions;
 
-  BongusFlowPass() : FunctionPass(ID), rng(std::random_device{}()) {
+  explicit BogusFlow(obf::TransformState &State)
+      : rng(State.RNG), blocks(State.Blocks) {
     integerOp = {Instruction::Add,  Instruction::Sub,  Instruction::Mul,
                  Instruction::UDiv, Instruction::SDiv, Instruction::URem,
                  Instruction::SRem, Instruction::Shl,  Instruction::LShr,
@@ -33,76 +87,226 @@ struct BongusFlowPass : public FunctionPass {
                Instruction::FDiv, Instruction::FRem};
   }
 
-  virtual bool runOnFunction(Function &F) {
-    // Put origin BB into vector.
-    SmallVector<BasicBlock *, 0> targetBasicBlocks;
-    for (BasicBlock &BB : F) {
-      targetBasicBlocks.emplace_back(&BB);
+  bool runOnFunction(Function &F, const obf::HotnessInfo &Hotness,
+                     const TargetTransformInfo &TTI,
+                     OptimizationRemarkEmitter &ORE) {
+    obf::PassPolicy policy = obf::Policy::get().lookup(F, DEBUG_TYPE);
+    if (!policy.Enabled) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "Disabled", &F)
+               << "no bogus control flow: disabled by "
+               << policy.getSourceName();
+      });
+      return false;
     }
-    // Put "alloca i32 ..." instruction into allocaInsts for further use
-    findAllocInst(F.getEntryBlock());
+    // Leave hot code alone, bogus branches in it cost too much.
+    if (Hotness.isHotFunction()) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "HotFunction", &F)
+               << "no bogus control flow: the function is hot";
+      });
+      return false;
+    }
+    unsigned instructionsBefore = obf::countInstructions(F, ORE, DEBUG_TYPE);
+    // Put origin BB into vector, with whether it runs at most once per call.
+    SmallVector<std::pair<BasicBlock *, bool>, 0> targetBasicBlocks;
+    for (BasicBlock *BB : blocks) {
+      if (!BB->isEHPad() && !Hotness.isHotBlock(BB)) {
+        targetBasicBlocks.emplace_back(BB, Hotness.isColdBlock(BB));
+      }
+    }
+    obf::OpaquePredicateBuilder predicates(F, TTI, rng);
+    // The pool blocks return, which a function that does not return can not
+    bool usePool = PoolSize != 0 && !F.doesNotReturn();
+    pool.clear();
+    clonedInstructions = 0;
     // Add bogus control flow to some BB.
-    for (BasicBlock *BB : targetBasicBlocks) {
-      if (rng() % 100 >= ObfProbRate) {
+    unsigned protectedBlocks = 0;
+    unsigned bogusBlocks = 0;
+    unsigned predicateCount = 0;
+    unsigned probability = getProbability(F);
+    for (auto &target : targetBasicBlocks) {
+      BasicBlock *BB = target.first;
+      if (rng() % 100 >= probability) {
         continue;
       }
-      BasicBlock *bogusBB = geneBogusFlow(BB, &F);
-      addBogusFlow(BB, bogusBB, &F);
+      BasicBlock *bogusBB;
+      PoolEntry *templateOf = nullptr;
+      if (!usePool) {
+        NamedRegionTimer timer("clone", "Clone the bogus blocks", DEBUG_TYPE,
+                               "Bogus control flow", TimePassesIsEnabled);
+        bogusBB = geneBogusFlow(BB, &F);
+        bogusBlocks++;
+      } else if (pool.size() < PoolSize) {
+        pool.push_back({BasicBlock::Create(F.getContext(), "bogusBlock", &F),
+                        BB});
+        templateOf = &pool.back();
+        bogusBB = templateOf->Block;
+        bogusBlocks++;
+      } else {
+        bogusBB = pool[rng() % pool.size()].Block;
+      }
+      NamedRegionTimer timer("predicate", "Insert the opaque predicates",
+                             DEBUG_TYPE, "Bogus control flow",
+                             TimePassesIsEnabled);
+      predicateCount +=
+          addBogusFlow(BB, bogusBB, predicates, target.second, templateOf);
+      protectedBlocks++;
     }
-    return true;
-  }
-
-  /// Put "alloca i32 ..." instruction into allocaInsts
-  /// \return the size of allocaInsts
-  int findAllocInst(BasicBlock &BB) {
-    Type *Int32Ty = Type::getInt32Ty(BB.getContext());
-    for (Instruction &inst : BB) {
-      if (AllocaInst *allocaInst = dyn_cast<AllocaInst>(&inst)) {
-        if (allocaInst->getAllocatedType() != Int32Ty) {
-          continue;
-        }
-        allocaInsts.emplace_back(allocaInst);
+    if (usePool) {
+      NamedRegionTimer timer("clone", "Clone the bogus blocks", DEBUG_TYPE,
+                             "Bogus control flow", TimePassesIsEnabled);
+      for (PoolEntry &entry : pool) {
+        fillPoolBlock(entry, predicates, F);
       }
     }
-    return allocaInsts.size();
+    NumFunctions++;
+    NumBlocksCloned += bogusBlocks;
+    NumInstructionsCloned += clonedInstructions;
+    NumOpaquePredicates += predicateCount;
+    ORE.emit([&]() {
+      OptimizationRemark remark(DEBUG_TYPE, "BogusFlow", &F);
+      remark << "added bogus control flow to "
+             << ore::NV("Blocks", protectedBlocks) << " of "
+             << ore::NV("Candidates", targetBasicBlocks.size())
+             << " blocks with " << ore::NV("Predicates", predicateCount)
+             << " opaque predicates and "
+             << ore::NV("BogusBlocks", bogusBlocks) << " bogus blocks of "
+             << ore::NV("ClonedInstructions", clonedInstructions)
+             << " instructions";
+      obf::addInstructionDelta(remark, F, instructionsBefore);
+      return remark;
+    });
+    return true;
   }
 
   /// Generate Bogus BasicBlock
   /// \param targetBB template BasicBlock
   /// \param F function
   BasicBlock *geneBogusFlow(BasicBlock *targetBB, Function *F) {
+    BasicBlock *bogusBB =
+        BasicBlock::Create(F->getContext(), "bogusBlock", F);
+    // The PHIs of the target block dominate its bogus block, which uses them
+    // instead of copies.
+    clonedInstructions +=
+        cloneWindow(targetBB->getFirstNonPHI()->getIterator(),
+                    targetBB->getTerminator()->getIterator(), bogusBB, nullptr);
+    modifyOperands(bogusBB);
+    return bogusBB;
+  }
+
+  /// Fill a bogus block of the pool with a copy of the start of the body of
+  /// its template block. The values it uses from outside the copy are merged
+  /// by PHIs: the template gives the real ones, the other blocks branching
+  /// to it give random ones. It returns from the function.
+  void fillPoolBlock(PoolEntry &entry, obf::OpaquePredicateBuilder &predicates,
+                     Function &F) {
+    BasicBlock *poolBB = entry.Block;
+    SmallSetVector<BasicBlock *, 8> preds(pred_begin(poolBB), pred_end(poolBB));
+    DenseMap<Value *, PHINode *> phis;
+    auto mapOutside = [&](Value *v) -> Value * {
+      PHINode *&phi = phis[v];
+      if (phi == nullptr) {
+        IRBuilder<> builder(poolBB, poolBB->begin());
+        phi = builder.CreatePHI(v->getType(), preds.size());
+        for (BasicBlock *pred : preds) {
+          bool fromTemplate = pred == entry.Head || pred == entry.Body;
+          phi->addIncoming(
+              fromTemplate ? v : getRandomValue(v->getType(), predicates),
+              pred);
+        }
+      }
+      return phi;
+    };
+    BasicBlock::iterator begin = entry.Body->begin();
+    clonedInstructions += cloneWindow(
+        begin, std::next(begin, entry.BodySize), poolBB, mapOutside);
+    modifyOperands(poolBB);
+
+    IRBuilder<> builder(poolBB);
+    Type *retTy = F.getReturnType();
+    if (retTy->isVoidTy()) {
+      builder.CreateRetVoid();
+      return;
+    }
+    Value *retValue = nullptr;
+    for (Instruction &inst : *poolBB) {
+      if (inst.getType() == retTy) {
+        retValue = &inst;
+      }
+    }
+    builder.CreateRet(retValue ? retValue
+                               : getRandomValue(retTy, predicates));
+  }
+
+  /// A constant of type \p ty which the optimizer can not prove undefined.
+  Value *getRandomValue(Type *ty, obf::OpaquePredicateBuilder &predicates) {
+    if (ty->isIntOrIntVectorTy()) {
+      return ConstantInt::get(ty, rng());
+    }
+    if (ty->isFPOrFPVectorTy()) {
+      return ConstantFP::get(ty, rng() % 1024);
+    }
+    // A null pointer would let the optimizer remove the edges passing it
+    if (ty->isPointerTy()) {
+      return ConstantExpr::getPointerBitCastOrAddrSpaceCast(
+          predicates.getSeedGlobal(), ty);
+    }
+    return UndefValue::get(ty);
+  }
+
+  /// Clone the instructions from \p begin to \p end at the end of \p dest,
+  /// at most -bcf_clone_size of them. The values used from outside the copy
+  /// are mapped by \p mapOutside, or used as they are if it is null.
+  /// \return the number of instructions cloned
+  unsigned cloneWindow(BasicBlock::iterator begin, BasicBlock::iterator end,
+                       BasicBlock *dest,
+                       function_ref<Value *(Value *)> mapOutside) {
     ValueToValueMapTy VMap;
-    const Twine &Name = "bogusBlock";
-    BasicBlock *bogusBB = CloneBasicBlock(targetBB, VMap, Name, F);
-    // Remap operands.
-    BasicBlock::iterator ji = targetBB->begin();
-    for (Instruction &i : *bogusBB) {
-      // Loop over the operands of the instruction
-      for (Use &opi : i.operands()) {
-        // get the value for the operand
-        Value *v = MapValue(opi, VMap, RF_None);
-        if (v != nullptr) {
-          opi = v;
+    unsigned count = 0;
+    for (auto it = begin; it != end; ++it) {
+      Instruction &inst = *it;
+      if (CloneSize != 0 && count == CloneSize) {
+        break;
+      }
+      if (isa<DbgInfoIntrinsic>(inst)) {
+        continue;
+      }
+      if (isa<PHINode>(inst) || inst.isEHPad() || inst.isTerminator()) {
+        break;
+      }
+      if (auto *call = dyn_cast<CallInst>(&inst)) {
+        if (call->isMustTailCall()) {
+          break;
         }
       }
-      // Remap phi nodes' incoming blocks.
-      if (PHINode *pn = dyn_cast<PHINode>(&i)) {
-        for (unsigned int j = 0, e = pn->getNumIncomingValues(); j != e; ++j) {
-          Value *v = MapValue(pn->getIncomingBlock(j), VMap, RF_None);
-          if (v != nullptr) {
-            pn->setIncomingBlock(j, cast<BasicBlock>(v));
-          }
+      // A token can not be merged by a PHI
+      if (mapOutside && any_of(inst.operand_values(), [&](Value *op) {
+            return isa<Instruction>(op) && !VMap.count(op) &&
+                   op->getType()->isTokenTy();
+          })) {
+        break;
+      }
+      Instruction *clone = inst.clone();
+      if (inst.hasName()) {
+        clone->setName(inst.getName() + "bogusBlock");
+      }
+      dest->getInstList().push_back(clone);
+      VMap[&inst] = clone;
+      for (Use &op : clone->operands()) {
+        if (Value *v = VMap.lookup(op.get())) {
+          op.set(v);
+        } else if (mapOutside && isa<Instruction>(op.get())) {
+          op.set(mapOutside(op.get()));
         }
       }
-      // Remap attached metadata.
-      SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
-      i.getAllMetadata(MDs);
-      // important for compiling with DWARF, using option -g.
-      i.setDebugLoc(ji->getDebugLoc());
-      ji++;
+      count++;
     }
+    return count;
+  }
 
-    // Modify some instruction's Operands
+  /// Modify some instruction's Operands
+  void modifyOperands(BasicBlock *bogusBB) {
     for (Instruction &i : *bogusBB) {
       if (!i.isBinaryOp()) {
         continue;
@@ -115,60 +319,163 @@ struct BongusFlowPass : public FunctionPass {
         i.setOperand(0, i.getOperand(rng() % numOperands));
       }
     }
-    return bogusBB;
   }
 
   /// Put target BasicBlock and Bogus Block together
-  void addBogusFlow(BasicBlock *targetBB, BasicBlock *bogusBB, Function *F) {
-    // Split the block
+  /// \param cold the block runs at most once per call, so it can afford the
+  /// costlier predicates and a second one at its end
+  /// \param templateOf the pool entry cloned from the block, if any
+  /// \return the number of opaque predicates added
+  unsigned addBogusFlow(BasicBlock *targetBB, BasicBlock *bogusBB,
+                        obf::OpaquePredicateBuilder &predicates, bool cold,
+                        PoolEntry *templateOf) {
+    // Split the block, the seed of the predicates stays before them
     BasicBlock *targetBodyBB;
-    if (targetBB->getFirstNonPHIOrDbgOrLifetime()) {
-      targetBodyBB =
-          targetBB->splitBasicBlock(targetBB->getFirstNonPHIOrDbgOrLifetime());
+    if (Instruction *splitPoint = targetBB->getFirstNonPHIOrDbgOrLifetime()) {
+      if (splitPoint == predicates.getSeedLoad()) {
+        splitPoint = splitPoint->getNextNode();
+      }
+      targetBodyBB = targetBB->splitBasicBlock(splitPoint);
     } else {
       targetBodyBB = targetBB->splitBasicBlock(targetBB->begin());
     }
 
-    // Modify the terminators to adjust the control flow.
-    bogusBB->getTerminator()->eraseFromParent();
+    // Modify the terminators to adjust the control flow. A bogus block of
+    // the pool gets its terminator when it is filled.
     targetBB->getTerminator()->eraseFromParent();
 
     // Add opaque predicate
-    // if (x * (x + 1) % 2 == 0)
     IRBuilder<> bogusCondBuilder(targetBB);
-    Value *loadInst;
-    if (allocaInsts.size() != 0) {
-      loadInst =
-          bogusCondBuilder.CreateLoad(allocaInsts[rng() % allocaInsts.size()]);
-    } else {
-      GlobalVariable *globalValue = new GlobalVariable(
-          *F->getParent(), bogusCondBuilder.getInt32Ty(), false,
-          GlobalValue::PrivateLinkage, bogusCondBuilder.getInt32(rng()));
-      loadInst = bogusCondBuilder.CreateLoad(globalValue);
-    }
-    Value *addInst =
-        bogusCondBuilder.CreateAdd(loadInst, bogusCondBuilder.getInt32(1));
-    Value *mulInst = bogusCondBuilder.CreateMul(loadInst, addInst);
-    Value *remainInst =
-        bogusCondBuilder.CreateSRem(mulInst, bogusCondBuilder.getInt32(2));
-    Value *trueCond =
-        bogusCondBuilder.CreateICmpEQ(remainInst, bogusCondBuilder.getInt32(0));
+    Value *trueCond = predicates.createTrue(bogusCondBuilder, {}, !cold);
+    if (obf::isProfiling()) {
+      obf::incrementCounter(bogusCondBuilder, obf::PredicateCounter,
+                            cold ? 2 : 1);
+    }
     bogusCondBuilder.CreateCondBr(trueCond, targetBodyBB, bogusBB);
-    BranchInst::Create(targetBodyBB, bogusBB);
+    if (pool.empty()) {
+      BranchInst::Create(targetBodyBB, bogusBB);
+    }
 
     // Split at this point (we only want the terminator in the second part)
     BasicBlock *targetBodyEndBB =
         targetBodyBB->splitBasicBlock(--targetBodyBB->end());
     // erase the terminator created when splitting.
     targetBodyBB->getTerminator()->eraseFromParent();
-    // We add at the end a new always true condition
+    if (templateOf != nullptr) {
+      templateOf->Body = targetBodyBB;
+      templateOf->BodySize = targetBodyBB->size();
+    }
+    // We add at the end an always true condition, a new one on the values
+    // of the block when it is cold.
     IRBuilder<> endCondBuilder(targetBodyBB, targetBodyBB->end());
-    Value *endCond =
-        endCondBuilder.CreateICmpEQ(remainInst, bogusCondBuilder.getInt32(0));
+    if (!cold) {
+      endCondBuilder.CreateCondBr(trueCond, targetBodyEndBB, bogusBB);
+      return 1;
+    }
+    SmallVector<Value *, 16> bodyValues;
+    for (Instruction &inst : *targetBodyBB) {
+      bodyValues.push_back(&inst);
+    }
+    Value *endCond = predicates.createTrue(endCondBuilder, bodyValues, false);
     endCondBuilder.CreateCondBr(endCond, targetBodyEndBB, bogusBB);
+    return 2;
+  }
+};
+
+/// A protected block runs its opaque predicate, about four operations, a
+/// compare and a branch, twice when it is cold. Its bogus block is never
+/// run, it only adds the cloned instructions, shared by the pool if any.
+obf::TransformCost
+obf::estimateBogusFlow(obf::FunctionCostModel &Model) {
+  obf::TransformCost Cost;
+  double prob = std::min(getProbability(Model.getFunction()), 100u) / 100.0;
+  unsigned predicate = 4 * Model.getArithmeticCost() +
+                       Model.getCompareCost() + Model.getBranchCost();
+  double predicates = 0;
+  double clones = 0;
+  unsigned candidates = 0;
+  for (const obf::BlockCost &block : Model.blocks()) {
+    if (block.BB->isEHPad()) {
+      continue;
+    }
+    unsigned count = block.Frequency <= 1 ? 2 : 1;
+    double body = block.Instructions - 1;
+    double cloned = CloneSize == 0 ? body : std::min<double>(CloneSize, body);
+    predicates += count * predicate;
+    clones += block.Size * cloned / block.Instructions + Model.getBranchCost();
+    Cost.Time += block.Frequency * count * predicate;
+    Cost.Coverage += block.Instructions;
+    candidates++;
+  }
+  // The pool shares the bogus blocks between the protected ones
+  double shared = 1;
+  if (PoolSize != 0 && candidates != 0) {
+    shared = std::min(1.0, PoolSize / (prob * candidates));
+  }
+  Cost.Size = prob * (predicates + clones * shared);
+  Cost.Time *= prob * Model.getCalls();
+  Cost.Coverage *= prob;
+  // A protected block runs as a head, its body and an end, each behind a
+  // predicate, next to its bogus copy
+  for (obf::BlockCost &block : Model.blocks()) {
+    if (block.BB->isEHPad()) {
+      continue;
+    }
+    unsigned count = block.Frequency <= 1 ? 2 : 1;
+    block.Size += prob * count * predicate;
+    block.Time += prob * count * predicate;
+    block.Blocks += 2 * prob;
+    block.DeadBlocks += prob * shared;
+  }
+  return Cost;
+}
+
+bool obf::addBogusFlow(Function &F, obf::TransformState &State,
+                       const obf::HotnessInfo &Hotness,
+                       const TargetTransformInfo &TTI,
+                       OptimizationRemarkEmitter &ORE) {
+  return BogusFlow(State).runOnFunction(F, Hotness, TTI, ORE);
+}
+
+PreservedAnalyses obf::BogusFlowPass::run(Function &F,
+                                          FunctionAnalysisManager &AM) {
+  obf::HotnessInfo Hotness(F, AM);
+  auto &TTI = AM.getResult<TargetIRAnalysis>(F);
+  auto &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+  obf::TransformState State;
+  State.reset(F, DEBUG_TYPE);
+  if (!obf::addBogusFlow(F, State, Hotness, TTI, ORE)) {
+    return PreservedAnalyses::all();
+  }
+  obf::finishProfile(F);
+  return PreservedAnalyses::none();
+}
+
+struct LegacyBogusFlowPass : public FunctionPass {
+  static char ID;
+  obf::TransformState State;
+
+  LegacyBogusFlowPass() : FunctionPass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    obf::HotnessInfo::getAnalysisUsage(AU);
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+  }
+
+  bool runOnFunction(Function &F) override {
+    obf::HotnessInfo Hotness(F, *this);
+    auto &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    auto &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+    State.reset(F, DEBUG_TYPE);
+    if (!obf::addBogusFlow(F, State, Hotness, TTI, ORE)) {
+      return false;
+    }
+    obf::finishProfile(F);
+    return true;
   }
 };
 
-char BongusFlowPass::ID = 1;
-static RegisterPass<BongusFlowPass> X("boguscf",
+char LegacyBogusFlowPass::ID = 1;
+static RegisterPass<LegacyBogusFlowPass> X("boguscf",
                                       "inserting bogus control flow");
\ No newline at end of file
@@ -0,0 +1,420 @@
+//===-- Budget.cpp - size and runtime budget of the passes ----------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+#include "Budget.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+
+#include "Hotness.h"
+#include "Passes.h"
+#include "Policy.h"
+#include "Utils.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "obfbudget"
+
+STATISTIC(NumAllocated, "Number of functions given to a pass by the budget");
+STATISTIC(NumSkipped, "Number of functions a pass skips for the budget");
+
+static cl::opt<unsigned> SizeBudget(
+    "obf-size-budget",
+    cl::desc("Let -obfbudget give the function passes at most this "
+             "percentage of the code size of the module (0 is unlimited)"),
+    cl::value_desc("percent"), cl::init(0), cl::Optional);
+
+static cl::opt<unsigned> TimeBudget(
+    "obf-time-budget",
+    cl::desc("Let -obfbudget give the function passes at most this "
+             "percentage of the estimated run time of the module (0 is "
+             "unlimited)"),
+    cl::value_desc("percent"), cl::init(0), cl::Optional);
+
+static cl::list<std::string> BudgetPasses(
+    "obf-budget-passes",
+    cl::desc("Passes sharing the budget of -obfbudget (default "
+             "subobf,boguscf,flattening)"),
+    cl::CommaSeparated, cl::value_desc("pass,..."));
+
+namespace {
+
+struct Estimator {
+  const char *Pass;
+  obf::TransformCost (*Estimate)(obf::FunctionCostModel &);
+};
+
+const Estimator Estimators[] = {
+    {"subobf", obf::estimateSubstitution},
+    {"boguscf", obf::estimateBogusFlow},
+    {"flattening", obf::estimateFlattening},
+};
+
+/// A pass on a function, which the allocator gives a share of the budget or
+/// not.
+struct Candidate {
+  Function *F;
+  /// Index of the pass in the planned ones
+  unsigned Step;
+  const char *Pass;
+  /// The estimate of the pass alone, then what it adds to the plan of the
+  /// function once allocated
+  obf::TransformCost Cost;
+  /// Coverage per unit of budget
+  double Density;
+  /// Enabled by an annotation or a policy rule, whatever its cost
+  bool Forced;
+  bool Allocated = false;
+};
+
+/// The passes allocated to a function so far, and what they cost together.
+struct FunctionPlan {
+  const obf::FunctionCostModel *Model;
+  /// Bit i is set for the i-th planned pass
+  unsigned Steps = 0;
+  obf::TransformCost Cost;
+};
+
+} // namespace
+
+/// Estimate the \p Steps of \p Planned on \p Model together, in order, each
+/// on the function as the ones before it leave it.
+static obf::TransformCost estimatePlan(const obf::FunctionCostModel &Model,
+                                       ArrayRef<const Estimator *> Planned,
+                                       unsigned Steps) {
+  obf::FunctionCostModel Chained = Model;
+  obf::TransformCost Total;
+  for (unsigned i = 0, e = Planned.size(); i != e; ++i) {
+    if (Steps & (1u << i)) {
+      obf::TransformCost Cost = Planned[i]->Estimate(Chained);
+      Total.Size += Cost.Size;
+      Total.Time += Cost.Time;
+      Total.Coverage += Cost.Coverage;
+    }
+  }
+  return Total;
+}
+
+/// LLVM 11 wrapped the entry count in an Optional.
+static Optional<uint64_t> getEntryCount(const Function &F) {
+#if LLVM_VERSION_MAJOR >= 11
+  if (auto Count = F.getEntryCount()) {
+    return Count->getCount();
+  }
+#else
+  auto Count = F.getEntryCount();
+  if (Count.hasValue()) {
+    return Count.getCount();
+  }
+#endif
+  return None;
+}
+
+static std::string getSkipAttribute(StringRef PassName) {
+  return ("obf-skip-" + PassName).str();
+}
+
+namespace obf {
+
+FunctionCostModel::FunctionCostModel(const Function &F,
+                                     BlockFrequencyInfo &BFI,
+                                     const TargetTransformInfo &TTI)
+    : F(F) {
+  double EntryFreq = std::max<uint64_t>(BFI.getEntryFreq(), 1);
+  for (const BasicBlock &BB : F) {
+    BlockCost Cost = {&BB, BFI.getBlockFreq(&BB).getFrequency() / EntryFreq,
+                      0, 0, 0};
+    for (const Instruction &I : BB) {
+      Cost.Size += toCost(
+          TTI.getInstructionCost(&I, TargetTransformInfo::TCK_CodeSize));
+      Cost.Time += toCost(TTI.getInstructionCost(
+          &I, TargetTransformInfo::TCK_RecipThroughput));
+      Cost.Instructions++;
+    }
+    Blocks.push_back(Cost);
+  }
+  // The passes add i32 arithmetic, compares and branches
+  Type *Int32Ty = Type::getInt32Ty(F.getContext());
+  ArithmeticCost =
+      std::max(1u, toCost(TTI.getArithmeticInstrCost(Instruction::Add,
+                                                     Int32Ty)));
+#if LLVM_VERSION_MAJOR >= 12
+  CompareCost = std::max(
+      1u, toCost(TTI.getCmpSelInstrCost(Instruction::ICmp, Int32Ty,
+                                        Type::getInt1Ty(F.getContext()),
+                                        CmpInst::BAD_ICMP_PREDICATE)));
+#else
+  CompareCost = std::max(
+      1u, toCost(TTI.getCmpSelInstrCost(Instruction::ICmp, Int32Ty,
+                                        Type::getInt1Ty(F.getContext()))));
+#endif
+  BranchCost = std::max(1u, toCost(TTI.getCFInstrCost(Instruction::Br)));
+}
+
+double FunctionCostModel::getSize() const {
+  double Size = 0;
+  for (const BlockCost &B : Blocks) {
+    Size += B.Size;
+  }
+  return Size;
+}
+
+double FunctionCostModel::getTime() const {
+  double Time = 0;
+  for (const BlockCost &B : Blocks) {
+    Time += B.Frequency * B.Time;
+  }
+  return Time * Calls;
+}
+
+bool isBudgetEnabled() { return SizeBudget != 0 || TimeBudget != 0; }
+
+bool isSkippedByBudget(const Function &F, StringRef PassName) {
+  return F.hasFnAttribute(getSkipAttribute(PassName));
+}
+
+} // namespace obf
+
+struct Budget {
+  std::vector<std::string> Passes;
+
+  bool runOnModule(Module &M,
+                   function_ref<BlockFrequencyInfo &(Function &)> GetBFI,
+                   function_ref<const TargetTransformInfo &(Function &)> GetTTI,
+                   ProfileSummaryInfo *PSI) {
+    if (!obf::isBudgetEnabled()) {
+      return false;
+    }
+    std::vector<const Estimator *> Planned = getEstimators();
+
+    // Measure the functions, and count the calls of each one from the
+    // frequencies of its direct call sites
+    std::vector<std::unique_ptr<obf::FunctionCostModel>> Models;
+    DenseMap<const Function *, double> CallSites;
+    for (Function &F : M) {
+      if (F.isDeclaration()) {
+        continue;
+      }
+      Models.push_back(
+          std::make_unique<obf::FunctionCostModel>(F, GetBFI(F), GetTTI(F)));
+      for (const obf::BlockCost &B : Models.back()->blocks()) {
+        for (const Instruction &I : *B.BB) {
+          if (auto *Call = dyn_cast<CallBase>(&I)) {
+            if (const Function *Callee = Call->getCalledFunction()) {
+              CallSites[Callee] += B.Frequency;
+            }
+          }
+        }
+      }
+    }
+    bool HasProfile = PSI != nullptr && PSI->hasProfileSummary();
+    double TotalSize = 0;
+    double TotalTime = 0;
+    for (auto &Model : Models) {
+      const Function &F = Model->getFunction();
+      Optional<uint64_t> Count = getEntryCount(F);
+      if (HasProfile && Count) {
+        Model->setCalls(*Count);
+      } else {
+        // The caller frequencies are per call of the caller, which is
+        // assumed to run once
+        Model->setCalls(std::max(1.0, CallSites.lookup(&F)));
+      }
+      TotalSize += Model->getSize();
+      TotalTime += Model->getTime();
+    }
+    double SizeLimit = TotalSize * SizeBudget / 100;
+    double TimeLimit = TotalTime * TimeBudget / 100;
+
+    std::vector<Candidate> Candidates;
+    DenseMap<Function *, FunctionPlan> Plans;
+    for (auto &Model : Models) {
+      Function &F = const_cast<Function &>(Model->getFunction());
+      Plans[&F].Model = Model.get();
+      for (unsigned Step = 0, e = Planned.size(); Step != e; ++Step) {
+        const Estimator *E = Planned[Step];
+        F.removeFnAttr(getSkipAttribute(E->Pass));
+        obf::PassPolicy Policy = obf::Policy::get().lookup(F, E->Pass);
+        if (!Policy.Enabled) {
+          continue;
+        }
+        // A pass with nothing to do alone stays a candidate, as the earlier
+        // passes may give it some: -boguscf splits the single block functions
+        obf::TransformCost Cost = estimatePlan(*Model, Planned, 1u << Step);
+        // The share of each budget the pass uses, a budget of 0 has none
+        double Share = 0;
+        if (SizeBudget != 0 && Cost.Size > 0) {
+          Share += Cost.Size / SizeLimit;
+        }
+        if (TimeBudget != 0 && Cost.Time > 0) {
+          Share += Cost.Time / TimeLimit;
+        }
+        double Density = Share == 0 ? HUGE_VAL : Cost.Coverage / Share;
+        Candidates.push_back(
+            {&F, Step, E->Pass, Cost, Density, Policy.isExplicit()});
+      }
+    }
+
+    // The forced candidates come first, then greedily the most coverage per
+    // unit of budget. The sort is stable so the plan only depends on the
+    // module. A candidate is charged what it adds to the passes its function
+    // already got, which grows with them: -flattening also flattens the
+    // blocks of -boguscf, which clones the substituted instructions.
+    std::stable_sort(Candidates.begin(), Candidates.end(),
+                     [](const Candidate &A, const Candidate &B) {
+                       if (A.Forced != B.Forced) {
+                         return A.Forced;
+                       }
+                       return A.Density > B.Density;
+                     });
+    double UsedSize = 0;
+    double UsedTime = 0;
+    for (Candidate &C : Candidates) {
+      FunctionPlan &Plan = Plans[C.F];
+      unsigned Steps = Plan.Steps | 1u << C.Step;
+      obf::TransformCost Cost = estimatePlan(*Plan.Model, Planned, Steps);
+      double Size = Cost.Size - Plan.Cost.Size;
+      double Time = Cost.Time - Plan.Cost.Time;
+      if (!C.Forced &&
+          ((SizeBudget != 0 && UsedSize + Size > SizeLimit) ||
+           (TimeBudget != 0 && UsedTime + Time > TimeLimit))) {
+        continue;
+      }
+      C.Allocated = true;
+      C.Cost.Size = Size;
+      C.Cost.Time = Time;
+      Plan.Steps = Steps;
+      Plan.Cost = Cost;
+      UsedSize += Size;
+      UsedTime += Time;
+    }
+    LLVM_DEBUG(dbgs() << "obfbudget: size " << UsedSize << " of "
+                      << SizeLimit << ", time " << UsedTime << " of "
+                      << TimeLimit << "\n");
+
+    for (Candidate &C : Candidates) {
+      if (C.Allocated) {
+        NumAllocated++;
+      } else {
+        C.F->addFnAttr(getSkipAttribute(C.Pass));
+        NumSkipped++;
+      }
+    }
+    emitRemarks(Candidates);
+    return !Candidates.empty();
+  }
+
+  /// The estimators of the passes sharing the budget.
+  std::vector<const Estimator *> getEstimators() const {
+    std::vector<std::string> Names = Passes;
+    if (Names.empty()) {
+      Names.assign(BudgetPasses.begin(), BudgetPasses.end());
+    }
+    // -obfuscate runs the three transforms
+    bool All = Names.empty() || is_contained(Names, "obfuscate");
+    std::vector<const Estimator *> Planned;
+    for (const Estimator &E : Estimators) {
+      if (All || is_contained(Names, E.Pass)) {
+        Planned.push_back(&E);
+      }
+    }
+    return Planned;
+  }
+
+  /// One remark per function with the passes it got and the ones it did
+  /// not, in the order of the candidates.
+  void emitRemarks(ArrayRef<Candidate> Candidates) {
+    DenseMap<Function *, SmallVector<const Candidate *, 3>> ByFunction;
+    SmallVector<Function *, 0> Order;
+    for (const Candidate &C : Candidates) {
+      auto &List = ByFunction[C.F];
+      if (List.empty()) {
+        Order.push_back(C.F);
+      }
+      List.push_back(&C);
+    }
+    for (Function *F : Order) {
+      OptimizationRemarkEmitter ORE(F);
+      ORE.emit([&]() {
+        OptimizationRemarkAnalysis Remark(DEBUG_TYPE, "Budget", F);
+        Remark << "budget";
+        for (const Candidate *C : ByFunction[F]) {
+          const char *Decision = C->Allocated ? "allocated" : "skipped";
+          if (C->Forced) {
+            Decision = "forced";
+          }
+          Remark << " " << C->Pass << ": " << Decision << " ("
+                 << ore::NV((Twine(C->Pass) + "Size").str(),
+                            int64_t(C->Cost.Size))
+                 << " size, "
+                 << ore::NV((Twine(C->Pass) + "Time").str(),
+                            int64_t(C->Cost.Time))
+                 << " time)";
+        }
+        return Remark;
+      });
+    }
+  }
+};
+
+PreservedAnalyses obf::BudgetPass::run(Module &M, ModuleAnalysisManager &AM) {
+  auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  auto GetBFI = [&](Function &F) -> BlockFrequencyInfo & {
+    return FAM.getResult<BlockFrequencyAnalysis>(F);
+  };
+  auto GetTTI = [&](Function &F) -> const TargetTransformInfo & {
+    return FAM.getResult<TargetIRAnalysis>(F);
+  };
+  Budget{Passes}.runOnModule(M, GetBFI, GetTTI,
+                             &AM.getResult<ProfileSummaryAnalysis>(M));
+  // Only function attributes change, which no analysis depends on
+  return PreservedAnalyses::all();
+}
+
+struct LegacyBudgetPass : public ModulePass {
+  static char ID;
+  Budget Impl;
+
+  explicit LegacyBudgetPass(std::vector<std::string> Passes = {})
+      : ModulePass(ID), Impl{std::move(Passes)} {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addRequired<ProfileSummaryInfoWrapperPass>();
+    AU.setPreservesAll();
+  }
+
+  bool runOnModule(Module &M) override {
+    auto GetBFI = [this](Function &F) -> BlockFrequencyInfo & {
+      return getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI();
+    };
+    auto GetTTI = [this](Function &F) -> const TargetTransformInfo & {
+      return getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    };
+    return Impl.runOnModule(M, GetBFI, GetTTI, obf::getProfileSummary(*this));
+  }
+};
+
+char LegacyBudgetPass::ID = 4;
+static RegisterPass<LegacyBudgetPass>
+    X("obfbudget", "Share a size and time budget between the passes");
+
+ModulePass *obf::createLegacyBudgetPass(std::vector<std::string> Passes) {
+  return new LegacyBudgetPass(std::move(Passes));
+}
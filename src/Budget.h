@@ -0,0 +1,122 @@
+//===-- Budget.h - size and runtime budget of the passes --------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Shares a code size and a runtime overhead budget between -flattening,
+/// -boguscf and -subobf.
+///
+/// The cost model measures each block with the TargetTransformInfo code size
+/// and reciprocal throughput of its instructions, and weights the latter by
+/// the block frequency and the number of calls of the function. Each pass
+/// estimates from it the code it would add to a function and the time it
+/// would add to a run of the module, with its own options.
+///
+/// The allocator then takes the (function, pass) pairs in decreasing order of
+/// protected instructions per unit of budget, while they fit, and marks the
+/// functions each pass must leave alone with an "obf-skip-<pass>" attribute.
+/// A pair costs what it adds to the passes the function already got, each
+/// pass estimated on the function as the passes before it leave it.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_BUDGET_H
+#define BABY_OBFUSCATOR_BUDGET_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Pass.h"
+#include <string>
+#include <vector>
+
+namespace obf {
+
+/// Cost of one block of the function before obfuscation, and of what the
+/// passes estimated so far make of it.
+struct BlockCost {
+  const llvm::BasicBlock *BB;
+  /// Expected executions per call of the function
+  double Frequency;
+  /// TTI code size of the instructions
+  double Size;
+  /// TTI reciprocal throughput of the instructions
+  double Time;
+  double Instructions;
+  /// Blocks it is split into, which run as often as it does
+  double Blocks = 1;
+  /// Blocks added for it which never run
+  double DeadBlocks = 0;
+};
+
+/// What a pass adds to one function.
+struct TransformCost {
+  /// Code size, in TTI units
+  double Size = 0;
+  /// Time per run of the module, in TTI units
+  double Time = 0;
+  /// Instructions of the function the pass protects
+  double Coverage = 0;
+};
+
+class FunctionCostModel {
+public:
+  FunctionCostModel(const llvm::Function &F, llvm::BlockFrequencyInfo &BFI,
+                    const llvm::TargetTransformInfo &TTI);
+
+  const llvm::Function &getFunction() const { return F; }
+  llvm::ArrayRef<BlockCost> blocks() const { return Blocks; }
+  llvm::MutableArrayRef<BlockCost> blocks() { return Blocks; }
+
+  /// Number of calls of the function per run of the module (default 1)
+  double getCalls() const { return Calls; }
+  void setCalls(double N) { Calls = N; }
+
+  /// Costs of the instructions the passes add
+  unsigned getArithmeticCost() const { return ArithmeticCost; }
+  unsigned getCompareCost() const { return CompareCost; }
+  unsigned getBranchCost() const { return BranchCost; }
+
+  /// Code size of the function
+  double getSize() const;
+  /// Time of the calls of the function per run of the module
+  double getTime() const;
+
+private:
+  const llvm::Function &F;
+  double Calls = 1;
+  llvm::SmallVector<BlockCost, 16> Blocks;
+  unsigned ArithmeticCost;
+  unsigned CompareCost;
+  unsigned BranchCost;
+};
+
+/// Estimates of each pass with its current options, defined with the pass.
+/// Each one then updates \p Model to the function as the pass leaves it, for
+/// the passes which run after it. They run in the order of -obfuscate:
+/// -subobf, which only reads the instructions of the blocks, -boguscf and
+/// -flattening.
+TransformCost estimateFlattening(FunctionCostModel &Model);
+TransformCost estimateBogusFlow(FunctionCostModel &Model);
+TransformCost estimateSubstitution(FunctionCostModel &Model);
+
+/// Is -obf-size-budget or -obf-time-budget given?
+bool isBudgetEnabled();
+
+/// Has the allocator left \p F out of the pass \p PassName?
+bool isSkippedByBudget(const llvm::Function &F, llvm::StringRef PassName);
+
+/// The legacy -obfbudget pass, sharing the budget between \p Passes, or
+/// between the passes of -obf-budget-passes when it is empty.
+llvm::ModulePass *
+createLegacyBudgetPass(std::vector<std::string> Passes = {});
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_BUDGET_H
@@ -1,134 +1,660 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
-#include "llvm/Transforms/Scalar.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
+#include "Budget.h"
+#include "Hotness.h"
+#include "Passes.h"
+#include "Policy.h"
+#include "Profile.h"
+#include "Transforms.h"
+#include "Utils.h"
+#include <algorithm>
+#include <numeric>
 #include <random>
 
 using namespace llvm;
 
-struct FlatteningPass : public FunctionPass {
-  static char ID;
-  std::mt19937 rng;
+#define DEBUG_TYPE "flattening"
 
-  FlatteningPass() : FunctionPass(ID), rng(std::random_device{}()) {}
+STATISTIC(NumFunctions, "Number of functions flattened");
+STATISTIC(NumDispatchers, "Number of dispatchers built");
+STATISTIC(NumBlocks, "Number of blocks dispatched");
+STATISTIC(NumSwitchCases, "Number of switch cases added");
+STATISTIC(NumIndirectTargets, "Number of indirect branch destinations added");
+STATISTIC(NumDemoted, "Number of values and PHIs demoted to stack slots");
+STATISTIC(NumKeptInMemory,
+          "Number of stack slots not promoted back, past -fla_phi_limit");
 
-  bool runOnFunction(Function &F) override {
+enum DispatchMode { SwitchDispatch, DenseDispatch, IndirectDispatch };
+
+static cl::opt<DispatchMode> Dispatch(
+    "fla_dispatch", cl::desc("Choose how -flattening dispatches the blocks"),
+    cl::values(clEnumValN(SwitchDispatch, "switch",
+                          "one switch on sparse random states (default)"),
+               clEnumValN(DenseDispatch, "dense",
+                          "one switch on dense encoded states, lowered to a "
+                          "jump table"),
+               clEnumValN(IndirectDispatch, "indirect",
+                          "each block jumps through an encoded table of "
+                          "block addresses")),
+    cl::init(SwitchDispatch), cl::Optional);
+
+static cl::opt<unsigned> IndirectTargets(
+    "fla_indirect_targets",
+    cl::desc("Add this many random decoy destinations to each indirectbr of "
+             "-fla_dispatch=indirect"),
+    cl::value_desc("blocks"), cl::init(4), cl::Optional);
+
+static cl::opt<bool> FlaReg2Mem(
+    "fla_reg2mem",
+    cl::desc("Demote the values and PHIs of flattened functions to memory "
+             "instead of rebuilding their SSA form"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<unsigned> PhiLimit(
+    "fla_phi_limit",
+    cl::desc("Rebuild the SSA form of a flattened function with at most this "
+             "many PHI incoming values at its dispatchers, the other values "
+             "stay in stack slots (0 is unlimited)"),
+    cl::value_desc("incoming values"), cl::init(50000), cl::Optional);
+
+enum LoopModeKind { FlattenLoops, KeepLoops, NestedLoops };
+
+static cl::opt<LoopModeKind> LoopMode(
+    "fla_loops", cl::desc("Choose how -flattening handles the loops"),
+    cl::values(clEnumValN(FlattenLoops, "flatten",
+                          "dispatch the loop blocks like the others (default)"),
+               clEnumValN(KeepLoops, "keep",
+                          "keep the innermost and small loops with their CFG, "
+                          "so they can still be optimized"),
+               clEnumValN(NestedLoops, "nested",
+                          "like keep, but flatten the body of each kept loop "
+                          "with its own dispatcher")),
+    cl::init(FlattenLoops), cl::Optional);
+
+static cl::opt<unsigned> LoopSize(
+    "fla_loop_size",
+    cl::desc("Loops of at most this many blocks are kept by -fla_loops"),
+    cl::init(8), cl::Optional);
+
+struct Flattening {
+  std::mt19937 &rng;
+  /// The dispatched blocks, filled once the other transforms are done
+  SmallVectorImpl<BasicBlock *> &originBB;
+  DominatorTree &dt;
+  /// The PHI incoming values a value promoted back to a register may need at
+  /// the dispatchers: one per edge into them.
+  uint64_t dispatchEdges = 0;
+
+  explicit Flattening(obf::TransformState &State)
+      : rng(State.RNG), originBB(State.Blocks), dt(State.DT) {}
+
+  bool runOnFunction(Function &F, const obf::HotnessInfo &Hotness,
+                     LoopInfo &LI, OptimizationRemarkEmitter &ORE) {
     // Only one BB in this Function
     if (F.size() <= 1) {
       return false;
     }
+    obf::PassPolicy policy = obf::Policy::get().lookup(F, DEBUG_TYPE);
+    if (!policy.Enabled) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "Disabled", &F)
+               << "not flattened: disabled by " << policy.getSourceName();
+      });
+      return false;
+    }
+    // Leave hot functions alone, and keep hot blocks out of the switch.
+    if (Hotness.isHotFunction()) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "HotFunction", &F)
+               << "not flattened: the function is hot";
+      });
+      return false;
+    }
+    for (BasicBlock &bb : F) {
+      if (isa<InvokeInst>(bb.getTerminator()) || hasCrossBlockToken(bb)) {
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "Unsupported", &F)
+                 << "not flattened: the function has an invoke or a token "
+                    "used across blocks";
+        });
+        return false;
+      }
+    }
+    unsigned instructionsBefore = obf::countInstructions(F, ORE, DEBUG_TYPE);
+
+    // Loops kept out of the function dispatcher
+    SmallVector<Loop *, 4> keptLoops;
+    if (LoopMode != FlattenLoops) {
+      for (Loop *L : LI) {
+        selectKeptLoops(L, keptLoops);
+      }
+    }
+    SmallPtrSet<BasicBlock *, 8> keptBB;
+    for (Loop *L : keptLoops) {
+      keptBB.insert(L->block_begin(), L->block_end());
+    }
 
     // Insert All BB into originBB
-    SmallVector<BasicBlock *, 0> originBB;
+    originBB.clear();
     for (BasicBlock &bb : F) {
-      originBB.emplace_back(&bb);
-      if (isa<InvokeInst>(bb.getTerminator())) {
-        return false;
+      if (&bb == &F.getEntryBlock() ||
+          (!keptBB.count(&bb) && !Hotness.isHotBlock(&bb))) {
+        originBB.emplace_back(&bb);
       }
     }
 
-    // Remove first BB
-    originBB.erase(originBB.begin());
+    // The blocks of each nested dispatcher: the blocks of a kept loop which
+    // are not in one of its subloops, except the header.
+    SmallVector<SmallVector<BasicBlock *, 0>, 4> loopBB;
+    if (LoopMode == NestedLoops) {
+      for (Loop *L : keptLoops) {
+        loopBB.emplace_back();
+        for (BasicBlock *bb : L->blocks()) {
+          if (bb != L->getHeader() && LI.getLoopFor(bb) == L &&
+              !Hotness.isHotBlock(bb)) {
+            loopBB.back().emplace_back(bb);
+          }
+        }
+      }
+    }
 
-    // If firstBB's terminator is BranchInst, then split into two blocks
-    BasicBlock *firstBB = &*F.begin();
-    Instruction *firstBBTerminator = firstBB->getTerminator();
-    if (isa<BranchInst>(firstBBTerminator) ||
-        isa<IndirectBrInst>(firstBBTerminator)) {
-      BasicBlock::iterator iter = firstBB->end();
-      if (firstBB->size() > 1) {
-        --iter;
+    // Flatten the function, then the body of the kept loops
+    unsigned dispatchers = 0;
+    size_t blocks = 0;
+    {
+      NamedRegionTimer timer("dispatch", "Build the dispatchers", DEBUG_TYPE,
+                             "Flattening", TimePassesIsEnabled);
+      BasicBlock *firstBB = &F.getEntryBlock();
+      originBB.erase(originBB.begin());
+      if (!originBB.empty()) {
+        flattenRegion(F, firstBB, originBB);
+        dispatchers++;
+        blocks += originBB.size();
+      }
+      for (size_t i = 0; i < loopBB.size(); i++) {
+        if (!loopBB[i].empty()) {
+          flattenRegion(F, keptLoops[i]->getHeader(), loopBB[i]);
+          dispatchers++;
+          blocks += loopBB[i].size();
+        }
       }
-      BasicBlock *tempBB = firstBB->splitBasicBlock(--iter);
-      originBB.insert(originBB.begin(), tempBB);
+    }
+    if (dispatchers == 0) {
+      return false;
+    }
+
+    {
+      NamedRegionTimer timer("ssa", "Rebuild the SSA form", DEBUG_TYPE,
+                             "Flattening", TimePassesIsEnabled);
+      if (FlaReg2Mem) {
+        demoteToMemory(F);
+      } else {
+        rebuildSSA(F);
+      }
+    }
+    NumFunctions++;
+    NumDispatchers += dispatchers;
+    NumBlocks += blocks;
+    ORE.emit([&]() {
+      OptimizationRemark remark(DEBUG_TYPE, "Flattened", &F);
+      remark << "flattened " << ore::NV("Blocks", blocks) << " blocks into "
+             << ore::NV("Dispatchers", dispatchers) << " dispatchers, "
+             << ore::NV("KeptLoops", keptLoops.size()) << " loops kept";
+      obf::addInstructionDelta(remark, F, instructionsBefore);
+      return remark;
+    });
+    return true;
+  }
+
+  /// Keep \p L with its CFG if it is innermost or small enough, otherwise
+  /// look at its subloops.
+  static void selectKeptLoops(Loop *L, SmallVectorImpl<Loop *> &keptLoops) {
+    if (L->getSubLoops().empty() || L->getNumBlocks() <= LoopSize) {
+      keptLoops.emplace_back(L);
+      return;
+    }
+    for (Loop *subLoop : *L) {
+      selectKeptLoops(subLoop, keptLoops);
+    }
+  }
+
+  /// Dispatch \p originBB from a dispatcher entered at the end of \p firstBB,
+  /// which dominates them.
+  void flattenRegion(Function &F, BasicBlock *firstBB,
+                     SmallVectorImpl<BasicBlock *> &originBB) {
+    // Split the terminator of firstBB, and the comparison feeding it, into
+    // the first dispatched block
+    BasicBlock::iterator iter = firstBB->getTerminator()->getIterator();
+    if (iter != firstBB->begin() && !isa<PHINode>(*std::prev(iter))) {
+      --iter;
+    }
+    BasicBlock *tempBB = firstBB->splitBasicBlock(iter);
+    originBB.insert(originBB.begin(), tempBB);
+    // The indirect jumps count their destinations themselves
+    if (Dispatch != IndirectDispatch) {
+      dispatchEdges += originBB.size();
     }
 
     // Remove firstBB
     firstBB->getTerminator()->eraseFromParent();
 
+    // Give every block a unique state number
+    DenseMap<BasicBlock *, ConstantInt *> stateOf;
+    IntegerType *int32Ty = Type::getInt32Ty(F.getContext());
+    uint32_t key = rng();
+    if (Dispatch == SwitchDispatch) {
+      // Sparse random numbers
+      DenseSet<uint32_t> used;
+      for (BasicBlock *bb : originBB) {
+        uint32_t state = rng();
+        while (!used.insert(state).second) {
+          state = rng();
+        }
+        stateOf[bb] = ConstantInt::get(int32Ty, state);
+      }
+    } else {
+      // Shuffled 0 .. N - 1 xor key, so the decoded states are dense
+      SmallVector<uint32_t, 0> numbers(originBB.size());
+      std::iota(numbers.begin(), numbers.end(), 0);
+      std::shuffle(numbers.begin(), numbers.end(), rng);
+      for (size_t i = 0; i < originBB.size(); i++) {
+        stateOf[originBB[i]] = ConstantInt::get(int32Ty, numbers[i] ^ key);
+      }
+    }
+
+    if (Dispatch == IndirectDispatch) {
+      buildIndirectDispatch(F, firstBB, originBB, stateOf, key);
+    } else {
+      buildSwitchDispatch(F, firstBB, originBB, stateOf, key);
+    }
+  }
+
+  /// Tokens can not go through PHIs nor memory.
+  static bool hasCrossBlockToken(const BasicBlock &bb) {
+    return any_of(bb, [&](const Instruction &inst) {
+      return inst.getType()->isTokenTy() && inst.isUsedOutsideOfBlock(&bb);
+    });
+  }
+
+  /// The blocks are now entered from the dispatcher, so their PHIs and the
+  /// values used in other blocks may be wrong. Demote only those to fresh
+  /// stack slots and promote the slots again, which inserts the PHIs needed
+  /// at the dispatcher and leaves the rest of the function in registers.
+  /// Each promoted slot may need a PHI incoming value per dispatched block, so
+  /// past -fla_phi_limit the remaining slots stay in memory like with
+  /// -fla_reg2mem.
+  void rebuildSSA(Function &F) {
+    BasicBlock *entry = &F.getEntryBlock();
+    Instruction *allocaPoint = &*entry->getFirstInsertionPt();
+    SmallVector<AllocaInst *, 0> slots;
+
+    // A PHI of a block with new predecessors becomes a variable assigned at
+    // the end of each of its old incoming blocks.
+    SmallVector<PHINode *, 0> brokenPHIs;
+    for (BasicBlock &bb : F) {
+      SmallPtrSet<BasicBlock *, 4> preds(pred_begin(&bb), pred_end(&bb));
+      for (PHINode &phi : bb.phis()) {
+        if (phi.getNumIncomingValues() != preds.size() ||
+            any_of(phi.blocks(),
+                   [&](BasicBlock *inBB) { return !preds.count(inBB); })) {
+          brokenPHIs.emplace_back(&phi);
+        }
+      }
+    }
+    for (PHINode *phi : brokenPHIs) {
+      // A PHI without uses, e.g. one of a -bcf_pool_size block, is erased
+      if (AllocaInst *slot = DemotePHIToStack(phi, allocaPoint)) {
+        slots.emplace_back(slot);
+      }
+    }
+    NumDemoted += brokenPHIs.size();
+
+    // Values whose definition does not dominate some uses any more.
+    dt.recalculate(F);
+    SmallVector<Instruction *, 0> values;
+    for (BasicBlock &bb : F) {
+      for (Instruction &inst : bb) {
+        if (any_of(inst.uses(),
+                   [&](const Use &use) { return !dt.dominates(&inst, use); })) {
+          values.emplace_back(&inst);
+        }
+      }
+    }
+    for (Instruction *inst : values) {
+      slots.emplace_back(DemoteRegToStack(*inst, false, allocaPoint));
+    }
+    NumDemoted += values.size();
+
+    if (PhiLimit != 0 && dispatchEdges != 0) {
+      uint64_t promoted = PhiLimit / dispatchEdges;
+      if (promoted < slots.size()) {
+        NumKeptInMemory += slots.size() - promoted;
+        slots.resize(promoted);
+      }
+    }
+    if (!slots.empty()) {
+      dt.recalculate(F);
+      PromoteMemToReg(slots, dt);
+    }
+  }
+
+  /// Fallback of -fla_reg2mem: demote the values used out of their block and
+  /// the PHIs to memory, like the reg2mem pass.
+  void demoteToMemory(Function &F) {
+    BasicBlock *entry = &F.getEntryBlock();
+    Instruction *allocaPoint = &*entry->getFirstInsertionPt();
+    SmallVector<Instruction *, 0> worklist;
+    for (BasicBlock &bb : F) {
+      for (Instruction &inst : bb) {
+        if (!(isa<AllocaInst>(inst) && inst.getParent() == entry) &&
+            inst.isUsedOutsideOfBlock(&bb)) {
+          worklist.emplace_back(&inst);
+        }
+      }
+    }
+    for (Instruction *inst : worklist) {
+      DemoteRegToStack(*inst, false, allocaPoint);
+    }
+    NumDemoted += worklist.size();
+    worklist.clear();
+    for (BasicBlock &bb : F) {
+      for (PHINode &phi : bb.phis()) {
+        worklist.emplace_back(&phi);
+      }
+    }
+    for (Instruction *phi : worklist) {
+      DemotePHIToStack(cast<PHINode>(phi), allocaPoint);
+    }
+    NumDemoted += worklist.size();
+  }
+
+  /// Compute the state of the next block at the end of \p bb.
+  /// \return the state, or nullptr if the terminator of \p bb must be kept
+  /// (it is not a branch, or it jumps to a block out of the dispatcher).
+  Value *getNextState(BasicBlock *bb, IRBuilder<> &builder,
+                      const DenseMap<BasicBlock *, ConstantInt *> &stateOf) {
+    BranchInst *terminator = dyn_cast<BranchInst>(bb->getTerminator());
+    if (terminator == nullptr ||
+        any_of(successors(bb),
+               [&](BasicBlock *succ) { return !stateOf.count(succ); })) {
+      return nullptr;
+    }
+    if (terminator->isUnconditional()) {
+      return stateOf.lookup(terminator->getSuccessor(0));
+    }
+    // Select the next BB to be executed
+    return builder.CreateSelect(terminator->getCondition(),
+                                stateOf.lookup(terminator->getSuccessor(0)),
+                                stateOf.lookup(terminator->getSuccessor(1)));
+  }
+
+  /// Dispatch every block through one switch in a loop. Each block jumps back
+  /// with the state of its successor, the state stays in a register.
+  void buildSwitchDispatch(Function &F, BasicBlock *firstBB,
+                           ArrayRef<BasicBlock *> originBB,
+                           const DenseMap<BasicBlock *, ConstantInt *> &stateOf,
+                           uint32_t key) {
     // Create main loop
     BasicBlock *loopEntry = BasicBlock::Create(F.getContext(), "Entry", &F);
     BasicBlock *loopEnd = BasicBlock::Create(F.getContext(), "End", &F);
     BasicBlock *swDefault = BasicBlock::Create(F.getContext(), "Default", &F);
-    // Create switch variable
     IRBuilder<> entryBuilder(firstBB, firstBB->end());
-    AllocaInst *swPtr = entryBuilder.CreateAlloca(entryBuilder.getInt32Ty());
-    StoreInst *storeRng =
-        entryBuilder.CreateStore(entryBuilder.getInt32(rng()), swPtr);
     entryBuilder.CreateBr(loopEntry);
-    // Create switch statement
+    // Create switch variable, let the first BB executed first
+    IRBuilder<> endBuilder(loopEnd);
+    PHINode *nextVar =
+        endBuilder.CreatePHI(endBuilder.getInt32Ty(), originBB.size());
+    endBuilder.CreateBr(loopEntry);
     IRBuilder<> swBuilder(loopEntry);
-    LoadInst *swVar = swBuilder.CreateLoad(swPtr);
-    SwitchInst *swInst = swBuilder.CreateSwitch(swVar, swDefault, 0);
-    BranchInst *dfTerminator = BranchInst::Create(loopEntry, swDefault);
-    BranchInst *toLoopEnd = BranchInst::Create(loopEntry, loopEnd);
+    PHINode *swVar = swBuilder.CreatePHI(swBuilder.getInt32Ty(), 3);
+    swVar->addIncoming(stateOf.lookup(originBB.front()), firstBB);
+    swVar->addIncoming(nextVar, loopEnd);
+    swVar->addIncoming(swVar, swDefault);
+    // Create switch statement
+    Value *swCond = swVar;
+    if (Dispatch == DenseDispatch) {
+      swCond = swBuilder.CreateXor(swVar, key);
+    }
+    if (obf::isProfiling()) {
+      obf::incrementCounter(swBuilder, obf::DispatchCounter);
+    }
+    SwitchInst *swInst =
+        swBuilder.CreateSwitch(swCond, swDefault, originBB.size());
+    BranchInst::Create(loopEntry, swDefault);
 
     // Put all BB into switch Instruction
     for (BasicBlock *bb : originBB) {
       bb->moveBefore(loopEnd);
-      swInst->addCase(swBuilder.getInt32(rng()), bb);
+      ConstantInt *state = stateOf.lookup(bb);
+      if (Dispatch == DenseDispatch) {
+        state = swBuilder.getInt32(state->getZExtValue() ^ key);
+      }
+      swInst->addCase(state, bb);
     }
+    NumSwitchCases += originBB.size();
 
     // Recalculate switch Instruction
     for (BasicBlock *bb : originBB) {
-      switch (bb->getTerminator()->getNumSuccessors()) {
-      case 0:
-        // No terminator
-        break;
-      case 1: {
-        // Terminator is a non-condition jump
-        Instruction *terminator = bb->getTerminator();
-        BasicBlock *sucessor = terminator->getSuccessor(0);
-        // Find sucessor's case condition
-        ConstantInt *caseNum = swInst->findCaseDest(sucessor);
-        if (caseNum == nullptr) {
-          caseNum = swBuilder.getInt32(rng());
-        }
-        // Connect this BB to sucessor
-        IRBuilder<> caseBuilder(bb, bb->end());
-        caseBuilder.CreateStore(caseNum, swPtr);
-        caseBuilder.CreateBr(loopEnd);
-        terminator->eraseFromParent();
-      } break;
-      case 2: {
-        // Terminator is a condition jump
-        Instruction *terminator = bb->getTerminator();
-        ConstantInt *trueCaseNum =
-            swInst->findCaseDest(terminator->getSuccessor(0));
-        ConstantInt *falseCaseNum =
-            swInst->findCaseDest(terminator->getSuccessor(1));
-        if (trueCaseNum == nullptr) {
-          trueCaseNum = swBuilder.getInt32(rng());
+      IRBuilder<> caseBuilder(bb->getTerminator());
+      Value *nextState = getNextState(bb, caseBuilder, stateOf);
+      if (nextState == nullptr) {
+        continue;
+      }
+      // Connect this BB to sucessor
+      nextVar->addIncoming(nextState, bb);
+      caseBuilder.CreateBr(loopEnd);
+      bb->getTerminator()->eraseFromParent();
+    }
+  }
+
+  /// Thread the dispatch: each block loads the address of its successor from
+  /// a table of encoded block addresses and jumps to it with an indirectbr,
+  /// so there is no shared dispatch block. The state stays in a register.
+  /// The table is indexed with a key loaded at run time, so the optimizer can
+  /// not resolve the jumps back into branches. Each indirectbr lists the real
+  /// successors of its block and -fla_indirect_targets random decoys.
+  void buildIndirectDispatch(
+      Function &F, BasicBlock *firstBB, ArrayRef<BasicBlock *> originBB,
+      const DenseMap<BasicBlock *, ConstantInt *> &stateOf, uint32_t key) {
+    LLVMContext &ctx = F.getContext();
+    Type *int8Ty = Type::getInt8Ty(ctx);
+    Type *int64Ty = Type::getInt64Ty(ctx);
+    // Entries are stored as blockaddress + offset
+    Constant *offset = ConstantInt::get(int64Ty, rng() & 0xffff);
+    SmallVector<Constant *, 0> entries(originBB.size());
+    for (BasicBlock *bb : originBB) {
+      uint32_t index = stateOf.lookup(bb)->getZExtValue() ^ key;
+      entries[index] = ConstantExpr::getGetElementPtr(
+          int8Ty, BlockAddress::get(&F, bb), offset);
+    }
+    ArrayType *tableTy = ArrayType::get(int8Ty->getPointerTo(), entries.size());
+    GlobalVariable *table = new GlobalVariable(
+        *F.getParent(), tableTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(tableTy, entries), F.getName() + ".dispatch");
+    // The key is read once per call, in the entry block
+    GlobalVariable *keyVar = new GlobalVariable(
+        *F.getParent(), Type::getInt32Ty(ctx), false,
+        GlobalValue::PrivateLinkage,
+        ConstantInt::get(Type::getInt32Ty(ctx), key), F.getName() + ".key");
+    BasicBlock *entryBB = &F.getEntryBlock();
+    IRBuilder<> keyBuilder(entryBB);
+    if (Instruction *entryTerminator = entryBB->getTerminator()) {
+      keyBuilder.SetInsertPoint(entryTerminator);
+    }
+    Value *runtimeKey =
+        keyBuilder.CreateLoad(keyVar->getValueType(), keyVar, true, "key");
+
+    // Jump from \p builder to the block of \p state, one of \p dests.
+    auto jumpTo = [&](IRBuilder<> &builder, Value *state,
+                      ArrayRef<BasicBlock *> dests) {
+      Value *index =
+          builder.CreateZExt(builder.CreateXor(state, runtimeKey), int64Ty);
+      Value *slot = builder.CreateInBoundsGEP(
+          tableTy, table, {ConstantInt::get(int64Ty, 0), index});
+      Value *entry = builder.CreateLoad(int8Ty->getPointerTo(), slot);
+      Value *addr =
+          builder.CreateGEP(int8Ty, entry, ConstantExpr::getNeg(offset));
+      if (obf::isProfiling()) {
+        obf::incrementCounter(builder, obf::DispatchCounter);
+      }
+      SmallPtrSet<BasicBlock *, 8> targets(dests.begin(), dests.end());
+      // Decoys, or all the other blocks when there are not enough of them
+      size_t decoys = std::min<size_t>(IndirectTargets,
+                                       originBB.size() - targets.size());
+      for (size_t added = 0; added < decoys;) {
+        if (targets.insert(originBB[rng() % originBB.size()]).second) {
+          added++;
         }
-        if (falseCaseNum == nullptr) {
-          falseCaseNum = swBuilder.getInt32(rng());
+      }
+      IndirectBrInst *br = builder.CreateIndirectBr(addr, targets.size());
+      // In block order, so the output does not depend on the pointers
+      for (BasicBlock *dest : originBB) {
+        if (targets.count(dest)) {
+          br->addDestination(dest);
         }
-        IRBuilder<> caseBuilder(bb, bb->end());
-        if (BranchInst *endBr = dyn_cast<BranchInst>(bb->getTerminator())) {
-          // Select the next BB to be executed
-          Value *selectInst = caseBuilder.CreateSelect(
-              endBr->getCondition(), trueCaseNum, falseCaseNum);
-          caseBuilder.CreateStore(selectInst, swPtr);
-          caseBuilder.CreateBr(loopEnd);
-          terminator->eraseFromParent();
+      }
+      NumIndirectTargets += targets.size();
+      dispatchEdges += targets.size();
+    };
+
+    IRBuilder<> entryBuilder(firstBB, firstBB->end());
+    jumpTo(entryBuilder, stateOf.lookup(originBB.front()), originBB.front());
+    for (BasicBlock *bb : originBB) {
+      Instruction *terminator = bb->getTerminator();
+      IRBuilder<> caseBuilder(terminator);
+      Value *nextState = getNextState(bb, caseBuilder, stateOf);
+      if (nextState == nullptr) {
+        continue;
+      }
+      SmallVector<BasicBlock *, 2> dests(successors(bb));
+      jumpTo(caseBuilder, nextState, dests);
+      terminator->eraseFromParent();
+    }
+  }
+};
+
+/// Each dispatched block updates the state and jumps to the dispatcher,
+/// which adds a case for it and jumps again. The kept loops and hot blocks
+/// are not known here, so all the blocks but the entry are counted.
+obf::TransformCost
+obf::estimateFlattening(obf::FunctionCostModel &Model) {
+  obf::TransformCost Cost;
+  const Function &F = Model.getFunction();
+  // The blocks the earlier passes split or added are flattened too
+  double pieces = 0;
+  for (const obf::BlockCost &block : Model.blocks()) {
+    pieces += block.Blocks + block.DeadBlocks;
+  }
+  if (pieces <= 1) {
+    return Cost;
+  }
+  for (const BasicBlock &bb : F) {
+    if (isa<InvokeInst>(bb.getTerminator()) ||
+        Flattening::hasCrossBlockToken(bb)) {
+      return Cost;
+    }
+  }
+  // Each block sets the state and goes back to the dispatcher, which compares
+  // the state to its case and branches to it, about two compares deep in the
+  // search tree of a switch. The states are 32-bit immediates, so setting and
+  // comparing one takes twice the code of an instruction. The values used in
+  // other blocks are stored to a stack slot and loaded again.
+  unsigned perBlockTime = 2 * Model.getArithmeticCost() +
+                          2 * Model.getBranchCost() + Model.getCompareCost();
+  unsigned perBlockSize = 4 * Model.getArithmeticCost() +
+                          3 * Model.getBranchCost() +
+                          4 * Model.getCompareCost();
+  for (obf::BlockCost &block : Model.blocks()) {
+    unsigned escaping = 0;
+    for (const Instruction &inst : *block.BB) {
+      for (const User *user : inst.users()) {
+        if (cast<Instruction>(user)->getParent() != block.BB ||
+            isa<PHINode>(user)) {
+          escaping++;
+          break;
         }
-      } break;
       }
     }
+    // The entry block stays in front of the dispatcher
+    bool entry = block.BB == &F.getEntryBlock();
+    double running = block.Blocks - entry;
+    double flattened = running + block.DeadBlocks;
+    double demoted = 2 * escaping + block.Blocks - 1;
+    double size =
+        flattened * perBlockSize + demoted * Model.getArithmeticCost();
+    double time = running * perBlockTime + demoted * Model.getArithmeticCost();
+    Cost.Size += size;
+    Cost.Time += block.Frequency * time;
+    if (!entry) {
+      Cost.Coverage += block.Instructions;
+    }
+    block.Size += size;
+    block.Time += time;
+  }
+  Cost.Time *= Model.getCalls();
+  return Cost;
+}
+
+bool obf::flatten(Function &F, obf::TransformState &State,
+                  const obf::HotnessInfo &Hotness, LoopInfo &LI,
+                  OptimizationRemarkEmitter &ORE) {
+  return Flattening(State).runOnFunction(F, Hotness, LI, ORE);
+}
+
+PreservedAnalyses obf::FlatteningPass::run(Function &F,
+                                           FunctionAnalysisManager &AM) {
+  obf::HotnessInfo Hotness(F, AM);
+  LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+  auto &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+  obf::TransformState State;
+  State.reset(F, DEBUG_TYPE);
+  if (!obf::flatten(F, State, Hotness, LI, ORE)) {
+    return PreservedAnalyses::all();
+  }
+  obf::finishProfile(F);
+  return PreservedAnalyses::none();
+}
+
+struct LegacyFlatteningPass : public FunctionPass {
+  static char ID;
+  obf::TransformState State;
+
+  LegacyFlatteningPass() : FunctionPass(ID) {}
 
-    // Set swVar's origin value, let the first BB executed first
-    ConstantInt *caseCond = swInst->findCaseDest(*originBB.begin());
-    storeRng->setOperand(0, caseCond);
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    obf::HotnessInfo::getAnalysisUsage(AU);
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+  }
 
-    // Demote register and phi to memory
-    FunctionPass *reg2memPass = createDemoteRegisterToMemoryPass();
-    reg2memPass->runOnFunction(F);
+  bool runOnFunction(Function &F) override {
+    obf::HotnessInfo Hotness(F, *this);
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    auto &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+    State.reset(F, DEBUG_TYPE);
+    if (!obf::flatten(F, State, Hotness, LI, ORE)) {
+      return false;
+    }
+    obf::finishProfile(F);
     return true;
   }
 };
 
-char FlatteningPass::ID = 3;
-static RegisterPass<FlatteningPass> X("flattening", "Call graph flattening");
\ No newline at end of file
+char LegacyFlatteningPass::ID = 3;
+static RegisterPass<LegacyFlatteningPass> X("flattening", "Call graph flattening");
\ No newline at end of file
@@ -0,0 +1,372 @@
+//===-- FunctionCache.cpp - on-disk cache of obfuscated functions ---------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+#include "FunctionCache.h"
+#include "OpaquePredicate.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+/// Debug info refers to metadata shared by the whole compile unit, which an
+/// entry can not hold.
+static bool hasDebugInfo(const Function &F) {
+  if (F.getSubprogram() != nullptr) {
+    return true;
+  }
+  for (const Instruction &I : instructions(F)) {
+    if (I.getDebugLoc() || isa<DbgInfoIntrinsic>(I)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// A global created by the passes for a function is copied in its entry,
+/// the other globals are referred to by name.
+static bool isOwned(const GlobalValue *GV, const StringSet<> *InputGlobals) {
+  return InputGlobals != nullptr && isa<GlobalVariable>(GV) &&
+         GV->hasLocalLinkage() && !InputGlobals->count(GV->getName());
+}
+
+/// Collect the globals used by \p F, and by the initializers of the owned
+/// ones. \return false if one of them can not be referred to by name.
+static bool collectGlobals(const Function &F, const StringSet<> *InputGlobals,
+                           SetVector<GlobalValue *> &Globals) {
+  SmallVector<const Value *, 16> Worklist;
+  SmallPtrSet<const Value *, 16> Visited;
+  for (const Instruction &I : instructions(F)) {
+    for (const Value *Op : I.operand_values()) {
+      if (const auto *MD = dyn_cast<MetadataAsValue>(Op)) {
+        if (const auto *VMD = dyn_cast<ValueAsMetadata>(MD->getMetadata())) {
+          Op = VMD->getValue();
+        }
+      }
+      Worklist.push_back(Op);
+    }
+  }
+  if (F.hasPersonalityFn()) {
+    Worklist.push_back(F.getPersonalityFn());
+  }
+  while (!Worklist.empty()) {
+    const Value *V = Worklist.pop_back_val();
+    if (!isa<Constant>(V) || V == &F || !Visited.insert(V).second) {
+      continue;
+    }
+    if (const auto *GV = dyn_cast<GlobalValue>(V)) {
+      if (!GV->hasName()) {
+        return false;
+      }
+      Globals.insert(const_cast<GlobalValue *>(GV));
+      const auto *Var = dyn_cast<GlobalVariable>(GV);
+      if (isOwned(GV, InputGlobals) && Var->hasInitializer()) {
+        Worklist.push_back(Var->getInitializer());
+      }
+    } else if (const auto *BA = dyn_cast<BlockAddress>(V)) {
+      if (BA->getFunction() != &F) {
+        return false;
+      }
+    } else {
+      for (const Value *Op : cast<Constant>(V)->operand_values()) {
+        Worklist.push_back(Op);
+      }
+    }
+  }
+  return true;
+}
+
+/// Copy \p F in a module of its own. The globals it uses are declared, except
+/// the owned ones which are copied.
+/// \return nullptr if \p F can not be cached.
+static std::unique_ptr<Module> extractFunction(const Function &F,
+                                               const StringSet<> *InputGlobals) {
+  SetVector<GlobalValue *> Globals;
+  if (hasDebugInfo(F) || F.hasPrefixData() || F.hasPrologueData() ||
+      !collectGlobals(F, InputGlobals, Globals)) {
+    return nullptr;
+  }
+  const Module &M = *F.getParent();
+  std::unique_ptr<Module> Entry(new Module(F.getName(), F.getContext()));
+  Entry->setDataLayout(M.getDataLayout());
+  Entry->setTargetTriple(M.getTargetTriple());
+
+  ValueToValueMapTy VMap;
+  Function *NewF =
+      Function::Create(F.getFunctionType(), GlobalValue::ExternalLinkage,
+                       F.getAddressSpace(), F.getName(), Entry.get());
+  VMap[&F] = NewF;
+  SmallVector<std::pair<GlobalVariable *, GlobalVariable *>, 4> Owned;
+  for (GlobalValue *GV : Globals) {
+    GlobalValue *NewGV;
+    if (isOwned(GV, InputGlobals)) {
+      GlobalVariable *Var = cast<GlobalVariable>(GV);
+      GlobalVariable *NewVar = new GlobalVariable(
+          *Entry, Var->getValueType(), Var->isConstant(), Var->getLinkage(),
+          nullptr, Var->getName(), nullptr, Var->getThreadLocalMode(),
+          Var->getAddressSpace());
+      NewVar->copyAttributesFrom(Var);
+      Owned.emplace_back(Var, NewVar);
+      NewGV = NewVar;
+    } else if (auto *FTy = dyn_cast<FunctionType>(GV->getValueType())) {
+      NewGV = Function::Create(FTy, GlobalValue::ExternalLinkage,
+                               GV->getAddressSpace(), GV->getName(),
+                               Entry.get());
+    } else {
+      NewGV = new GlobalVariable(*Entry, GV->getValueType(), false,
+                                 GlobalValue::ExternalLinkage, nullptr,
+                                 GV->getName(), nullptr,
+                                 GV->getThreadLocalMode(),
+                                 GV->getAddressSpace());
+    }
+    // The linker would merge it with the one of the module
+    NewGV->setUnnamedAddr(GV->getUnnamedAddr());
+    VMap[GV] = NewGV;
+  }
+
+  Function::arg_iterator NewArg = NewF->arg_begin();
+  for (const Argument &Arg : F.args()) {
+    NewArg->setName(Arg.getName());
+    VMap[&Arg] = &*NewArg++;
+  }
+  SmallVector<ReturnInst *, 4> Returns;
+#if LLVM_VERSION_MAJOR >= 13
+  CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule,
+                    Returns);
+  // Always created, the reader would warn about debug info without version
+  if (NamedMDNode *CUs = Entry->getNamedMetadata("llvm.dbg.cu")) {
+    Entry->eraseNamedMetadata(CUs);
+  }
+#else
+  CloneFunctionInto(NewF, &F, VMap, true, Returns);
+#endif
+  for (auto &Var : Owned) {
+    if (Var.first->hasInitializer()) {
+      Var.second->setInitializer(MapValue(Var.first->getInitializer(), VMap));
+    }
+  }
+  return Entry;
+}
+
+/// Whether \p GV, a global an entry owns, is a copy of \p Dest, the global of
+/// the same name in the module. The functions of a module share the seed of
+/// the opaque predicates, so each of their entries has a copy of it.
+static bool isSharedCopy(const GlobalValue &GV, const GlobalValue &Dest) {
+  const auto *Var = dyn_cast<GlobalVariable>(&GV);
+  const auto *DestVar = dyn_cast<GlobalVariable>(&Dest);
+  return Var != nullptr && DestVar != nullptr &&
+         Var->getName() == obf::SeedGlobalName && DestVar->hasInitializer() &&
+         Var->getInitializer() == DestVar->getInitializer();
+}
+
+/// Put the functions and the global variables of \p M back in the order they
+/// had before the cached functions were linked, \p Functions and
+/// \p Variables. The variables the passes created follow, in the order the
+/// functions use them, so that they do not depend on which functions were
+/// cached.
+static void restoreOrder(Module &M, ArrayRef<std::string> Functions,
+                         ArrayRef<std::string> Variables,
+                         const StringSet<> &InputGlobals) {
+  SetVector<Function *> FunctionOrder;
+  for (const std::string &Name : Functions) {
+    if (Function *F = M.getFunction(Name)) {
+      FunctionOrder.insert(F);
+    }
+  }
+  for (Function &F : M) {
+    FunctionOrder.insert(&F);
+  }
+  SetVector<GlobalVariable *> VariableOrder;
+  for (const std::string &Name : Variables) {
+    if (GlobalVariable *GV = M.getNamedGlobal(Name)) {
+      VariableOrder.insert(GV);
+    }
+  }
+  for (Function *F : FunctionOrder) {
+    SetVector<GlobalValue *> Used;
+    collectGlobals(*F, &InputGlobals, Used);
+    for (GlobalValue *GV : Used) {
+      if (isOwned(GV, &InputGlobals)) {
+        VariableOrder.insert(cast<GlobalVariable>(GV));
+      }
+    }
+  }
+  for (GlobalVariable &GV : M.globals()) {
+    VariableOrder.insert(&GV);
+  }
+
+  for (Function *F : FunctionOrder) {
+    M.getFunctionList().splice(M.end(), M.getFunctionList(), F);
+  }
+  for (GlobalVariable *GV : VariableOrder) {
+    M.getGlobalList().splice(M.global_end(), M.getGlobalList(), GV);
+  }
+}
+
+namespace obf {
+
+FunctionCache::FunctionCache(StringRef Dir, StringRef Options)
+    : Dir(Dir), Options(Options) {}
+
+std::string FunctionCache::getPath(StringRef Key) const {
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, Key + ".bc");
+  return Path.str().str();
+}
+
+FunctionCache::Lookup FunctionCache::lookup(Module &M) const {
+  Lookup L;
+  for (GlobalValue &GV : M.global_values()) {
+    if (GV.hasName()) {
+      L.Globals.insert(GV.getName());
+    }
+  }
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    std::unique_ptr<Module> Entry = extractFunction(F, nullptr);
+    if (!Entry) {
+      continue;
+    }
+    std::string Text;
+    raw_string_ostream OS(Text);
+    Entry->print(OS, nullptr);
+    OS << Options;
+    MD5 Hash;
+    Hash.update(OS.str());
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Key;
+    MD5::stringifyResult(Result, Key);
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+        MemoryBuffer::getFile(getPath(Key));
+    Expected<std::unique_ptr<Module>> Cached =
+        Buffer ? parseBitcodeFile((*Buffer)->getMemBufferRef(), M.getContext())
+               : errorCodeToError(Buffer.getError());
+    if (!Cached) {
+      // Missing or unreadable, obfuscate it and store it again
+      consumeError(Cached.takeError());
+      L.Keys[F.getName()] = std::string(Key.str());
+      continue;
+    }
+    Lookup::Hit H;
+    H.Name = F.getName().str();
+    H.Entry = std::move(*Cached);
+    H.Linkage = F.getLinkage();
+    H.Visibility = F.getVisibility();
+    if (const Comdat *C = F.getComdat()) {
+      H.ComdatName = C->getName().str();
+      H.ComdatKind = C->getSelectionKind();
+    }
+    L.Hits.emplace_back(std::move(H));
+    F.deleteBody();
+    F.setComdat(nullptr);
+  }
+  return L;
+}
+
+void FunctionCache::update(Module &M, Lookup &L) const {
+  for (Function &F : M) {
+    auto It = L.Keys.find(F.getName());
+    if (F.isDeclaration() || It == L.Keys.end()) {
+      continue;
+    }
+    std::unique_ptr<Module> Entry = extractFunction(F, &L.Globals);
+    if (!Entry) {
+      continue;
+    }
+    // Write a temporary file and rename it, so that concurrent builds never
+    // read a partial entry
+    std::string Path = getPath(It->second);
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(Path + ".%%%%%%", FD, TempPath)) {
+      continue;
+    }
+    {
+      raw_fd_ostream OS(FD, true);
+      WriteBitcodeToFile(*Entry, OS);
+    }
+    if (sys::fs::rename(TempPath, Path)) {
+      sys::fs::remove(TempPath);
+    }
+  }
+
+  // Linking moves the functions found and the globals they use
+  std::vector<std::string> Functions, Variables;
+  for (Function &F : M) {
+    Functions.push_back(F.getName().str());
+  }
+  for (GlobalVariable &GV : M.globals()) {
+    if (L.Globals.count(GV.getName())) {
+      Variables.push_back(GV.getName().str());
+    }
+  }
+
+  // The linker only resolves the declarations of the entries to local
+  // symbols while they are external. The entries are linked one at a time,
+  // so that a global shared by the functions of the module is only linked
+  // from the first entry which has it.
+  SmallVector<std::pair<GlobalValue *, GlobalValue::LinkageTypes>, 16> Locals;
+  for (Lookup::Hit &H : L.Hits) {
+    for (GlobalValue &GV : H.Entry->global_values()) {
+      GlobalValue *Dest = M.getNamedValue(GV.getName());
+      if (Dest == nullptr || !Dest->hasLocalLinkage()) {
+        continue;
+      }
+      if (!GV.isDeclaration() && !L.Globals.count(GV.getName()) &&
+          isSharedCopy(GV, *Dest)) {
+        auto &Var = cast<GlobalVariable>(GV);
+        Var.setInitializer(nullptr);
+        Var.setLinkage(GlobalValue::ExternalLinkage);
+      }
+      if (GV.isDeclaration()) {
+        Locals.emplace_back(Dest, Dest->getLinkage());
+        Dest->setLinkage(GlobalValue::ExternalLinkage);
+        Dest->setVisibility(GlobalValue::HiddenVisibility);
+      }
+    }
+    if (Linker::linkModules(M, std::move(H.Entry))) {
+      report_fatal_error(Twine("cannot link the cached function ") + H.Name);
+    }
+    for (auto &Local : Locals) {
+      Local.first->setVisibility(GlobalValue::DefaultVisibility);
+      Local.first->setLinkage(Local.second);
+    }
+    Locals.clear();
+  }
+  for (Lookup::Hit &H : L.Hits) {
+    Function *F = M.getFunction(H.Name);
+    F->setVisibility(H.Visibility);
+    F->setLinkage(H.Linkage);
+    if (!H.ComdatName.empty()) {
+      Comdat *C = M.getOrInsertComdat(H.ComdatName);
+      C->setSelectionKind(H.ComdatKind);
+      F->setComdat(C);
+    }
+  }
+  restoreOrder(M, Functions, Variables, L.Globals);
+  L.Hits.clear();
+}
+
+} // namespace obf
@@ -0,0 +1,78 @@
+//===-- FunctionCache.h - on-disk cache of obfuscated functions -*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Cache of obf-parallel. An entry holds the bitcode of one obfuscated
+/// function, named after the hash of the function before obfuscation and of
+/// the options, so incremental builds only obfuscate the changed functions.
+/// Functions with debug info are not cached.
+///
+/// A module is looked up before it is obfuscated and updated after, which
+/// stores the new functions and puts back the functions found.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_FUNCTIONCACHE_H
+#define BABY_OBFUSCATOR_FUNCTIONCACHE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/Comdat.h"
+#include "llvm/IR/Module.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace obf {
+
+class FunctionCache {
+public:
+  /// \p Options identifies the passes to run and their options, seed
+  /// included.
+  FunctionCache(llvm::StringRef Dir, llvm::StringRef Options);
+
+  /// The functions of a module found in the cache, and the keys of the
+  /// others.
+  class Lookup {
+    friend class FunctionCache;
+
+    struct Hit {
+      std::string Name;
+      std::unique_ptr<llvm::Module> Entry;
+      llvm::GlobalValue::LinkageTypes Linkage;
+      llvm::GlobalValue::VisibilityTypes Visibility;
+      /// Empty when the function is not in a comdat
+      std::string ComdatName;
+      llvm::Comdat::SelectionKind ComdatKind;
+    };
+
+    /// Names of the globals before obfuscation
+    llvm::StringSet<> Globals;
+    /// Keys of the functions to store, by name
+    llvm::StringMap<std::string> Keys;
+    std::vector<Hit> Hits;
+  };
+
+  /// Look up the functions defined in \p M. The functions found are turned
+  /// into declarations, so they are not obfuscated again.
+  Lookup lookup(llvm::Module &M) const;
+
+  /// Store the functions of \p M obfuscated since \p L was looked up, and
+  /// put back the functions found, in the order of \p M. Modules can be
+  /// updated concurrently.
+  void update(llvm::Module &M, Lookup &L) const;
+
+private:
+  std::string getPath(llvm::StringRef Key) const;
+
+  std::string Dir;
+  std::string Options;
+};
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_FUNCTIONCACHE_H
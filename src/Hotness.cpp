@@ -0,0 +1,151 @@
+//===-- Hotness.cpp - hot code detection ----------------------------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+#include "Hotness.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSummaryIndex.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned> HotThreshold(
+    "obf-hot-threshold",
+    cl::desc("Leave alone the blocks expected to run at least this many times "
+             "per call of their function (0 disables the static estimate)"),
+    cl::value_desc("times per call"), cl::init(0), cl::Optional);
+
+static cl::opt<bool> UseProfile(
+    "obf-use-profile",
+    cl::desc("Leave alone the functions and blocks which are hot in the "
+             "profile, when the module has one"),
+    cl::init(true), cl::Optional);
+
+static cl::opt<std::string> SummaryIndex(
+    "obf-thinlto-index",
+    cl::desc("Leave alone the functions called from hot call sites in the "
+             "call graph of this ThinLTO summary index"),
+    cl::value_desc("filename"));
+
+/// Is the call \p Edge hot? The summary has the profile hotness of the calls,
+/// and their frequency relative to the entry of the caller when the thin link
+/// wrote it (-write-relbf-to-summary).
+static bool isHotEdge(const CalleeInfo &Edge) {
+  if (UseProfile && (Edge.getHotness() == CalleeInfo::HotnessType::Hot ||
+                     Edge.getHotness() == CalleeInfo::HotnessType::Critical)) {
+    return true;
+  }
+  return HotThreshold != 0 &&
+         Edge.RelBlockFreq >= uint64_t(HotThreshold) << CalleeInfo::ScaleShift;
+}
+
+/// The GUIDs of the functions called from hot call sites in -obf-thinlto-index,
+/// read on the first call. An invalid index is a fatal error.
+static const DenseSet<GlobalValue::GUID> &getHotCallees() {
+  static const DenseSet<GlobalValue::GUID> HotCallees = []() {
+    DenseSet<GlobalValue::GUID> Result;
+    if (SummaryIndex.empty()) {
+      return Result;
+    }
+    Expected<std::unique_ptr<ModuleSummaryIndex>> Index =
+        getModuleSummaryIndexForFile(SummaryIndex);
+    if (!Index) {
+      report_fatal_error(Twine(SummaryIndex) + ": " +
+                         toString(Index.takeError()));
+    }
+    for (const auto &Entry : **Index) {
+      for (const auto &Summary : Entry.second.SummaryList) {
+        auto *FS = dyn_cast<FunctionSummary>(Summary.get());
+        if (FS == nullptr) {
+          continue;
+        }
+        for (const FunctionSummary::EdgeTy &Call : FS->calls()) {
+          if (isHotEdge(Call.second)) {
+            Result.insert(Call.first.getGUID());
+          }
+        }
+      }
+    }
+    return Result;
+  }();
+  return HotCallees;
+}
+
+namespace obf {
+
+HotnessInfo::HotnessInfo(Function &F, BlockFrequencyInfo &BFI,
+                         ProfileSummaryInfo *PSI)
+    : BFI(BFI), PSI(PSI) {
+  HasProfile = UseProfile && PSI != nullptr && PSI->hasProfileSummary();
+  HotFunction = (HasProfile && PSI->isFunctionHotInCallGraph(&F, BFI)) ||
+                isHotInSummary(F);
+  EntryFreq = BFI.getEntryFreq();
+}
+
+bool isHotInSummary(const Function &F) {
+  const DenseSet<GlobalValue::GUID> &HotCallees = getHotCallees();
+  if (HotCallees.empty()) {
+    return false;
+  }
+  // The backend renamed the local functions it promoted to external ones, the
+  // summary knows them by their original name and source file
+  StringRef Name = F.getName();
+  StringRef Original = ModuleSummaryIndex::getOriginalNameBeforePromote(Name);
+  GlobalValue::GUID GUID = F.getGUID();
+  if (Original.size() != Name.size()) {
+    GUID = GlobalValue::getGUID(GlobalValue::getGlobalIdentifier(
+        Original, GlobalValue::InternalLinkage,
+        F.getParent()->getSourceFileName()));
+  }
+  return HotCallees.count(GUID);
+}
+
+/// LLVM 11 made ProfileSummaryInfoWrapperPass::getPSI return a reference.
+ProfileSummaryInfo *getProfileSummary(Pass &P) {
+#if LLVM_VERSION_MAJOR >= 11
+  return &P.getAnalysis<ProfileSummaryInfoWrapperPass>().getPSI();
+#else
+  return P.getAnalysis<ProfileSummaryInfoWrapperPass>().getPSI();
+#endif
+}
+
+HotnessInfo::HotnessInfo(Function &F, Pass &P)
+    : HotnessInfo(F, P.getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI(),
+                  getProfileSummary(P)) {}
+
+HotnessInfo::HotnessInfo(Function &F, FunctionAnalysisManager &AM)
+    : HotnessInfo(F, AM.getResult<BlockFrequencyAnalysis>(F),
+                  AM.getResult<ModuleAnalysisManagerFunctionProxy>(F)
+                      .getCachedResult<ProfileSummaryAnalysis>(
+                          *F.getParent())) {}
+
+void HotnessInfo::getAnalysisUsage(AnalysisUsage &AU) {
+  AU.addRequired<BlockFrequencyInfoWrapperPass>();
+  AU.addRequired<ProfileSummaryInfoWrapperPass>();
+}
+
+bool HotnessInfo::isHotBlock(const BasicBlock *BB) const {
+  if (HasProfile && PSI->isHotBlock(BB, &BFI)) {
+    return true;
+  }
+  if (HotThreshold == 0 || EntryFreq == 0) {
+    return false;
+  }
+  return BFI.getBlockFreq(BB).getFrequency() / EntryFreq >= HotThreshold;
+}
+
+bool HotnessInfo::isColdBlock(const BasicBlock *BB) const {
+  if (HasProfile) {
+    return PSI->isColdBlock(BB, &BFI);
+  }
+  return BFI.getBlockFreq(BB).getFrequency() <= EntryFreq;
+}
+
+} // namespace obf
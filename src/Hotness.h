@@ -0,0 +1,73 @@
+//===-- Hotness.h - hot code detection --------------------------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Tells the passes which functions and blocks are too hot to be obfuscated
+/// at full strength. The profile (e.g. from -fprofile-instr-use) is used when
+/// the module has one, the static block frequencies otherwise. In a ThinLTO
+/// backend, the call graph of the summary index of the thin link also tells
+/// which functions are called from hot code in the other modules.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_HOTNESS_H
+#define BABY_OBFUSCATOR_HOTNESS_H
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+
+namespace obf {
+
+class HotnessInfo {
+public:
+  HotnessInfo(llvm::Function &F, llvm::BlockFrequencyInfo &BFI,
+              llvm::ProfileSummaryInfo *PSI);
+
+  /// Get the analyses from the legacy pass \p P.
+  HotnessInfo(llvm::Function &F, llvm::Pass &P);
+
+  /// Get the analyses from \p AM. The profile summary is only used when it
+  /// was computed before, as a function pass can not compute it.
+  HotnessInfo(llvm::Function &F, llvm::FunctionAnalysisManager &AM);
+
+  /// Add the analyses needed by HotnessInfo to \p AU.
+  static void getAnalysisUsage(llvm::AnalysisUsage &AU);
+
+  /// Is the function hot in the profile, or called from a hot call site in
+  /// the -obf-thinlto-index summary?
+  bool isHotFunction() const { return HotFunction; }
+
+  /// Is \p BB hot in the profile, or expected to run at least -obf-hot-threshold
+  /// times per call of the function?
+  bool isHotBlock(const llvm::BasicBlock *BB) const;
+
+  /// Is \p BB cold in the profile, or expected to run at most once per call
+  /// of the function?
+  bool isColdBlock(const llvm::BasicBlock *BB) const;
+
+private:
+  llvm::BlockFrequencyInfo &BFI;
+  /// Null when the profile summary is not available
+  llvm::ProfileSummaryInfo *PSI;
+  bool HasProfile;
+  bool HotFunction;
+  uint64_t EntryFreq;
+};
+
+/// The profile summary of the legacy pass \p P, which requires
+/// ProfileSummaryInfoWrapperPass.
+llvm::ProfileSummaryInfo *getProfileSummary(llvm::Pass &P);
+
+/// Is \p F called from a hot call site in the -obf-thinlto-index summary?
+bool isHotInSummary(const llvm::Function &F);
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_HOTNESS_H
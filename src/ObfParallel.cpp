@@ -0,0 +1,278 @@
+//===-- ObfParallel.cpp - run the obfuscation passes on many threads ------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// obf-parallel splits a module into partitions of functions, runs the
+/// function passes given on the command line on each partition in its own
+/// LLVMContext on a pool of threads, and links the partitions back in order.
+///
+///   obf-parallel -flattening -boguscf -subobf -j 8 in.bc -o out.bc
+///
+/// The partitions only depend on the module and on -partitions, so the
+/// output does not depend on -j. With -obf-cache-dir, the functions which
+/// were already obfuscated with the same options are reused. With
+/// -obf-size-budget or -obf-time-budget, the budget is shared between the
+/// passes on the whole module before it is split. The annotations of the
+/// functions are copied to attributes, so the partitions keep them.
+///
+//===----------------------------------------------------------------------===//
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LegacyPassNameParser.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+#include "Budget.h"
+#include "FunctionCache.h"
+#include "Policy.h"
+#include <atomic>
+#include <thread>
+
+using namespace llvm;
+
+static cl::list<const PassInfo *, bool, PassNameParser>
+    PassList(cl::desc("Function passes to run, in order:"));
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input bitcode file>"),
+                                          cl::init("-"),
+                                          cl::value_desc("filename"));
+
+static cl::opt<std::string> OutputFilename("o",
+                                           cl::desc("Output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write output as LLVM assembly"));
+
+static cl::opt<unsigned>
+    Threads("j", cl::desc("Number of threads (0 uses all the cores)"),
+            cl::init(0));
+
+static cl::opt<unsigned>
+    Partitions("partitions",
+               cl::desc("Number of partitions the module is split into, the "
+                        "output depends on it"),
+               cl::init(16));
+
+static cl::opt<bool> NoVerify("disable-verify",
+                              cl::desc("Do not verify the partitions"));
+
+static cl::opt<std::string>
+    CacheDir("obf-cache-dir",
+             cl::desc("Reuse the obfuscated functions stored in this "
+                      "directory, and store the new ones"),
+             cl::value_desc("directory"));
+
+static const char *ToolName;
+
+static void error(const Twine &Message) {
+  WithColor::error(errs(), ToolName) << Message << "\n";
+  exit(1);
+}
+
+/// Run the passes on the partition serialized in \p Buffer and serialize the
+/// result back into it. Each partition has its own context, so partitions can
+/// be processed concurrently.
+static void obfuscatePartition(SmallVectorImpl<char> &Buffer,
+                               const obf::FunctionCache *Cache) {
+  LLVMContext Ctx;
+  Expected<std::unique_ptr<Module>> MOrErr = parseBitcodeFile(
+      MemoryBufferRef(StringRef(Buffer.data(), Buffer.size()), "partition"),
+      Ctx);
+  if (!MOrErr) {
+    error(toString(MOrErr.takeError()));
+  }
+  Module &M = **MOrErr;
+  obf::FunctionCache::Lookup Found;
+  if (Cache != nullptr) {
+    Found = Cache->lookup(M);
+  }
+
+  legacy::PassManager PM;
+  for (const PassInfo *PI : PassList) {
+    PM.add(PI->createPass());
+  }
+  if (!NoVerify) {
+    PM.add(createVerifierPass());
+  }
+  PM.run(M);
+  if (Cache != nullptr) {
+    Cache->update(M, Found);
+  }
+
+  Buffer.clear();
+  raw_svector_ostream OS(Buffer);
+  WriteBitcodeToFile(M, OS);
+}
+
+/// The command line without the input, the output and the options which do
+/// not change the obfuscated functions: the passes, their options and the
+/// seed.
+static std::string getCacheOptions(int argc, char **argv) {
+  static const StringRef DriverOptions[] = {"o",          "j",
+                                            "partitions", "obf-cache-dir",
+                                            "S",          "disable-verify"};
+  std::string Options;
+  for (int I = 1; I < argc; I++) {
+    StringRef Arg = argv[I];
+    if (Arg == InputFilename) {
+      continue;
+    }
+    StringRef Name = Arg.ltrim('-').split('=').first;
+    if (Arg.startswith("-") && is_contained(DriverOptions, Name)) {
+      // Skip the value given as the next argument
+      if (!Arg.contains('=') && Name != "S" && Name != "disable-verify") {
+        I++;
+      }
+      continue;
+    }
+    Options += Arg;
+    Options += ' ';
+  }
+  return Options;
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  ToolName = argv[0];
+
+  // The passes of the obfuscator are registered by their static constructors,
+  // the analyses they require need to be registered here.
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "parallel driver of the obfuscation passes\n");
+
+  for (const PassInfo *PI : PassList) {
+    std::unique_ptr<Pass> P(PI->createPass());
+    if (P->getPassKind() != PT_Function) {
+      error("-" + PI->getPassArgument() +
+            " is not a function pass, run it with opt on the whole module");
+    }
+  }
+
+  LLVMContext Ctx;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Ctx);
+  if (!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+
+  // The annotations of the functions are lost when the module is split
+  obf::copyAnnotations(*M);
+  if (obf::isBudgetEnabled()) {
+    std::vector<std::string> Passes;
+    for (const PassInfo *PI : PassList) {
+      Passes.push_back(PI->getPassArgument().str());
+    }
+    legacy::PassManager PM;
+    PM.add(obf::createLegacyBudgetPass(std::move(Passes)));
+    PM.run(*M);
+  }
+
+  std::unique_ptr<obf::FunctionCache> Cache;
+  if (!CacheDir.empty()) {
+    if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+      error(CacheDir + ": " + EC.message());
+    }
+    // The rules of the policy file change the output, not only its name
+    Cache.reset(new obf::FunctionCache(
+        CacheDir,
+        getCacheOptions(argc, argv) + obf::Policy::get().getText().str()));
+  }
+
+  // Split the module, keeping the local symbols with their users so they are
+  // not renamed
+  SmallVector<SmallVector<char, 0>, 16> Buffers;
+  auto Callback = [&](std::unique_ptr<Module> MPart) {
+    Buffers.emplace_back();
+    raw_svector_ostream OS(Buffers.back());
+    WriteBitcodeToFile(*MPart, OS);
+  };
+#if LLVM_VERSION_MAJOR >= 13
+  SplitModule(*M, std::max(1u, Partitions.getValue()), Callback, true);
+#else
+  SplitModule(std::move(M), std::max(1u, Partitions.getValue()), Callback,
+              true);
+#endif
+  std::string SourceFileName = M->getSourceFileName();
+  M.reset();
+
+  // Each thread takes the next partition until there is none left
+  unsigned NumThreads = Threads;
+  if (NumThreads == 0) {
+    NumThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  NumThreads = std::min<unsigned>(NumThreads, Buffers.size());
+  std::atomic<size_t> Next(0);
+  auto Worker = [&]() {
+    for (size_t I = Next++; I < Buffers.size(); I = Next++) {
+      obfuscatePartition(Buffers[I], Cache.get());
+    }
+  };
+  std::vector<std::thread> Pool;
+  for (unsigned I = 1; I < NumThreads; I++) {
+    Pool.emplace_back(Worker);
+  }
+  Worker();
+  for (std::thread &T : Pool) {
+    T.join();
+  }
+
+  // Link the partitions back in order. They are all linked into an empty
+  // module rather than into the first one: the linker moves the bodies of
+  // the functions in the order of their instructions, so the symbol tables
+  // of the functions, which the bitcode is written from, do not depend on
+  // how their partition got them, from the passes or from the cache.
+  std::unique_ptr<Module> Linked(new Module(InputFilename, Ctx));
+  Linked->setSourceFileName(SourceFileName);
+  for (SmallVectorImpl<char> &Buffer : Buffers) {
+    Expected<std::unique_ptr<Module>> MOrErr = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Buffer.data(), Buffer.size()), "partition"),
+        Ctx);
+    if (!MOrErr) {
+      error(toString(MOrErr.takeError()));
+    }
+    if (Linker::linkModules(*Linked, std::move(*MOrErr))) {
+      error("cannot link the partitions back");
+    }
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_None);
+  if (EC) {
+    error(EC.message());
+  }
+  if (OutputAssembly) {
+    Linked->print(Out.os(), nullptr);
+  } else {
+    WriteBitcodeToFile(*Linked, Out.os());
+  }
+  Out.keep();
+  return 0;
+}
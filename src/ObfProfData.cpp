@@ -0,0 +1,227 @@
+//===-- ObfProfData.cpp - read the counters of -obf-profile-gen -----------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// obf-profdata merges the dumps written by the runtime of -obf-profile-gen
+/// and prints, per function, what the obfuscation cost it at run time:
+///
+///   obf-profdata run1.raw run2.raw
+///
+/// With -policy, it writes an -obf-policy file instead, which disables each
+/// pass on the few functions making most of its cost, e.g. the -flattening
+/// dispatchers of a hot loop:
+///
+///   obf-profdata -policy -hot-percent=90 run1.raw -o hot.policy
+///   opt -obf-policy=hot.policy -flattening ...
+///
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Profile.h"
+#include <array>
+#include <map>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFilenames(cl::Positional, cl::OneOrMore,
+                                            cl::desc("<profile dumps>"));
+
+static cl::opt<std::string> OutputFilename("o",
+                                           cl::desc("Output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+static cl::opt<bool>
+    WritePolicy("policy",
+                cl::desc("Write an -obf-policy file disabling the passes on "
+                         "the hottest functions instead of the table"));
+
+static cl::opt<unsigned> HotPercent(
+    "hot-percent",
+    cl::desc("The hottest functions of a pass are the fewest making this "
+             "percentage of its counts"),
+    cl::init(90));
+
+static const char Magic[] = "OBFPROF";
+static const uint8_t Version = 1;
+
+/// The column of each counter, and the policy word disabling its pass.
+static const char *const CounterNames[obf::NumProfileCounters][2] = {
+    {"dispatches", "nofla"},
+    {"predicates", "nobcf"},
+    {"decrypted bytes", "nostr"},
+};
+
+using Counters = std::array<uint64_t, obf::NumProfileCounters>;
+
+static const char *ToolName;
+
+static void error(const Twine &Message) {
+  WithColor::error(errs(), ToolName) << Message << "\n";
+  exit(1);
+}
+
+/// Add the counters of the dump \p FileName to \p Profile, by function name.
+static void readDump(StringRef FileName, StringMap<Counters> &Profile) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+      MemoryBuffer::getFile(FileName);
+  if (!Buffer) {
+    error(FileName + ": " + Buffer.getError().message());
+  }
+  StringRef Data = (*Buffer)->getBuffer();
+  if (!Data.consume_front(StringRef(Magic, sizeof(Magic) - 1)) ||
+      Data.empty() || Data.front() != Version) {
+    error(FileName + ": not an -obf-profile-gen dump of version " +
+          Twine(unsigned(Version)));
+  }
+  Data = Data.drop_front();
+
+  auto readULEB = [&]() {
+    unsigned Size;
+    const char *Error = nullptr;
+    uint64_t Value =
+        decodeULEB128(Data.bytes_begin(), &Size, Data.bytes_end(), &Error);
+    if (Error != nullptr) {
+      error(FileName + ": " + Error);
+    }
+    Data = Data.drop_front(Size);
+    return Value;
+  };
+  // A newer runtime may have more counters, the unknown ones are skipped
+  uint64_t NumCounters = readULEB();
+  while (!Data.empty()) {
+    uint64_t Length = readULEB();
+    if (Length > Data.size()) {
+      error(FileName + ": truncated function name");
+    }
+    Counters &Sums = Profile[Data.take_front(Length)];
+    Data = Data.drop_front(Length);
+    for (uint64_t I = 0; I < NumCounters; I++) {
+      uint64_t Value = readULEB();
+      if (I < obf::NumProfileCounters) {
+        Sums[I] += Value;
+      }
+    }
+  }
+}
+
+static void printTable(const StringMap<Counters> &Profile, raw_ostream &OS) {
+  std::vector<const StringMapEntry<Counters> *> Entries;
+  for (const StringMapEntry<Counters> &Entry : Profile) {
+    Entries.push_back(&Entry);
+  }
+  // The costliest functions first
+  llvm::sort(Entries, [](const StringMapEntry<Counters> *A,
+                         const StringMapEntry<Counters> *B) {
+    uint64_t SumA = 0, SumB = 0;
+    for (unsigned I = 0; I < obf::NumProfileCounters; I++) {
+      SumA += A->second[I];
+      SumB += B->second[I];
+    }
+    return SumA != SumB ? SumA > SumB : A->first() < B->first();
+  });
+  Counters Totals = {};
+  for (unsigned I = 0; I < obf::NumProfileCounters; I++) {
+    OS << right_justify(CounterNames[I][0], 16);
+  }
+  OS << "  function\n";
+  for (const StringMapEntry<Counters> *Entry : Entries) {
+    for (unsigned I = 0; I < obf::NumProfileCounters; I++) {
+      OS << format("%16llu", (unsigned long long)Entry->second[I]);
+      Totals[I] += Entry->second[I];
+    }
+    OS << "  " << Entry->first() << "\n";
+  }
+  for (unsigned I = 0; I < obf::NumProfileCounters; I++) {
+    OS << format("%16llu", (unsigned long long)Totals[I]);
+  }
+  OS << "  total\n";
+}
+
+/// The rule pattern matching only \p Name: the name as a glob, or an anchored
+/// regex when it has glob metacharacters.
+static std::string getPattern(StringRef Name) {
+  if (Name.find_first_of("*?[]\\{}") == StringRef::npos) {
+    return Name.str();
+  }
+  return "re:^" + Regex::escape(Name) + "$";
+}
+
+static void printPolicy(const StringMap<Counters> &Profile, raw_ostream &OS) {
+  // The words of each function, in name order so the file is stable
+  std::map<std::string, std::string> Words;
+  for (unsigned I = 0; I < obf::NumProfileCounters; I++) {
+    std::vector<std::pair<uint64_t, StringRef>> Costs;
+    uint64_t Total = 0;
+    for (const StringMapEntry<Counters> &Entry : Profile) {
+      if (Entry.second[I] != 0) {
+        Costs.emplace_back(Entry.second[I], Entry.first());
+        Total += Entry.second[I];
+      }
+    }
+    llvm::sort(Costs, [](const std::pair<uint64_t, StringRef> &A,
+                         const std::pair<uint64_t, StringRef> &B) {
+      return A.first != B.first ? A.first > B.first : A.second < B.second;
+    });
+    // Take the hottest functions until they make -hot-percent of the total
+    uint64_t Covered = 0;
+    for (const auto &Cost : Costs) {
+      if (Covered * 100 >= Total * std::min(100u, HotPercent.getValue())) {
+        break;
+      }
+      Covered += Cost.first;
+      std::string &FunctionWords = Words[Cost.second.str()];
+      if (!FunctionWords.empty()) {
+        FunctionWords += ' ';
+      }
+      FunctionWords += CounterNames[I][1];
+    }
+  }
+  OS << "# The functions making " << HotPercent
+     << "% of the run-time cost of each pass, by obf-profdata\n";
+  for (const auto &Rule : Words) {
+    OS << getPattern(Rule.first) << "  " << Rule.second << "\n";
+  }
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  ToolName = argv[0];
+  cl::ParseCommandLineOptions(argc, argv,
+                              "merge the dumps of -obf-profile-gen\n");
+
+  StringMap<Counters> Profile;
+  for (const std::string &FileName : InputFilenames) {
+    readDump(FileName, Profile);
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    error(OutputFilename + ": " + EC.message());
+  }
+  if (WritePolicy) {
+    printPolicy(Profile, Out.os());
+  } else {
+    printTable(Profile, Out.os());
+  }
+  Out.keep();
+  return 0;
+}
@@ -0,0 +1,419 @@
+//===-- ObfStream.cpp - obfuscate a lazily loaded module in batches -------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// obf-stream obfuscates a bitcode file too large to be loaded at once. The
+/// module is loaded lazily: the globals are read, the function bodies stay
+/// in the bitcode. The strings are encrypted in place from the global table,
+/// then the function bodies are loaded, obfuscated and written out in
+/// batches of about -batch-instructions instructions, and freed. The memory
+/// used is the global table plus a batch, not the whole module.
+///
+///   obf-stream -obfstr -subobf -boguscf -flattening huge.bc -o huge.obf
+///
+/// The output directory holds a module per batch, 00000.bc, 00001.bc, ...,
+/// and globals.bc, the global variables and the functions aliases point to.
+/// The modules are compiled separately and linked together. The local
+/// symbols are made hidden and renamed with the hash of the module, so the
+/// batches can refer to each other, and the comdats of the functions are
+/// dropped.
+///
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LegacyPassNameParser.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include "Budget.h"
+#include "Passes.h"
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<const PassInfo *, bool, PassNameParser>
+    PassList(cl::desc("Passes to run, in order:"));
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input bitcode file>"),
+                                          cl::init("-"),
+                                          cl::value_desc("filename"));
+
+static cl::opt<std::string>
+    OutputDirectory("o", cl::desc("Output directory"), cl::Required,
+                    cl::value_desc("directory"));
+
+static cl::opt<unsigned> BatchInstructions(
+    "batch-instructions",
+    cl::desc("Write out the obfuscated functions once they have this many "
+             "instructions"),
+    cl::init(200000));
+
+static cl::opt<bool> NoVerify("disable-verify",
+                              cl::desc("Do not verify the output modules"));
+
+static const char *ToolName;
+
+static void error(const Twine &Message) {
+  WithColor::error(errs(), ToolName) << Message << "\n";
+  exit(1);
+}
+
+namespace {
+/// Declares in a batch module the global values of the input module it
+/// refers to.
+struct DeclarationMaterializer : ValueMaterializer {
+  Module &Batch;
+
+  explicit DeclarationMaterializer(Module &Batch) : Batch(Batch) {}
+
+  Value *materialize(Value *V) override {
+    auto *GV = dyn_cast<GlobalValue>(V);
+    if (GV == nullptr) {
+      return nullptr;
+    }
+    GlobalValue::LinkageTypes Linkage = GV->hasExternalWeakLinkage()
+                                            ? GlobalValue::ExternalWeakLinkage
+                                            : GlobalValue::ExternalLinkage;
+    GlobalValue *Declaration;
+    if (auto *FTy = dyn_cast<FunctionType>(GV->getValueType())) {
+      Declaration = Function::Create(FTy, Linkage, GV->getAddressSpace(),
+                                     GV->getName(), &Batch);
+    } else {
+      auto *GVar = dyn_cast<GlobalVariable>(GV);
+      Declaration = new GlobalVariable(
+          Batch, GV->getValueType(), GVar != nullptr && GVar->isConstant(),
+          Linkage, nullptr, GV->getName(), nullptr, GV->getThreadLocalMode(),
+          GV->getAddressSpace());
+    }
+    if (auto *F = dyn_cast<Function>(GV)) {
+      auto *FDeclaration = cast<Function>(Declaration);
+      FDeclaration->copyAttributesFrom(F);
+      FDeclaration->setComdat(nullptr);
+      // The data of the body do not belong to the declaration
+      FDeclaration->setPersonalityFn(nullptr);
+      FDeclaration->setPrefixData(nullptr);
+      FDeclaration->setPrologueData(nullptr);
+    } else if (auto *GVar = dyn_cast<GlobalVariable>(GV)) {
+      auto *GVarDeclaration = cast<GlobalVariable>(Declaration);
+      GVarDeclaration->copyAttributesFrom(GVar);
+      GVarDeclaration->setComdat(nullptr);
+    } else {
+      Declaration->setVisibility(GV->getVisibility());
+      Declaration->setDLLStorageClass(GV->getDLLStorageClass());
+    }
+    return Declaration;
+  }
+};
+
+class Streamer {
+public:
+  Streamer(Module &M, legacy::FunctionPassManager &FPM)
+      : M(M), FPM(FPM), ModuleId(getModuleId(M)) {}
+
+  /// Obfuscate the functions of M in batches and write them out.
+  void run() {
+    // The functions aliases and ifuncs point to are defined with them
+    for (GlobalAlias &GA : M.aliases()) {
+#if LLVM_VERSION_MAJOR >= 14
+      keepInGlobals(dyn_cast_or_null<Function>(GA.getAliaseeObject()));
+#else
+      keepInGlobals(dyn_cast_or_null<Function>(GA.getBaseObject()));
+#endif
+    }
+    for (GlobalIFunc &GI : M.ifuncs()) {
+      keepInGlobals(dyn_cast<Function>(GI.getResolver()->stripPointerCasts()));
+    }
+    promoteLocals();
+    LastGlobal = getLastGlobal();
+
+    std::vector<Function *> Batch;
+    unsigned Instructions = 0;
+    for (Function &F : M) {
+      if (!F.isMaterializable()) {
+        continue;
+      }
+      materialize(F);
+      FPM.run(F);
+      Batch.push_back(&F);
+      Instructions += F.getInstructionCount();
+      if (Instructions >= BatchInstructions) {
+        writeBatch(Batch);
+        Batch.clear();
+        Instructions = 0;
+      }
+    }
+    if (!Batch.empty()) {
+      writeBatch(Batch);
+    }
+
+    // What is left: the globals, and the declarations still used
+    for (auto I = M.begin(), E = M.end(); I != E;) {
+      Function &F = *I++;
+      if (F.isDeclaration() && F.use_empty()) {
+        F.eraseFromParent();
+      }
+    }
+    if (Error E = M.materializeAll()) {
+      error(toString(std::move(E)));
+    }
+    writeModule(M, "globals.bc");
+  }
+
+private:
+  Module &M;
+  legacy::FunctionPassManager &FPM;
+  /// Appended to the promoted local names, to keep them unique in the link.
+  std::string ModuleId;
+  /// The last global before the passes ran on the current batch.
+  GlobalVariable *LastGlobal = nullptr;
+  unsigned NumBatches = 0;
+
+  static std::string getModuleId(Module &M) {
+    std::string Id = getUniqueModuleId(&M);
+    if (!Id.empty()) {
+      return Id;
+    }
+    MD5 Hash;
+    Hash.update(M.getModuleIdentifier());
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return ("." + Result.digest()).str();
+  }
+
+  GlobalVariable *getLastGlobal() {
+    return M.global_empty() ? nullptr : &M.getGlobalList().back();
+  }
+
+  void materialize(Function &F) {
+    if (Error E = F.materialize()) {
+      error(F.getName() + ": " + toString(std::move(E)));
+    }
+  }
+
+  /// Obfuscate \p F now and leave it in globals.bc.
+  void keepInGlobals(Function *F) {
+    if (F != nullptr && F->isMaterializable()) {
+      materialize(*F);
+      FPM.run(*F);
+    }
+  }
+
+  /// Make the local symbols hidden, with a name unique in the link, so the
+  /// batches can refer to them.
+  void promoteLocals() {
+    for (GlobalValue &GV : M.global_values()) {
+      if (!GV.hasLocalLinkage() || GV.getName().startswith("llvm.")) {
+        continue;
+      }
+      GV.setName((GV.hasName() ? GV.getName() : "obf.anon") + ".obf" +
+                 ModuleId);
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setVisibility(GlobalValue::HiddenVisibility);
+      if (auto *GO = dyn_cast<GlobalObject>(&GV)) {
+        GO->setComdat(nullptr);
+      }
+    }
+  }
+
+  /// Move the functions of \p Batch and the globals the passes added for
+  /// them to a module, write it and free them.
+  void writeBatch(ArrayRef<Function *> Batch) {
+    auto Out = std::make_unique<Module>(M.getModuleIdentifier(),
+                                        M.getContext());
+    Out->setSourceFileName(M.getSourceFileName());
+    Out->setDataLayout(M.getDataLayout());
+    Out->setTargetTriple(M.getTargetTriple());
+    SmallVector<Module::ModuleFlagEntry, 8> Flags;
+    M.getModuleFlagsMetadata(Flags);
+    for (const Module::ModuleFlagEntry &Flag : Flags) {
+      // The flags referring to values, e.g. the call graph profile, are left
+      // to globals.bc
+      if (isa<ConstantAsMetadata>(Flag.Val) || isa<MDString>(Flag.Val)) {
+        Out->addModuleFlag(Flag.Behavior, Flag.Key->getString(), Flag.Val);
+      }
+    }
+
+    ValueToValueMapTy VMap;
+    DeclarationMaterializer Materializer(*Out);
+    // The passes append the globals they add for the functions, e.g. the
+    // dispatch tables, after the ones of the previous batches
+    SmallVector<GlobalVariable *, 16> Added;
+    auto AddedBegin = LastGlobal != nullptr
+                          ? std::next(LastGlobal->getIterator())
+                          : M.global_begin();
+    for (GlobalVariable &GVar : make_range(AddedBegin, M.global_end())) {
+      auto *NewGVar = new GlobalVariable(
+          *Out, GVar.getValueType(), GVar.isConstant(), GVar.getLinkage(),
+          nullptr, GVar.getName(), nullptr, GVar.getThreadLocalMode(),
+          GVar.getAddressSpace());
+      NewGVar->copyAttributesFrom(&GVar);
+      VMap[&GVar] = NewGVar;
+      Added.push_back(&GVar);
+    }
+    for (Function *F : Batch) {
+      Function *NewF =
+          Function::Create(F->getFunctionType(), F->getLinkage(),
+                           F->getAddressSpace(), F->getName(), Out.get());
+      NewF->copyAttributesFrom(F);
+      VMap[F] = NewF;
+    }
+    for (Function *F : Batch) {
+      auto *NewF = cast<Function>(VMap[F]);
+      auto NewArg = NewF->arg_begin();
+      for (Argument &Arg : F->args()) {
+        NewArg->setName(Arg.getName());
+        VMap[&Arg] = &*NewArg++;
+      }
+      SmallVector<ReturnInst *, 8> Returns;
+#if LLVM_VERSION_MAJOR >= 13
+      CloneFunctionInto(NewF, F, VMap,
+                        CloneFunctionChangeType::DifferentModule, Returns, "",
+                        nullptr, nullptr, &Materializer);
+#else
+      CloneFunctionInto(NewF, F, VMap, true, Returns, "", nullptr, nullptr,
+                        &Materializer);
+#endif
+      addCompileUnit(*Out, NewF);
+    }
+    for (GlobalVariable *GVar : Added) {
+      if (GVar->hasInitializer()) {
+        cast<GlobalVariable>(VMap[GVar])->setInitializer(
+            MapValue(GVar->getInitializer(), VMap, RF_None, nullptr,
+                     &Materializer));
+      }
+    }
+
+    // CloneFunctionInto adds llvm.dbg.cu even when there is no debug info,
+    // which readers then take for debug info without a version
+    NamedMDNode *CUs = Out->getNamedMetadata("llvm.dbg.cu");
+    if (CUs != nullptr && CUs->getNumOperands() == 0) {
+      Out->eraseNamedMetadata(CUs);
+    }
+
+    SmallString<16> Name;
+    raw_svector_ostream(Name) << format("%05u.bc", NumBatches++);
+    writeModule(*Out, Name);
+    Out.reset();
+
+    for (Function *F : Batch) {
+      F->deleteBody();
+      F->setComdat(nullptr);
+    }
+    for (GlobalVariable *GVar : Added) {
+      GVar->dropAllReferences();
+    }
+    for (GlobalVariable *GVar : Added) {
+      GVar->eraseFromParent();
+    }
+    LastGlobal = getLastGlobal();
+  }
+
+  /// List the compile unit of \p F in llvm.dbg.cu, as the verifier requires.
+  static void addCompileUnit(Module &Out, Function *F) {
+    DISubprogram *SP = F->getSubprogram();
+    if (SP == nullptr || SP->getUnit() == nullptr) {
+      return;
+    }
+    NamedMDNode *CUs = Out.getOrInsertNamedMetadata("llvm.dbg.cu");
+    for (MDNode *CU : CUs->operands()) {
+      if (CU == SP->getUnit()) {
+        return;
+      }
+    }
+    CUs->addOperand(SP->getUnit());
+  }
+
+  void writeModule(Module &Out, StringRef Name) {
+    if (!NoVerify && verifyModule(Out, &errs())) {
+      error(Name + ": the obfuscated module is broken");
+    }
+    SmallString<128> Path(OutputDirectory);
+    sys::path::append(Path, Name);
+    std::error_code EC;
+    ToolOutputFile File(Path, EC, sys::fs::OF_None);
+    if (EC) {
+      error(Path + ": " + EC.message());
+    }
+    WriteBitcodeToFile(Out, File.os());
+    File.keep();
+  }
+};
+} // namespace
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  ToolName = argv[0];
+
+  // The passes of the obfuscator are registered by their static constructors,
+  // the analyses they require need to be registered here.
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "obfuscate a module in batches of functions\n");
+
+  if (obf::isBudgetEnabled()) {
+    error("the budget is shared over the whole module, use obf-parallel");
+  }
+  bool EncryptStrings = false;
+  LLVMContext Ctx;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M =
+      getLazyIRFileModule(InputFilename, Err, Ctx, true);
+  if (!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+  legacy::FunctionPassManager FPM(M.get());
+  for (const PassInfo *PI : PassList) {
+    if (PI->getPassArgument() == "obfstr") {
+      EncryptStrings = true;
+      continue;
+    }
+    Pass *P = PI->createPass();
+    if (P->getPassKind() != PT_Function) {
+      error("-" + PI->getPassArgument() +
+            " is not a function pass, run it with opt on the whole module");
+    }
+    FPM.add(P);
+  }
+  if (std::error_code EC = sys::fs::create_directories(OutputDirectory)) {
+    error(OutputDirectory + ": " + EC.message());
+  }
+
+  // The strings are encrypted in place, their uses are not rewritten
+  if (EncryptStrings) {
+    obf::encryptStringsInPlace(*M);
+  }
+  FPM.doInitialization();
+  Streamer(*M, FPM).run();
+  FPM.doFinalization();
+  return 0;
+}
@@ -0,0 +1,110 @@
+//===-- Obfuscate.cpp - the function transforms in one walk ---------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// -obfuscate does what -subobf -boguscf -flattening do, in one walk of each
+/// function instead of three passes. The transforms share the random stream
+/// of the function, which is hashed once, the list of its blocks and the
+/// scratch containers and analyses, reset for each function. They run in
+/// that order: the instructions are substituted before -boguscf clones them,
+/// so the bogus blocks are not substituted again, and -flattening sees the
+/// bogus blocks.
+///
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/Timer.h"
+
+#include "Hotness.h"
+#include "Passes.h"
+#include "Profile.h"
+#include "Random.h"
+#include "Transforms.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "obfuscate"
+
+STATISTIC(NumFunctions, "Number of functions walked by -obfuscate");
+
+void obf::TransformState::reset(Function &F, StringRef PassName) {
+  RNG = createRNG(F, PassName);
+  Blocks.clear();
+  for (BasicBlock &BB : F) {
+    Blocks.push_back(&BB);
+  }
+  Worklist.clear();
+  LI.releaseMemory();
+}
+
+/// Run the transforms on \p F. The hotness is computed before them, the
+/// blocks they add are neither hot nor cold.
+static bool obfuscate(Function &F, obf::TransformState &State,
+                      const obf::HotnessInfo &Hotness,
+                      const TargetTransformInfo &TTI,
+                      OptimizationRemarkEmitter &ORE) {
+  if (F.isDeclaration()) {
+    return false;
+  }
+  NamedRegionTimer Timer("obfuscate", "Run the transforms", DEBUG_TYPE,
+                         "Obfuscation", TimePassesIsEnabled);
+  State.reset(F, DEBUG_TYPE);
+  bool Changed = obf::substitute(F, State, ORE);
+  Changed |= obf::addBogusFlow(F, State, Hotness, TTI, ORE);
+  // The loops of -fla_loops are the ones of the bogus control flow
+  State.DT.recalculate(F);
+  State.LI.analyze(State.DT);
+  Changed |= obf::flatten(F, State, Hotness, State.LI, ORE);
+  State.LI.releaseMemory();
+  if (!Changed) {
+    return false;
+  }
+  // The counters of both -boguscf and -flattening are set up at once
+  obf::finishProfile(F);
+  NumFunctions++;
+  return true;
+}
+
+PreservedAnalyses obf::ObfuscatePass::run(Function &F,
+                                          FunctionAnalysisManager &AM) {
+  obf::HotnessInfo Hotness(F, AM);
+  auto &TTI = AM.getResult<TargetIRAnalysis>(F);
+  auto &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+  if (!obfuscate(F, State, Hotness, TTI, ORE)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
+struct LegacyObfuscatePass : public FunctionPass {
+  static char ID;
+  obf::TransformState State;
+
+  LegacyObfuscatePass() : FunctionPass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    obf::HotnessInfo::getAnalysisUsage(AU);
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+  }
+
+  bool runOnFunction(Function &F) override {
+    obf::HotnessInfo Hotness(F, *this);
+    auto &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    auto &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+    return obfuscate(F, State, Hotness, TTI, ORE);
+  }
+};
+
+char LegacyObfuscatePass::ID = 0;
+static RegisterPass<LegacyObfuscatePass>
+    X("obfuscate",
+      "Substitute, add bogus control flow and flatten in one walk");
@@ -11,120 +11,935 @@
 /// This file contains the module pass class and decrypt function.
 ///
 //===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "Passes.h"
+#include "Policy.h"
+#include "Profile.h"
+#include "Utils.h"
 #include <map>
 #include <vector>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "obfstr"
+
+STATISTIC(NumStrings, "Number of strings encrypted");
+STATISTIC(NumBytes, "Number of bytes encrypted");
+STATISTIC(NumAround, "Number of strings decrypted around their call user");
+STATISTIC(NumLazy, "Number of strings decrypted on first use");
+STATISTIC(NumOnStack, "Number of strings decrypted on the stack");
+STATISTIC(NumAtStartup, "Number of strings decrypted at startup");
+
+namespace {
+/// How the decrypt / re-encrypt code is emitted around a protected user.
+enum ObfStrMode {
+  /// Call the external `__decrypt` / `__encrypt` functions (see encrypt.c).
+  CallMode,
+  /// Call an internal always-inline helper which xors 32 / 16 bytes at once.
+  InlineMode,
+  /// Decrypt each string in place on first use, later uses only check a flag.
+  LazyMode,
+  /// Decrypt small strings into a stack buffer of the calling function, the
+  /// ciphertext stays read-only.
+  StackMode,
+};
+} // namespace
+
+static cl::opt<ObfStrMode> ObfStrModeOpt(
+    "obfstr-mode", cl::desc("Choose how -obfstr decrypts strings"),
+    cl::values(clEnumValN(CallMode, "call",
+                          "call external __decrypt / __encrypt (default)"),
+               clEnumValN(InlineMode, "inline",
+                          "emit an always-inline vectorized xor helper"),
+               clEnumValN(LazyMode, "lazy",
+                          "decrypt each string once, on its first use"),
+               clEnumValN(StackMode, "stack",
+                          "decrypt small strings into stack buffers")),
+    cl::init(CallMode), cl::Optional);
+
+static cl::opt<uint64_t> ObfStrChunkSize(
+    "obfstr-chunk-size",
+    cl::desc("Choose how many bytes of the string table -obfstr-mode=lazy "
+             "decrypts together"),
+    cl::value_desc("bytes"), cl::init(1024), cl::Optional);
+
+static cl::opt<uint64_t> ObfStrStackThreshold(
+    "obfstr-stack-threshold",
+    cl::desc("Choose the largest string -obfstr-mode=stack decrypts on the "
+             "stack, larger strings are decrypted lazily"),
+    cl::value_desc("bytes"), cl::init(256), cl::Optional);
+
 namespace {
+/// Key used to xor strings, must match the runtime in encrypt.c.
+const uint8_t XorKey = 42;
+
 /// encrypt strings with xor.
 /// \param s input string for encrypt.
-void encrypt(std::string &s) {
-  for (int i = 0; i < s.length() - 1; i++) {
-    s[i] ^= 42;
+/// \param length number of bytes to encrypt.
+void encrypt(std::string &s, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    s[i] ^= XorKey;
+  }
+}
+
+/// Emit one step of the xor loop: xor \p Width bytes at \p Src + \p Idx and
+/// store them at \p Dst + \p Idx.
+/// \return the index after this chunk.
+Value *emitXorChunk(IRBuilder<> &builder, Value *Dst, Value *Src, Value *Idx,
+                    unsigned Width) {
+  Type *VecTy = builder.getInt8Ty();
+  if (Width > 1) {
+    VecTy = VectorType::get(VecTy, Width, false);
+  }
+  Value *SrcPtr = builder.CreateBitCast(
+      builder.CreateInBoundsGEP(builder.getInt8Ty(), Src, Idx),
+      VecTy->getPointerTo());
+  Value *DstPtr = SrcPtr;
+  if (Dst != Src) {
+    DstPtr = builder.CreateBitCast(
+        builder.CreateInBoundsGEP(builder.getInt8Ty(), Dst, Idx),
+        VecTy->getPointerTo());
   }
+  LoadInst *Chunk = builder.CreateLoad(VecTy, SrcPtr);
+  obf::setAlignment(Chunk, 1);
+  Constant *Key = ConstantInt::get(VecTy, XorKey);
+  StoreInst *Store = builder.CreateStore(builder.CreateXor(Chunk, Key), DstPtr);
+  obf::setAlignment(Store, 1);
+  return builder.CreateAdd(Idx, builder.getInt64(Width));
+}
+
+/// Fill the empty always-inline helper \p F with a loop storing the \p Len
+/// bytes at \p Src xored with the key to \p Dst, then returning \p Dst.
+/// The loop xors 32 bytes per iteration, then one 16 bytes chunk and a scalar
+/// tail, so the backend can lower it to SSE2 / AVX2.
+void buildXorLoop(Function *F, Value *Dst, Value *Src, Value *Len) {
+  LLVMContext &Ctx = F->getContext();
+  F->addFnAttr(Attribute::AlwaysInline);
+  F->addFnAttr(Attribute::NoUnwind);
+
+  BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+  BasicBlock *Vec32Cond = BasicBlock::Create(Ctx, "vec32.cond", F);
+  BasicBlock *Vec32Body = BasicBlock::Create(Ctx, "vec32.body", F);
+  BasicBlock *Vec16Cond = BasicBlock::Create(Ctx, "vec16.cond", F);
+  BasicBlock *Vec16Body = BasicBlock::Create(Ctx, "vec16.body", F);
+  BasicBlock *TailCond = BasicBlock::Create(Ctx, "tail.cond", F);
+  BasicBlock *TailBody = BasicBlock::Create(Ctx, "tail.body", F);
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", F);
+
+  IRBuilder<> builder(Entry);
+  Type *Int64Ty = builder.getInt64Ty();
+  Value *Len32 = builder.CreateAnd(Len, builder.getInt64(~uint64_t(31)));
+  builder.CreateBr(Vec32Cond);
+
+  // for (i = 0; i < (len & ~31); i += 32) xor <32 x i8>
+  builder.SetInsertPoint(Vec32Cond);
+  PHINode *I32 = builder.CreatePHI(Int64Ty, 2);
+  I32->addIncoming(builder.getInt64(0), Entry);
+  builder.CreateCondBr(builder.CreateICmpULT(I32, Len32), Vec32Body,
+                       Vec16Cond);
+  builder.SetInsertPoint(Vec32Body);
+  Value *Next32 = emitXorChunk(builder, Dst, Src, I32, 32);
+  I32->addIncoming(Next32, Vec32Body);
+  builder.CreateBr(Vec32Cond);
+
+  // if (len - i >= 16) xor <16 x i8>
+  builder.SetInsertPoint(Vec16Cond);
+  Value *Remain = builder.CreateSub(Len, I32);
+  builder.CreateCondBr(builder.CreateICmpUGE(Remain, builder.getInt64(16)),
+                       Vec16Body, TailCond);
+  builder.SetInsertPoint(Vec16Body);
+  Value *Next16 = emitXorChunk(builder, Dst, Src, I32, 16);
+  builder.CreateBr(TailCond);
+
+  // for (; i < len; i++) xor i8
+  builder.SetInsertPoint(TailCond);
+  PHINode *ITail = builder.CreatePHI(Int64Ty, 3);
+  ITail->addIncoming(I32, Vec16Cond);
+  ITail->addIncoming(Next16, Vec16Body);
+  builder.CreateCondBr(builder.CreateICmpULT(ITail, Len), TailBody, Exit);
+  builder.SetInsertPoint(TailBody);
+  Value *NextTail = emitXorChunk(builder, Dst, Src, ITail, 1);
+  ITail->addIncoming(NextTail, TailBody);
+  builder.CreateBr(TailCond);
+
+  builder.SetInsertPoint(Exit);
+  builder.CreateRet(Dst);
+}
+
+/// Get or create `i8* __obfstr_xor(i8* str, i64 len)`, which xors \p str in
+/// place. As xor is its own inverse, the same helper is used to decrypt and
+/// re-encrypt.
+Function *getOrCreateXorFunc(Module &M, FunctionType *FuncType) {
+  if (Function *F = M.getFunction("__obfstr_xor")) {
+    return F;
+  }
+  Function *F = Function::Create(FuncType, GlobalValue::InternalLinkage,
+                                 "__obfstr_xor", &M);
+  Value *Str = &*F->arg_begin();
+  buildXorLoop(F, Str, Str, &*std::next(F->arg_begin()));
+  return F;
+}
+
+/// Get or create `i8* __obfstr_xor_copy(i8* dst, i8* src, i64 len)`, which
+/// decrypts \p src into \p dst.
+Function *getOrCreateXorCopyFunc(Module &M) {
+  if (Function *F = M.getFunction("__obfstr_xor_copy")) {
+    return F;
+  }
+  Type *Int8PtrTy = Type::getInt8PtrTy(M.getContext());
+  FunctionType *FuncType = FunctionType::get(
+      Int8PtrTy, {Int8PtrTy, Int8PtrTy, Type::getInt64Ty(M.getContext())},
+      false);
+  Function *F = Function::Create(FuncType, GlobalValue::InternalLinkage,
+                                 "__obfstr_xor_copy", &M);
+  auto ArgIter = F->arg_begin();
+  Value *Dst = &*ArgIter++;
+  Value *Src = &*ArgIter++;
+  buildXorLoop(F, Dst, Src, &*ArgIter);
+  return F;
+}
+
+/// States of the per chunk guard byte used by the lazy mode.
+enum LazyState : uint8_t { Encrypted = 0, Decrypting = 1, Decrypted = 2 };
+
+/// Where a protected string is decrypted.
+enum DecryptKind {
+  /// Around its single call user, with the decrypt / encrypt functions.
+  DecryptAround,
+  /// In place, on the first use of its chunk.
+  DecryptLazy,
+  /// Into a stack buffer before each call user, the ciphertext is read-only.
+  DecryptOnStack,
+  /// In place, by a module constructor. Used for strings referenced by a
+  /// global initializer or by a use which can not be guarded.
+  DecryptAtStartup,
+};
+
+/// A constant string found by the use index.
+struct StringInfo {
+  /// Instruction operands using the string, directly or through constants.
+  SmallVector<Use *, 1> Uses;
+  DecryptKind Kind = DecryptAround;
+  /// Offset of the string in its packed table.
+  uint64_t Offset = 0;
+  /// Length of the string, including the trailing '\0'.
+  uint64_t Length = 0;
+  /// Lazy mode chunk holding the string.
+  unsigned Chunk = 0;
+};
+
+/// Can \p GVar be moved into the packed table?
+bool isCandidate(const GlobalVariable *GVar) {
+  if (!GVar->isConstant() || !GVar->hasInitializer() ||
+      !GVar->hasLocalLinkage() || GVar->hasSection() ||
+      GVar->isThreadLocal() || GVar->getName().startswith("__obfprof")) {
+    return false;
+  }
+  const ConstantDataArray *Arr =
+      dyn_cast<ConstantDataArray>(GVar->getInitializer());
+  return Arr != nullptr && Arr->isString(8) && Arr->getNumElements() > 1;
 }
 
 /// A pass for obfuscating const string in modules.
-struct ObfuscatePass : public ModulePass {
-  static char ID;
-  ObfuscatePass() : ModulePass(ID) {}
+/// All protected strings are encrypted into one packed table global, strings
+/// decrypted on the stack into a second, read-only one. Uses are found in a
+/// single walk over the module, so the work is linear in the module size.
+struct ObfuscateString {
+  /// Strings in order of first use, so strings used together are packed
+  /// together.
+  MapVector<GlobalVariable *, StringInfo> Strings;
+  /// Candidate strings reachable from a constant expression or aggregate.
+  DenseMap<Constant *, SmallVector<GlobalVariable *, 1>> ConstantStrings;
+  GlobalVariable *Table = nullptr;
+  GlobalVariable *ReadOnlyTable = nullptr;
+  FunctionType *XorFuncType = nullptr;
+  FunctionCallee DecryptFunc, EncryptFunc;
 
-  virtual bool runOnModule(Module &M) {
-    for (GlobalValue &GV : M.globals()) {
-      GlobalVariable *GVar = dyn_cast<GlobalVariable>(&GV);
-      if (GVar == nullptr) {
-        continue;
+  /// What the remark of a function reports.
+  struct FunctionRemark {
+    unsigned Strings = 0;
+    unsigned Uses = 0;
+    unsigned InstructionsBefore = 0;
+  };
+
+  bool runOnModule(Module &M) {
+    {
+      NamedRegionTimer Timer("index", "Find the uses of the strings",
+                             DEBUG_TYPE, "String obfuscation",
+                             TimePassesIsEnabled);
+      buildUseIndex(M);
+    }
+    if (Strings.empty()) {
+      return false;
+    }
+    NamedRegionTimer Timer("encrypt", "Encrypt and rewrite the strings",
+                           DEBUG_TYPE, "String obfuscation",
+                           TimePassesIsEnabled);
+    declareXorFuncs(M);
+
+    for (auto &S : Strings) {
+      if (S.second.Kind != DecryptAtStartup) {
+        S.second.Kind = chooseKind(M, S.first, S.second);
+      }
+    }
+    MapVector<Function *, FunctionRemark> Remarks = collectRemarks();
+    // Startup strings are packed first so one call decrypts all of them.
+    std::string Data, ReadOnlyData;
+    uint64_t StartupLength = packStrings(Data, DecryptAtStartup);
+    packStrings(Data, DecryptAround);
+    uint64_t LazyBegin = Data.size();
+    packStrings(Data, DecryptLazy);
+    packStrings(ReadOnlyData, DecryptOnStack);
+    // The strings of Table are decrypted in place.
+    Table = createTable(M, Data, false, "__obfstr_table");
+    ReadOnlyTable = createTable(M, ReadOnlyData, true, "__obfstr_rodata");
+    // Uses are moved to the stack buffers before the strings are replaced.
+    insertStackDecrypt(M);
+    replaceStrings();
+
+    if (StartupLength != 0) {
+      insertStartupDecrypt(M, StartupLength);
+    }
+    if (LazyBegin != Data.size()) {
+      insertLazyDecrypt(M, LazyBegin, Data.size());
+    }
+    for (auto &S : Strings) {
+      if (S.second.Kind == DecryptAround) {
+        obfuscateString(M, cast<Instruction>(S.second.Uses[0]->getUser()),
+                        S.second);
       }
-      std::vector<std::pair<Instruction *, User *>> Target;
-      bool hasExceptCallInst = false;
-      // Find all user and encrypt const value, then insert decrypt function.
-      for (User *Usr : GVar->users()) {
-        // Get instruction.
-        Instruction *Inst = dyn_cast<Instruction>(Usr);
-        if (Inst == nullptr) {
-          // If Usr is not an instruction, like i8* getelementptr...
-          // Dig deeper to find Instruction.
-          for (User *DirecUsr : Usr->users()) {
-            Inst = dyn_cast<Instruction>(DirecUsr);
-            if (Inst == nullptr) {
+    }
+    if (obf::isProfiling()) {
+      for (Function &F : M) {
+        obf::finishProfile(F);
+      }
+    }
+    updateStatistics();
+    emitRemarks(Remarks);
+    Strings.clear();
+    ConstantStrings.clear();
+    return true;
+  }
+
+  /// Encrypt the candidate strings in place and decrypt them all in a module
+  /// constructor. Only the global table is read: the uses are not rewritten,
+  /// so the function bodies of a lazily loaded module are not needed.
+  bool runOnGlobals(Module &M) {
+    if (!obf::Policy::get().isEnabledByDefault(DEBUG_TYPE)) {
+      return false;
+    }
+    SmallVector<GlobalVariable *, 0> Found;
+    for (GlobalVariable &GVar : M.globals()) {
+      if (isCandidate(&GVar)) {
+        Found.push_back(&GVar);
+      }
+    }
+    if (Found.empty()) {
+      return false;
+    }
+    declareXorFuncs(M);
+    LLVMContext &Ctx = M.getContext();
+    Function *Init = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "__obfstr_init", &M);
+    IRBuilder<> builder(BasicBlock::Create(Ctx, "entry", Init));
+    uint64_t Length = 0;
+    for (GlobalVariable *GVar : Found) {
+      std::string Data =
+          cast<ConstantDataArray>(GVar->getInitializer())->getAsString().str();
+      encrypt(Data, Data.size());
+      GVar->setInitializer(ConstantDataArray::getString(Ctx, Data, false));
+      GVar->setConstant(false);
+      Value *Str = builder.CreatePointerCast(GVar, builder.getInt8PtrTy());
+      builder.CreateCall(DecryptFunc, {Str, builder.getInt64(Data.size())});
+      Length += Data.size();
+    }
+    if (obf::isProfiling()) {
+      obf::incrementCounter(builder, obf::DecryptedBytesCounter, Length);
+    }
+    builder.CreateRetVoid();
+    appendToGlobalCtors(M, Init, 0);
+    obf::finishProfile(*Init);
+    NumStrings += Found.size();
+    NumAtStartup += Found.size();
+    NumBytes += Length;
+    return true;
+  }
+
+  /// Declare or create the functions decrypting and re-encrypting the
+  /// strings, for -obfstr-mode.
+  void declareXorFuncs(Module &M) {
+    LLVMContext &Ctx = M.getContext();
+    Type *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+    XorFuncType = FunctionType::get(
+        Int8PtrTy, {Int8PtrTy, Type::getInt64Ty(Ctx)}, false);
+    if (ObfStrModeOpt == CallMode) {
+      DecryptFunc = M.getOrInsertFunction("__decrypt", XorFuncType);
+      EncryptFunc = M.getOrInsertFunction("__encrypt", XorFuncType);
+    } else {
+      DecryptFunc = EncryptFunc = getOrCreateXorFunc(M, XorFuncType);
+    }
+  }
+
+  /// Count the protected strings used by each function, and its size when
+  /// its remarks are enabled.
+  MapVector<Function *, FunctionRemark> collectRemarks() {
+    MapVector<Function *, FunctionRemark> Remarks;
+    SmallPtrSet<Function *, 4> Users;
+    for (auto &S : Strings) {
+      Users.clear();
+      for (Use *U : S.second.Uses) {
+        Function *F = cast<Instruction>(U->getUser())->getFunction();
+        Remarks[F].Uses++;
+        if (Users.insert(F).second) {
+          Remarks[F].Strings++;
+        }
+      }
+    }
+    for (auto &R : Remarks) {
+      OptimizationRemarkEmitter ORE(R.first);
+      R.second.InstructionsBefore =
+          obf::countInstructions(*R.first, ORE, DEBUG_TYPE);
+    }
+    return Remarks;
+  }
+
+  void emitRemarks(const MapVector<Function *, FunctionRemark> &Remarks) {
+    for (auto &R : Remarks) {
+      OptimizationRemarkEmitter ORE(R.first);
+      ORE.emit([&]() {
+        OptimizationRemark Remark(DEBUG_TYPE, "Encrypted", R.first);
+        Remark << "protected " << ore::NV("Strings", R.second.Strings)
+               << " strings at " << ore::NV("Uses", R.second.Uses) << " uses";
+        obf::addInstructionDelta(Remark, *R.first,
+                                 R.second.InstructionsBefore);
+        return Remark;
+      });
+    }
+  }
+
+  void updateStatistics() {
+    for (auto &S : Strings) {
+      NumStrings++;
+      NumBytes += S.second.Length;
+      switch (S.second.Kind) {
+      case DecryptAround:
+        NumAround++;
+        break;
+      case DecryptLazy:
+        NumLazy++;
+        break;
+      case DecryptOnStack:
+        NumOnStack++;
+        break;
+      case DecryptAtStartup:
+        NumAtStartup++;
+        break;
+      }
+    }
+  }
+
+  /// Find every use of every candidate string in one walk over the module.
+  /// The strings used where the policy disables the pass stay in clear.
+  void buildUseIndex(Module &M) {
+    SmallVector<GlobalVariable *, 1> Found;
+    SmallPtrSet<GlobalVariable *, 8> Excluded;
+    const obf::Policy &Policy = obf::Policy::get();
+    for (Function &F : M) {
+      obf::PassPolicy FunctionPolicy;
+      if (!F.isDeclaration()) {
+        FunctionPolicy = Policy.lookup(F, DEBUG_TYPE);
+      }
+      bool UsesExcluded = false;
+      for (BasicBlock &BB : F) {
+        for (Instruction &Inst : BB) {
+          for (Use &U : Inst.operands()) {
+            Constant *C = dyn_cast<Constant>(U.get());
+            if (C == nullptr) {
               continue;
             }
-            if (!isa<CallInst>(Inst)) {
-              hasExceptCallInst = true;
-              Target.clear();
-            } else {
-              Target.emplace_back(std::pair<Instruction *, User *>(Inst, Usr));
+            Found.clear();
+            findStrings(C, Found);
+            for (GlobalVariable *GVar : Found) {
+              if (!FunctionPolicy.Enabled) {
+                Excluded.insert(GVar);
+                UsesExcluded = true;
+                continue;
+              }
+              StringInfo &Info = Strings[GVar];
+              Info.Uses.emplace_back(&U);
+              // Nothing can be inserted before an EH pad.
+              if (Inst.isEHPad()) {
+                Info.Kind = DecryptAtStartup;
+              }
             }
           }
         }
       }
-      if (hasExceptCallInst == false && Target.size() == 1) {
-        for (auto &T : Target) {
-          obfuscateString(M, T.first, T.second, GVar);
+      if (UsesExcluded) {
+        OptimizationRemarkEmitter ORE(&F);
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed(DEBUG_TYPE, "Disabled", &F)
+                 << "strings left in clear: disabled by "
+                 << FunctionPolicy.getSourceName();
+        });
+      }
+    }
+    // Strings in aggregate initializers escape to memory.
+    bool ProtectGlobals = Policy.isEnabledByDefault(DEBUG_TYPE);
+    auto addStartupStrings = [&](Constant *C) {
+      Found.clear();
+      findStrings(C, Found);
+      for (GlobalVariable *Str : Found) {
+        if (ProtectGlobals) {
+          Strings[Str].Kind = DecryptAtStartup;
+        } else {
+          Excluded.insert(Str);
         }
-        // Change constant to variable.
-        GVar->setConstant(false);
+      }
+    };
+    for (GlobalVariable &GVar : M.globals()) {
+      if (GVar.hasInitializer()) {
+        addStartupStrings(GVar.getInitializer());
       }
     }
-    return true;
+    for (GlobalAlias &GA : M.aliases()) {
+      addStartupStrings(GA.getAliasee());
+    }
+    if (!Excluded.empty()) {
+      Strings.remove_if([&](const std::pair<GlobalVariable *, StringInfo> &S) {
+        return Excluded.count(S.first) != 0;
+      });
+    }
   }
 
-  /// Obfuscate string and add decrypt function.
-  /// \param M Module
-  /// \param Inst Instruction
-  /// \param Usr User of the \p GlobalVariable
-  /// \param GVar The const string
-  void obfuscateString(Module &M, Instruction *Inst, Value *Usr,
-                       GlobalVariable *GVar) {
-    // Encrypt origin string and replace it encrypted string.
-    ConstantDataArray *GVarArr =
-        dyn_cast<ConstantDataArray>(GVar->getInitializer());
-    if (GVarArr == nullptr) {
+  /// Append the candidate strings reachable from \p C to \p Found.
+  void findStrings(Constant *C, SmallVectorImpl<GlobalVariable *> &Found) {
+    if (GlobalVariable *GVar = dyn_cast<GlobalVariable>(C)) {
+      if (isCandidate(GVar)) {
+        Found.emplace_back(GVar);
+      }
       return;
     }
-    std::string Origin;
-    if (GVarArr->isString(8)) {
-      Origin = GVarArr->getAsString().str();
-    } else if (GVarArr->isCString()) {
-      Origin = GVarArr->getAsCString().str();
+    if (isa<GlobalValue>(C) || isa<ConstantData>(C) || isa<BlockAddress>(C)) {
+      return;
     }
-    encrypt(Origin);
-    Constant *NewConstStr = ConstantDataArray::getString(
-        GVarArr->getContext(), StringRef(Origin), false);
-    GVarArr->replaceAllUsesWith(NewConstStr);
+    auto Iter = ConstantStrings.find(C);
+    if (Iter == ConstantStrings.end()) {
+      SmallVector<GlobalVariable *, 1> Reachable;
+      for (Value *Op : C->operands()) {
+        findStrings(cast<Constant>(Op), Reachable);
+      }
+      Iter = ConstantStrings.insert({C, std::move(Reachable)}).first;
+    }
+    Found.append(Iter->second.begin(), Iter->second.end());
+  }
 
+  /// Choose where the string \p GVar is decrypted.
+  DecryptKind chooseKind(Module &M, GlobalVariable *GVar,
+                         const StringInfo &Info) {
+    switch (ObfStrModeOpt) {
+    case LazyMode:
+      return DecryptLazy;
+    case StackMode:
+      return canDecryptOnStack(M, GVar, Info) ? DecryptOnStack : DecryptLazy;
+    default: {
+      CallInst *Call = nullptr;
+      if (Info.Uses.size() == 1) {
+        Call = dyn_cast<CallInst>(Info.Uses[0]->getUser());
+      }
+      if (Call == nullptr || Call->isMustTailCall()) {
+        return DecryptAtStartup;
+      }
+      return DecryptAround;
+    }
+    }
+  }
+
+  /// Strings small enough, only passed as arguments of calls, can be
+  /// decrypted into a stack buffer. The callee must not keep the pointer nor
+  /// return one derived from it, which would dangle once the caller returns,
+  /// so the argument must be nocapture.
+  bool canDecryptOnStack(Module &M, GlobalVariable *GVar,
+                         const StringInfo &Info) {
+    if (GVar->getType()->getAddressSpace() !=
+            M.getDataLayout().getAllocaAddrSpace() ||
+        cast<ArrayType>(GVar->getValueType())->getNumElements() >
+            ObfStrStackThreshold) {
+      return false;
+    }
+    SmallVector<GlobalVariable *, 1> Found;
+    for (Use *U : Info.Uses) {
+      CallInst *Call = dyn_cast<CallInst>(U->getUser());
+      if (Call == nullptr || Call->isMustTailCall() || Call->isCallee(U) ||
+          !Call->doesNotCapture(U->getOperandNo())) {
+        return false;
+      }
+      // The operand is rebuilt for this string only.
+      Found.clear();
+      findStrings(cast<Constant>(U->get()), Found);
+      if (any_of(Found, [GVar](GlobalVariable *Str) { return Str != GVar; }) ||
+          !canMaterialize(cast<Constant>(U->get()), GVar)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Does \p C use \p GVar?
+  bool usesString(Constant *C, GlobalVariable *GVar) {
+    SmallVector<GlobalVariable *, 1> Found;
+    findStrings(C, Found);
+    return is_contained(Found, GVar);
+  }
+
+  /// Can \p C be rebuilt with instructions, using a stack buffer instead of
+  /// \p GVar? Only constant expressions can, not aggregates.
+  bool canMaterialize(Constant *C, GlobalVariable *GVar) {
+    if (C == GVar) {
+      return true;
+    }
+    ConstantExpr *CE = dyn_cast<ConstantExpr>(C);
+    if (CE == nullptr) {
+      return false;
+    }
+    for (Value *Op : CE->operands()) {
+      Constant *OpC = cast<Constant>(Op);
+      if (usesString(OpC, GVar) && !canMaterialize(OpC, GVar)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Rebuild \p C before \p InsertPt, replacing \p GVar by \p Buffer.
+  Value *materialize(Constant *C, GlobalVariable *GVar, Value *Buffer,
+                     Instruction *InsertPt) {
+    if (C == GVar) {
+      return Buffer;
+    }
+    if (!usesString(C, GVar)) {
+      return C;
+    }
+    Instruction *Inst = cast<ConstantExpr>(C)->getAsInstruction();
+    Inst->insertBefore(InsertPt);
+    for (Use &Op : Inst->operands()) {
+      Op.set(materialize(cast<Constant>(Op.get()), GVar, Buffer, Inst));
+    }
+    return Inst;
+  }
+
+  /// Encrypt the strings decrypted by \p Kind and append them to \p Data.
+  /// \return the number of appended bytes.
+  uint64_t packStrings(std::string &Data, DecryptKind Kind) {
+    uint64_t Begin = Data.size();
+    for (auto &S : Strings) {
+      StringInfo &Info = S.second;
+      if (Info.Kind != Kind) {
+        continue;
+      }
+      ConstantDataArray *GVarArr =
+          cast<ConstantDataArray>(S.first->getInitializer());
+      std::string Origin = GVarArr->getAsString().str();
+      Info.Offset = Data.size();
+      Info.Length = Origin.length();
+      encrypt(Origin, Info.Length);
+      Data += Origin;
+    }
+    return Data.size() - Begin;
+  }
+
+  /// Create a packed table from \p Data, or nothing if \p Data is empty.
+  GlobalVariable *createTable(Module &M, StringRef Data, bool IsConstant,
+                              const Twine &Name) {
+    if (Data.empty()) {
+      return nullptr;
+    }
+    Constant *Init = ConstantDataArray::getString(M.getContext(), Data, false);
+    return new GlobalVariable(M, Init->getType(), IsConstant,
+                              GlobalValue::PrivateLinkage, Init, Name);
+  }
+
+  /// Point every string into its table.
+  void replaceStrings() {
+    for (auto &S : Strings) {
+      GlobalVariable *GVar = S.first;
+      GlobalVariable *StrTable =
+          S.second.Kind == DecryptOnStack ? ReadOnlyTable : Table;
+      GVar->replaceAllUsesWith(ConstantExpr::getBitCast(
+          getTablePtr(StrTable, S.second.Offset), GVar->getType()));
+      GVar->eraseFromParent();
+    }
+  }
+
+  /// \return `i8*` pointing at \p Offset of the packed table \p StrTable.
+  Constant *getTablePtr(GlobalVariable *StrTable, uint64_t Offset) {
+    Type *Int64Ty = Type::getInt64Ty(StrTable->getContext());
+    Constant *Indices[] = {ConstantInt::get(Int64Ty, 0),
+                           ConstantInt::get(Int64Ty, Offset)};
+    return ConstantExpr::getInBoundsGetElementPtr(StrTable->getValueType(),
+                                                  StrTable, Indices);
+  }
+
+  /// Decrypt the read-only strings into a buffer in the entry block of the
+  /// calling function before each call, and pass the buffer instead. The
+  /// buffer is shared by all the calls of a function using the same string.
+  void insertStackDecrypt(Module &M) {
+    DenseMap<std::pair<Function *, GlobalVariable *>, AllocaInst *> Buffers;
+    for (auto &S : Strings) {
+      GlobalVariable *GVar = S.first;
+      StringInfo &Info = S.second;
+      if (Info.Kind != DecryptOnStack) {
+        continue;
+      }
+      for (Use *U : Info.Uses) {
+        CallInst *Call = cast<CallInst>(U->getUser());
+        Function *F = Call->getFunction();
+        AllocaInst *&Buffer = Buffers[{F, GVar}];
+        if (Buffer == nullptr) {
+          IRBuilder<> entryBuilder(&*F->getEntryBlock().getFirstInsertionPt());
+          Buffer = entryBuilder.CreateAlloca(GVar->getValueType());
+        }
+        IRBuilder<> builder(Call);
+        builder.CreateCall(
+            getOrCreateXorCopyFunc(M),
+            {builder.CreatePointerCast(Buffer, builder.getInt8PtrTy()),
+             getTablePtr(ReadOnlyTable, Info.Offset),
+             builder.getInt64(Info.Length)});
+        if (obf::isProfiling()) {
+          obf::incrementCounter(builder, obf::DecryptedBytesCounter,
+                                Info.Length);
+        }
+        U->set(materialize(cast<Constant>(U->get()), GVar, Buffer, Call));
+      }
+    }
+  }
+
+  /// Decrypt the first \p Length bytes of the table in a module constructor.
+  void insertStartupDecrypt(Module &M, uint64_t Length) {
+    LLVMContext &Ctx = M.getContext();
+    Function *Init = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::InternalLinkage, "__obfstr_init", &M);
+    IRBuilder<> builder(BasicBlock::Create(Ctx, "entry", Init));
+    builder.CreateCall(DecryptFunc,
+                       {getTablePtr(Table, 0), builder.getInt64(Length)});
+    if (obf::isProfiling()) {
+      obf::incrementCounter(builder, obf::DecryptedBytesCounter, Length);
+    }
+    builder.CreateRetVoid();
+    // Run before the constructors which may use the strings.
+    appendToGlobalCtors(M, Init, 0);
+  }
+
+  /// Obfuscate string and add decrypt function.
+  /// \param M Module
+  /// \param Inst Instruction
+  /// \param Info The const string
+  void obfuscateString(Module &M, Instruction *Inst, const StringInfo &Info) {
     // Insert decrypt function above Inst with IRBuilder.
     IRBuilder<> builder(Inst);
-    Type *Int8PtrTy = builder.getInt8PtrTy();
-    Type *Int64Ty = builder.getInt64Ty();
-    // Create decrypt function in GlobalValue / Get decrypt function.
-    SmallVector<Type *, 1> FuncArgs = {Int8PtrTy, Int64Ty};
-    FunctionType *FuncType = FunctionType::get(Int8PtrTy, FuncArgs, false);
-    FunctionCallee DecryptFunc = M.getOrInsertFunction("__decrypt", FuncType);
-    FunctionCallee EncryptFunc = M.getOrInsertFunction("__encrypt", FuncType);
-    ConstantInt *StringLength = builder.getInt64(Origin.length() - 1);
+    ConstantInt *StringLength = builder.getInt64(Info.Length);
     // Create call instrucions.
-    SmallVector<Value *, 2> CallArgs = {Usr, StringLength};
+    SmallVector<Value *, 2> CallArgs = {getTablePtr(Table, Info.Offset),
+                                        StringLength};
     CallInst *DecryptInst =
-        builder.CreateCall(FuncType, DecryptFunc.getCallee(), CallArgs);
+        builder.CreateCall(XorFuncType, DecryptFunc.getCallee(), CallArgs);
+    if (obf::isProfiling()) {
+      obf::incrementCounter(builder, obf::DecryptedBytesCounter, Info.Length);
+    }
     CallInst *EncryptInst =
-        CallInst::Create(FuncType, EncryptFunc.getCallee(), CallArgs);
+        CallInst::Create(XorFuncType, EncryptFunc.getCallee(), CallArgs);
     EncryptInst->insertAfter(Inst);
   }
+
+  /// Split the lazy strings in [\p Begin, \p End) of the table into chunks of
+  /// about -obfstr-chunk-size bytes, each decrypted on the first use of one
+  /// of its strings. The fast path of a use is one load of the chunk guard
+  /// byte and a likely branch.
+  void insertLazyDecrypt(Module &M, uint64_t Begin, uint64_t End) {
+    LLVMContext &Ctx = M.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    StructType *RecordTy = StructType::get(Int64Ty, Int64Ty);
+    // Offset / length record of each chunk.
+    SmallVector<Constant *, 0> Records;
+    SmallVector<uint64_t, 0> ChunkLengths;
+    uint64_t ChunkBegin = Begin;
+    for (auto &S : Strings) {
+      StringInfo &Info = S.second;
+      if (Info.Kind != DecryptLazy) {
+        continue;
+      }
+      if (Info.Offset - ChunkBegin >= ObfStrChunkSize) {
+        Records.emplace_back(ConstantStruct::get(
+            RecordTy, {ConstantInt::get(Int64Ty, ChunkBegin),
+                       ConstantInt::get(Int64Ty, Info.Offset - ChunkBegin)}));
+        ChunkLengths.push_back(Info.Offset - ChunkBegin);
+        ChunkBegin = Info.Offset;
+      }
+      Info.Chunk = Records.size();
+    }
+    if (ChunkBegin == End) {
+      return;
+    }
+    Records.emplace_back(ConstantStruct::get(
+        RecordTy, {ConstantInt::get(Int64Ty, ChunkBegin),
+                   ConstantInt::get(Int64Ty, End - ChunkBegin)}));
+    ChunkLengths.push_back(End - ChunkBegin);
+
+    ArrayType *RecordsTy = ArrayType::get(RecordTy, Records.size());
+    GlobalVariable *Chunks = new GlobalVariable(
+        M, RecordsTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(RecordsTy, Records), "__obfstr_chunks");
+    ArrayType *StatesTy = ArrayType::get(Type::getInt8Ty(Ctx), Records.size());
+    GlobalVariable *States = new GlobalVariable(
+        M, StatesTy, false, GlobalValue::PrivateLinkage,
+        ConstantAggregateZero::get(StatesTy), "__obfstr_states");
+    Function *LazyFunc = createLazyFunc(M, Chunks, States);
+
+    // Guard every use, once per instruction and chunk.
+    DenseSet<std::pair<Instruction *, unsigned>> Guarded;
+    MDNode *Unlikely = MDBuilder(Ctx).createBranchWeights(1, 1000);
+    for (auto &S : Strings) {
+      StringInfo &Info = S.second;
+      if (Info.Kind != DecryptLazy) {
+        continue;
+      }
+      for (Use *U : Info.Uses) {
+        Instruction *InsertPt = cast<Instruction>(U->getUser());
+        if (PHINode *PN = dyn_cast<PHINode>(InsertPt)) {
+          InsertPt = PN->getIncomingBlock(*U)->getTerminator();
+        }
+        if (!Guarded.insert({InsertPt, Info.Chunk}).second) {
+          continue;
+        }
+        IRBuilder<> builder(InsertPt);
+        Constant *Indices[] = {builder.getInt64(0),
+                               builder.getInt64(Info.Chunk)};
+        Constant *State =
+            ConstantExpr::getInBoundsGetElementPtr(StatesTy, States, Indices);
+        LoadInst *Current = builder.CreateLoad(builder.getInt8Ty(), State);
+        obf::setAlignment(Current, 1);
+        Current->setAtomic(AtomicOrdering::Acquire);
+        Value *NotReady =
+            builder.CreateICmpNE(Current, builder.getInt8(Decrypted));
+        Instruction *SlowPath =
+            SplitBlockAndInsertIfThen(NotReady, InsertPt, false, Unlikely);
+        builder.SetInsertPoint(SlowPath);
+        builder.CreateCall(LazyFunc, {builder.getInt64(Info.Chunk)});
+        if (obf::isProfiling()) {
+          obf::incrementCounter(builder, obf::DecryptedBytesCounter,
+                                ChunkLengths[Info.Chunk]);
+        }
+      }
+    }
+  }
+
+  /// Create `void __obfstr_lazy(i64 chunk)`.
+  /// The first thread moving the chunk state from Encrypted to Decrypting
+  /// decrypts the chunk in place and publishes it with a release store, the
+  /// others spin until the chunk is Decrypted. No lock is taken.
+  Function *createLazyFunc(Module &M, GlobalVariable *Chunks,
+                           GlobalVariable *States) {
+    LLVMContext &Ctx = M.getContext();
+    FunctionType *FuncType = FunctionType::get(
+        Type::getVoidTy(Ctx), {Type::getInt64Ty(Ctx)}, false);
+    Function *F = Function::Create(FuncType, GlobalValue::InternalLinkage,
+                                   "__obfstr_lazy", &M);
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::Cold);
+    F->addFnAttr(Attribute::NoUnwind);
+    Value *Chunk = &*F->arg_begin();
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", F);
+    BasicBlock *Decrypt = BasicBlock::Create(Ctx, "decrypt", F);
+    BasicBlock *Wait = BasicBlock::Create(Ctx, "wait", F);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", F);
+
+    IRBuilder<> builder(Entry);
+    Value *State = builder.CreateInBoundsGEP(States->getValueType(), States,
+                                             {builder.getInt64(0), Chunk});
+    AtomicCmpXchgInst *Claim = obf::createAtomicCmpXchg(
+        builder, State, builder.getInt8(Encrypted), builder.getInt8(Decrypting),
+        AtomicOrdering::Acquire, AtomicOrdering::Acquire);
+    builder.CreateCondBr(builder.CreateExtractValue(Claim, 1), Decrypt, Wait);
+
+    builder.SetInsertPoint(Decrypt);
+    Type *Int64Ty = builder.getInt64Ty();
+    Value *Offset = builder.CreateLoad(
+        Int64Ty,
+        builder.CreateInBoundsGEP(Chunks->getValueType(), Chunks,
+                                  {builder.getInt64(0), Chunk,
+                                   builder.getInt32(0)}));
+    Value *Length = builder.CreateLoad(
+        Int64Ty,
+        builder.CreateInBoundsGEP(Chunks->getValueType(), Chunks,
+                                  {builder.getInt64(0), Chunk,
+                                   builder.getInt32(1)}));
+    Value *Str = builder.CreateInBoundsGEP(Table->getValueType(), Table,
+                                           {builder.getInt64(0), Offset});
+    builder.CreateCall(DecryptFunc, {Str, Length});
+    StoreInst *Publish = builder.CreateStore(builder.getInt8(Decrypted), State);
+    obf::setAlignment(Publish, 1);
+    Publish->setAtomic(AtomicOrdering::Release);
+    builder.CreateRetVoid();
+
+    builder.SetInsertPoint(Wait);
+    LoadInst *Current = builder.CreateLoad(builder.getInt8Ty(), State);
+    obf::setAlignment(Current, 1);
+    Current->setAtomic(AtomicOrdering::Acquire);
+    builder.CreateCondBr(
+        builder.CreateICmpEQ(Current, builder.getInt8(Decrypted)), Exit, Wait);
+
+    builder.SetInsertPoint(Exit);
+    builder.CreateRetVoid();
+    return F;
+  }
+};
+
+struct LegacyObfuscateStringPass : public ModulePass {
+  static char ID;
+
+  LegacyObfuscateStringPass() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override {
+    return ObfuscateString().runOnModule(M);
+  }
 };
 } // namespace
 
-char ObfuscatePass::ID = 0;
-static RegisterPass<ObfuscatePass> X("obfstr", "obfuscate string");
\ No newline at end of file
+PreservedAnalyses obf::ObfuscateStringPass::run(Module &M,
+                                                ModuleAnalysisManager &AM) {
+  if (!ObfuscateString().runOnModule(M)) {
+    return PreservedAnalyses::all();
+  }
+  return PreservedAnalyses::none();
+}
+
+bool obf::encryptStringsInPlace(Module &M) {
+  return ObfuscateString().runOnGlobals(M);
+}
+
+char LegacyObfuscateStringPass::ID = 0;
+static RegisterPass<LegacyObfuscateStringPass> X("obfstr", "obfuscate string");
\ No newline at end of file
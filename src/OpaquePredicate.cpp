@@ -0,0 +1,321 @@
+//===-- OpaquePredicate.cpp - always true predicates ----------------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+#include "OpaquePredicate.h"
+#include "Utils.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "boguscf"
+
+static cl::opt<std::string> OnlyFamily(
+    "bcf_predicate",
+    cl::desc("Build every opaque predicate of -boguscf from this family"),
+    cl::value_desc("family"), cl::Optional);
+
+namespace {
+
+struct PredicateFamily {
+  const char *Name;
+  unsigned NumOperands;
+  /// Opcodes of the instructions built, for the cost
+  std::vector<unsigned> Opcodes;
+  Value *(*Build)(IRBuilder<> &, ArrayRef<Value *>);
+};
+
+} // namespace
+
+static Constant *getConstant(Value *V, uint64_t C) {
+  return ConstantInt::get(V->getType(), C);
+}
+
+/// x * (x + 1) is even
+static Value *buildEvenProduct(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0];
+  Value *P = B.CreateMul(X, B.CreateAdd(X, getConstant(X, 1)));
+  return B.CreateICmpEQ(B.CreateAnd(P, getConstant(X, 1)), getConstant(X, 0));
+}
+
+/// x * x is 0 or 1 modulo 4
+static Value *buildSquareModFour(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0];
+  Value *S = B.CreateMul(X, X);
+  return B.CreateICmpULT(B.CreateAnd(S, getConstant(X, 3)), getConstant(X, 2));
+}
+
+/// The square of an odd number is 1 modulo 8
+static Value *buildOddSquare(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = B.CreateOr(Ops[0], getConstant(Ops[0], 1));
+  Value *S = B.CreateMul(X, X);
+  return B.CreateICmpEQ(B.CreateAnd(S, getConstant(X, 7)), getConstant(X, 1));
+}
+
+/// The product of four consecutive numbers is a multiple of 8
+static Value *buildFourConsecutive(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0];
+  Value *P = X;
+  for (uint64_t i = 1; i < 4; i++) {
+    P = B.CreateMul(P, B.CreateAdd(X, getConstant(X, i)));
+  }
+  return B.CreateICmpEQ(B.CreateAnd(P, getConstant(X, 7)), getConstant(X, 0));
+}
+
+/// x * x != 7 * y * y - 1, as x * x is 0, 1 or 4 modulo 8 while
+/// 7 * y * y - 1 is 3, 6 or 7
+static Value *buildSevenSquares(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0], *Y = Ops[1];
+  Value *Rhs = B.CreateSub(B.CreateMul(B.CreateMul(Y, Y), getConstant(Y, 7)),
+                           getConstant(Y, 1));
+  return B.CreateICmpNE(B.CreateMul(X, X), Rhs);
+}
+
+/// (x & y) * (x | y) + (x & ~y) * (~x & y) == x * y
+static Value *buildAndOrProduct(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0], *Y = Ops[1];
+  Value *Both = B.CreateMul(B.CreateAnd(X, Y), B.CreateOr(X, Y));
+  Value *Either = B.CreateMul(B.CreateAnd(X, B.CreateNot(Y)),
+                              B.CreateAnd(B.CreateNot(X), Y));
+  return B.CreateICmpEQ(B.CreateAdd(Both, Either), B.CreateMul(X, Y));
+}
+
+/// (x ^ y) + 2 * (x & y) == x + y
+static Value *buildXorAndSum(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0], *Y = Ops[1];
+  Value *Lhs =
+      B.CreateAdd(B.CreateXor(X, Y), B.CreateShl(B.CreateAnd(X, Y), 1));
+  return B.CreateICmpEQ(Lhs, B.CreateAdd(X, Y));
+}
+
+/// (x + y)^2 - (x - y)^2 == 4 * x * y
+static Value *buildSquareDifference(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0], *Y = Ops[1];
+  Value *Sum = B.CreateAdd(X, Y), *Diff = B.CreateSub(X, Y);
+  Value *Lhs = B.CreateSub(B.CreateMul(Sum, Sum), B.CreateMul(Diff, Diff));
+  return B.CreateICmpEQ(Lhs, B.CreateShl(B.CreateMul(X, Y), 2));
+}
+
+/// x * x has the parity of x
+static Value *buildSquareParity(IRBuilder<> &B, ArrayRef<Value *> Ops) {
+  Value *X = Ops[0];
+  Value *P = B.CreateXor(B.CreateMul(X, X), X);
+  return B.CreateICmpEQ(B.CreateAnd(P, getConstant(X, 1)), getConstant(X, 0));
+}
+
+static const PredicateFamily Families[] = {
+    {"even-product",
+     1,
+     {Instruction::Add, Instruction::Mul, Instruction::And, Instruction::ICmp},
+     buildEvenProduct},
+    {"square-mod-four",
+     1,
+     {Instruction::Mul, Instruction::And, Instruction::ICmp},
+     buildSquareModFour},
+    {"odd-square",
+     1,
+     {Instruction::Or, Instruction::Mul, Instruction::And, Instruction::ICmp},
+     buildOddSquare},
+    {"four-consecutive",
+     1,
+     {Instruction::Add, Instruction::Add, Instruction::Add, Instruction::Mul,
+      Instruction::Mul, Instruction::Mul, Instruction::And, Instruction::ICmp},
+     buildFourConsecutive},
+    {"seven-squares",
+     2,
+     {Instruction::Mul, Instruction::Mul, Instruction::Mul, Instruction::Sub,
+      Instruction::ICmp},
+     buildSevenSquares},
+    {"and-or-product",
+     2,
+     {Instruction::And, Instruction::Or, Instruction::Mul, Instruction::Xor,
+      Instruction::And, Instruction::Xor, Instruction::And, Instruction::Mul,
+      Instruction::Add, Instruction::Mul, Instruction::ICmp},
+     buildAndOrProduct},
+    {"xor-and-sum",
+     2,
+     {Instruction::Xor, Instruction::And, Instruction::Shl, Instruction::Add,
+      Instruction::Add, Instruction::ICmp},
+     buildXorAndSum},
+    {"square-difference",
+     2,
+     {Instruction::Add, Instruction::Sub, Instruction::Mul, Instruction::Mul,
+      Instruction::Sub, Instruction::Mul, Instruction::Shl, Instruction::ICmp},
+     buildSquareDifference},
+    {"square-parity",
+     1,
+     {Instruction::Mul, Instruction::Xor, Instruction::And, Instruction::ICmp},
+     buildSquareParity},
+};
+
+/// The integer type \p V is used as, or nullptr if it can not be an operand.
+static IntegerType *getOperandType(Value *V, const DataLayout &DL) {
+  Type *Ty = V->getType();
+  if (Ty->isPointerTy()) {
+    if (DL.isNonIntegralPointerType(Ty)) {
+      return nullptr;
+    }
+    Ty = DL.getIntPtrType(Ty);
+  }
+  auto *IntTy = dyn_cast<IntegerType>(Ty);
+  if (IntTy == nullptr || IntTy->getBitWidth() < 8 ||
+      IntTy->getBitWidth() > 64) {
+    return nullptr;
+  }
+  return IntTy;
+}
+
+/// \p V as an integer which is not undefined.
+static Value *getOperand(IRBuilder<> &B, Value *V, const DataLayout &DL) {
+  if (V->getType()->isPointerTy()) {
+    V = B.CreatePtrToInt(V, DL.getIntPtrType(V->getType()));
+  }
+#if LLVM_VERSION_MAJOR >= 10
+  V = B.CreateFreeze(V);
+#endif
+  return V;
+}
+
+namespace obf {
+
+OpaquePredicateBuilder::OpaquePredicateBuilder(Function &F,
+                                               const TargetTransformInfo &TTI,
+                                               std::mt19937 &rng)
+    : F(F), TTI(TTI), rng(rng) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  BasicBlock &Entry = F.getEntryBlock();
+  for (Instruction &I : Entry) {
+    if (!I.isTerminator() && getOperandType(&I, DL) != nullptr) {
+      EntryValues.push_back(&I);
+    }
+  }
+}
+
+unsigned OpaquePredicateBuilder::getCost(unsigned Family, Type *Ty) {
+  auto It = Costs.find({Family, Ty});
+  if (It != Costs.end()) {
+    return It->second;
+  }
+  unsigned Cost = 0;
+  for (unsigned Opcode : Families[Family].Opcodes) {
+    if (Opcode == Instruction::ICmp) {
+      Type *CondTy = CmpInst::makeCmpResultType(Ty);
+#if LLVM_VERSION_MAJOR >= 12
+      Cost += toCost(TTI.getCmpSelInstrCost(Opcode, Ty, CondTy,
+                                            CmpInst::BAD_ICMP_PREDICATE));
+#else
+      Cost += toCost(TTI.getCmpSelInstrCost(Opcode, Ty, CondTy));
+#endif
+    } else {
+      Cost += toCost(TTI.getArithmeticInstrCost(Opcode, Ty));
+    }
+  }
+  Costs[{Family, Ty}] = Cost;
+  return Cost;
+}
+
+GlobalVariable *OpaquePredicateBuilder::getSeedGlobal() {
+  Module &M = *F.getParent();
+  Type *Int32Ty = Type::getInt32Ty(F.getContext());
+  GlobalVariable *Seed = M.getNamedGlobal(SeedGlobalName);
+  if (Seed == nullptr) {
+    Seed = new GlobalVariable(M, Int32Ty, false, GlobalValue::PrivateLinkage,
+                              ConstantInt::get(Int32Ty, rng()), SeedGlobalName);
+  }
+  return Seed;
+}
+
+Value *OpaquePredicateBuilder::getSeed() {
+  if (SeedLoad != nullptr) {
+    return SeedLoad;
+  }
+  GlobalVariable *Seed = getSeedGlobal();
+  BasicBlock &Entry = F.getEntryBlock();
+  IRBuilder<> B(&Entry, Entry.getFirstInsertionPt());
+  // Volatile, or -O2 turns the global, which is never stored to, into a
+  // constant and folds the predicates
+  SeedLoad = B.CreateLoad(Seed->getValueType(), Seed, true, "obf.seed");
+  return SeedLoad;
+}
+
+Value *OpaquePredicateBuilder::createTrue(IRBuilder<> &Builder,
+                                          ArrayRef<Value *> Live, bool Cheap) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  BasicBlock *BB = Builder.GetInsertBlock();
+  SmallVector<Value *, 32> Values;
+  auto addValue = [&](Value *V) {
+    if (getOperandType(V, DL) != nullptr) {
+      Values.push_back(V);
+    }
+  };
+  for (Argument &Arg : F.args()) {
+    addValue(&Arg);
+  }
+  for (PHINode &PN : BB->phis()) {
+    addValue(&PN);
+  }
+  if (BB != &F.getEntryBlock()) {
+    Values.append(EntryValues.begin(), EntryValues.end());
+  }
+  for (Value *V : Live) {
+    addValue(V);
+  }
+  if (SeedLoad != nullptr || Values.empty()) {
+    Values.push_back(getSeed());
+  }
+
+  Value *X = Values[rng() % Values.size()];
+  IntegerType *Ty = getOperandType(X, DL);
+  SmallVector<unsigned, 16> Candidates;
+  for (unsigned i = 0; i < array_lengthof(Families); i++) {
+    if (OnlyFamily.empty() || OnlyFamily == Families[i].Name) {
+      Candidates.push_back(i);
+    }
+  }
+  if (Candidates.empty()) {
+    report_fatal_error(Twine("-bcf_predicate: unknown family ") + OnlyFamily);
+  }
+  std::stable_sort(Candidates.begin(), Candidates.end(),
+                   [&](unsigned A, unsigned B) {
+                     return getCost(A, Ty) < getCost(B, Ty);
+                   });
+  if (Cheap) {
+    Candidates.resize((Candidates.size() + 1) / 2);
+  }
+  const PredicateFamily &Family =
+      Families[Candidates[rng() % Candidates.size()]];
+  LLVM_DEBUG(dbgs() << "opaque predicate " << Family.Name << " on " << *Ty
+                    << " in " << BB->getName() << "\n");
+
+  SmallVector<Value *, 2> Ops;
+  Ops.push_back(getOperand(Builder, X, DL));
+  // The other operands are values of the same type, or derived from x
+  SmallVector<Value *, 8> Others;
+  for (Value *V : Values) {
+    if (V != X && getOperandType(V, DL) == Ty) {
+      Others.push_back(V);
+    }
+  }
+  while (Ops.size() < Family.NumOperands) {
+    if (Others.empty()) {
+      Ops.push_back(Builder.CreateXor(Ops[0], ConstantInt::get(Ty, rng())));
+    } else {
+      Ops.push_back(getOperand(Builder, Others[rng() % Others.size()], DL));
+    }
+  }
+  return Family.Build(Builder, Ops);
+}
+
+} // namespace obf
@@ -0,0 +1,81 @@
+//===-- OpaquePredicate.h - always true predicates --------------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Builds opaque predicates: conditions which are true for any value of
+/// their operands, but which the optimizer does not see through. Each family
+/// is an identity of the integers modulo 2^n, such as x * (x + 1) being even
+/// or (x + y)^2 - (x - y)^2 == 4 * x * y. Identities which InstCombine knows,
+/// such as (x & y) + (x | y) == x + y, or the known low bits of an aligned
+/// address, are folded at -O2 and can not be used.
+///
+/// The operands are values already live at the insertion point: arguments,
+/// PHIs, values of the entry block and values given by the caller. Integers
+/// and addresses of 8 to 64 bits are used, frozen so that an undefined value
+/// can not make the predicate false. A function without any loads a single
+/// seed global shared by the module.
+///
+/// The cost of each family is estimated with TargetTransformInfo for the
+/// type of its operands, so the predicates of code which runs often can be
+/// restricted to the cheapest families.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_OPAQUEPREDICATE_H
+#define BABY_OBFUSCATOR_OPAQUEPREDICATE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include <random>
+
+namespace obf {
+
+/// Name of the seed global, which the functions of a module share
+static const char *const SeedGlobalName = "obf.seed";
+
+class OpaquePredicateBuilder {
+public:
+  OpaquePredicateBuilder(llvm::Function &F,
+                         const llvm::TargetTransformInfo &TTI,
+                         std::mt19937 &rng);
+
+  /// Create an always true i1 at the insertion point of \p Builder, which
+  /// must be at the end of a block. \p Live are values available there in
+  /// addition to the arguments, the PHIs of the block and the values of the
+  /// entry block. With \p Cheap, only the cheaper half of the families is
+  /// used.
+  llvm::Value *createTrue(llvm::IRBuilder<> &Builder,
+                          llvm::ArrayRef<llvm::Value *> Live, bool Cheap);
+
+  /// The volatile load of the seed global, or nullptr. It is at the top of
+  /// the entry block and must stay before the predicates using it.
+  llvm::Instruction *getSeedLoad() const { return SeedLoad; }
+
+  /// The seed global of the module, created on the first call.
+  llvm::GlobalVariable *getSeedGlobal();
+
+private:
+  llvm::Function &F;
+  const llvm::TargetTransformInfo &TTI;
+  std::mt19937 &rng;
+  /// Integers and pointers of the entry block, available in the other blocks
+  llvm::SmallVector<llvm::Value *, 16> EntryValues;
+  llvm::Instruction *SeedLoad = nullptr;
+  /// Cost of each family for each operand type
+  llvm::DenseMap<std::pair<unsigned, llvm::Type *>, unsigned> Costs;
+
+  unsigned getCost(unsigned Family, llvm::Type *Ty);
+  llvm::Value *getSeed();
+};
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_OPAQUEPREDICATE_H
@@ -0,0 +1,81 @@
+//===-- Passes.h - new pass manager interface of the passes -----*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// The passes for the new pass manager. Each one is also registered for the
+/// legacy pass manager under the same name (-obfstr, -boguscf, -subobf,
+/// -flattening, -obfuscate and -obfbudget).
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_PASSES_H
+#define BABY_OBFUSCATOR_PASSES_H
+
+#include "llvm/IR/PassManager.h"
+
+#include "Transforms.h"
+#include <string>
+#include <vector>
+
+namespace obf {
+
+/// Encrypt the constant strings of the module.
+struct ObfuscateStringPass : llvm::PassInfoMixin<ObfuscateStringPass> {
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+  static bool isRequired() { return true; }
+};
+
+/// Encrypt the strings of \p M in place and decrypt them in a module
+/// constructor, reading only the global table. obf-stream runs it instead of
+/// -obfstr on lazily loaded modules, whose function bodies are not loaded.
+bool encryptStringsInPlace(llvm::Module &M);
+
+/// Insert bogus control flow.
+struct BogusFlowPass : llvm::PassInfoMixin<BogusFlowPass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+  static bool isRequired() { return true; }
+};
+
+/// Substitute arithmetic instructions.
+struct SubstitutionPass : llvm::PassInfoMixin<SubstitutionPass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+  static bool isRequired() { return true; }
+};
+
+/// Flatten the control flow.
+struct FlatteningPass : llvm::PassInfoMixin<FlatteningPass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+  static bool isRequired() { return true; }
+};
+
+/// Substitute, add bogus control flow and flatten in one walk of each
+/// function, with the state of the transforms reused between the functions.
+struct ObfuscatePass : llvm::PassInfoMixin<ObfuscatePass> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &AM);
+  static bool isRequired() { return true; }
+
+  TransformState State;
+};
+
+/// Share -obf-size-budget and -obf-time-budget between \p Passes, or the
+/// passes of -obf-budget-passes when it is empty, before they run.
+struct BudgetPass : llvm::PassInfoMixin<BudgetPass> {
+  explicit BudgetPass(std::vector<std::string> Passes = {})
+      : Passes(std::move(Passes)) {}
+  llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+  static bool isRequired() { return true; }
+
+  std::vector<std::string> Passes;
+};
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_PASSES_H
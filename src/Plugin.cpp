@@ -0,0 +1,319 @@
+//===-- Plugin.cpp - new pass manager plugin ------------------------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Entry point of the new pass manager. The passes can be named in a pipeline
+///
+///   opt -load-pass-plugin libObfuscator.so -passes='function(flattening)'
+///
+/// and the passes of -obf-pipeline are added to the default pipelines at
+/// -obf-ep, so clang obfuscates in memory:
+///
+///   clang -O2 -fpass-plugin=libObfuscator.so
+///
+/// With -obf-thinlto, the compile steps of a ThinLTO build are left alone and
+/// the ThinLTO backends run the passes, after the imports and the inlining.
+///
+//===----------------------------------------------------------------------===//
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include "Passes.h"
+#include <algorithm>
+#include <memory>
+
+using namespace llvm;
+
+enum ExtensionPointKind {
+  PipelineStart,
+  Peephole,
+  ScalarOptimizerLate,
+  VectorizerStart,
+  OptimizerLast
+};
+
+static cl::opt<ExtensionPointKind> ExtensionPoint(
+    "obf-ep",
+    cl::desc("Where the new pass manager runs the -obf-pipeline passes"),
+    cl::values(
+        clEnumValN(PipelineStart, "pipeline-start",
+                   "Before the optimizations, on the unoptimized code"),
+        clEnumValN(Peephole, "peephole",
+                   "After each instruction combining of the function "
+                   "simplification"),
+        clEnumValN(ScalarOptimizerLate, "scalar-late",
+                   "At the end of the function simplification"),
+        clEnumValN(VectorizerStart, "vectorizer-start",
+                   "Before the loop vectorizer"),
+        clEnumValN(OptimizerLast, "optimizer-last",
+                   "After all the optimizations")),
+    cl::init(OptimizerLast), cl::Optional);
+
+static cl::list<std::string> PipelineList(
+    "obf-pipeline",
+    cl::desc("Passes added by the new pass manager to the default pipelines, "
+             "in order (default subobf,boguscf,flattening)"),
+    cl::CommaSeparated, cl::value_desc("pass,..."));
+
+static cl::opt<bool> ThinLTOBackend(
+    "obf-thinlto",
+    cl::desc("Run -obf-pipeline in the ThinLTO backends, at the end of their "
+             "optimizations, and leave the compile steps alone"),
+    cl::init(false), cl::Optional);
+
+enum SubstitutionPointKind { SubstituteAtObfEP, SubstituteLast };
+
+static cl::opt<SubstitutionPointKind> SubstitutionPoint(
+    "sub_ep",
+    cl::desc("Where the new pass manager runs -subobf when it is in "
+             "-obf-pipeline"),
+    cl::values(clEnumValN(SubstituteAtObfEP, "obf-ep",
+                          "With the other passes, at -obf-ep"),
+               clEnumValN(SubstituteLast, "optimizer-last",
+                          "After all the optimizations, so the loop and SLP "
+                          "vectorizers see the code before it is "
+                          "substituted")),
+    cl::init(SubstituteAtObfEP), cl::Optional);
+
+/// The passes named by -obf-pipeline.
+static std::vector<std::string> getPipelineNames() {
+  if (PipelineList.empty()) {
+    return {"subobf", "boguscf", "flattening"};
+  }
+  return std::vector<std::string>(PipelineList.begin(), PipelineList.end());
+}
+
+/// The passes of -obf-pipeline run at -obf-ep.
+static std::vector<std::string> getPipeline() {
+  std::vector<std::string> Names = getPipelineNames();
+  if (SubstitutionPoint == SubstituteLast) {
+    Names.erase(std::remove(Names.begin(), Names.end(), "subobf"),
+                Names.end());
+  }
+  return Names;
+}
+
+/// Add -subobf after the other passes when -sub_ep moves it there.
+static void addLateSubstitution(ModulePassManager &MPM) {
+  std::vector<std::string> Names = getPipelineNames();
+  if (SubstitutionPoint == SubstituteLast &&
+      std::find(Names.begin(), Names.end(), "subobf") != Names.end()) {
+    MPM.addPass(createModuleToFunctionPassAdaptor(obf::SubstitutionPass()));
+  }
+}
+
+static bool addFunctionPass(StringRef Name, FunctionPassManager &FPM) {
+  if (Name == "boguscf") {
+    FPM.addPass(obf::BogusFlowPass());
+  } else if (Name == "subobf") {
+    FPM.addPass(obf::SubstitutionPass());
+  } else if (Name == "flattening") {
+    FPM.addPass(obf::FlatteningPass());
+  } else if (Name == "obfuscate") {
+    FPM.addPass(obf::ObfuscatePass());
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool addModulePass(StringRef Name, ModulePassManager &MPM) {
+  if (Name == "obfstr") {
+    MPM.addPass(obf::ObfuscateStringPass());
+    return true;
+  }
+  if (Name == "obfbudget") {
+    MPM.addPass(obf::BudgetPass());
+    return true;
+  }
+  return false;
+}
+
+/// Share the budget between the function passes of -obf-pipeline, which
+/// does nothing without -obf-size-budget or -obf-time-budget.
+static void addBudget(ModulePassManager &MPM) {
+  MPM.addPass(obf::BudgetPass(getPipelineNames()));
+}
+
+/// Add the passes of -obf-pipeline at a module extension point. The function
+/// passes are grouped so each function goes through all of them in turn.
+static void addPipeline(ModulePassManager &MPM) {
+  // A function pass can only use the profile summary if it is cached
+  MPM.addPass(RequireAnalysisPass<ProfileSummaryAnalysis, Module>());
+  addBudget(MPM);
+  FunctionPassManager FPM;
+  bool HasFunctionPasses = false;
+  for (const std::string &Name : getPipeline()) {
+    if (addFunctionPass(Name, FPM)) {
+      HasFunctionPasses = true;
+      continue;
+    }
+    if (HasFunctionPasses) {
+      MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+      FPM = FunctionPassManager();
+      HasFunctionPasses = false;
+    }
+    if (!addModulePass(Name, MPM)) {
+      report_fatal_error(Twine("-obf-pipeline: unknown pass ") + Name);
+    }
+  }
+  if (HasFunctionPasses) {
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+  }
+}
+
+/// Marks the functions the passes of a function extension point obfuscated.
+static const char *const DoneAttribute = "obf-done";
+
+namespace {
+
+/// Run the passes of a function extension point once per function. The
+/// extension points may be reached several times by a function, peephole
+/// after each InstCombine, and obfuscating the obfuscated code again makes
+/// it grow without bound.
+struct OncePerFunctionPass : PassInfoMixin<OncePerFunctionPass> {
+  FunctionPassManager FPM;
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    if (F.hasFnAttribute(DoneAttribute)) {
+      return PreservedAnalyses::all();
+    }
+    F.addFnAttr(DoneAttribute);
+    return FPM.run(F, AM);
+  }
+  static bool isRequired() { return true; }
+};
+
+/// Remove the marks of OncePerFunctionPass from the output.
+struct ClearDonePass : PassInfoMixin<ClearDonePass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    for (Function &F : M) {
+      F.removeFnAttr(DoneAttribute);
+    }
+    return PreservedAnalyses::all();
+  }
+  static bool isRequired() { return true; }
+};
+
+} // namespace
+
+/// Add the function passes of -obf-pipeline at a function extension point.
+/// The module passes are left to addModulePasses.
+static void addPipeline(FunctionPassManager &FPM) {
+  OncePerFunctionPass Once;
+  for (const std::string &Name : getPipeline()) {
+    if (!addFunctionPass(Name, Once.FPM) && Name != "obfstr") {
+      report_fatal_error(Twine("-obf-pipeline: unknown pass ") + Name);
+    }
+  }
+  FPM.addPass(std::move(Once));
+}
+
+/// Add the module passes of -obf-pipeline at the end of the optimizations,
+/// when the function passes are at a function extension point.
+static void addModulePasses(ModulePassManager &MPM) {
+  for (const std::string &Name : getPipeline()) {
+    addModulePass(Name, MPM);
+  }
+}
+
+static void registerCallbacks(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, FunctionPassManager &FPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        return addFunctionPass(Name, FPM);
+      });
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        return addModulePass(Name, MPM);
+      });
+
+  // The callbacks are registered before the command line is parsed by clang,
+  // so they all check -obf-ep when the pipeline is built.
+  //
+  // Only the compile steps reach pipeline-start, the ThinLTO backends start
+  // at the simplification. Each PassBuilder builds one pipeline at a time, so
+  // it tells the later callbacks of the pipeline which step builds it: the
+  // backends obfuscate with -obf-thinlto, the compile steps without.
+  auto IsCompileStep = std::make_shared<bool>(false);
+#if LLVM_VERSION_MAJOR >= 12
+  PB.registerPipelineStartEPCallback(
+      [IsCompileStep](ModulePassManager &MPM, auto) {
+#else
+  PB.registerPipelineStartEPCallback([IsCompileStep](ModulePassManager &MPM) {
+#endif
+        *IsCompileStep = true;
+        if (ThinLTOBackend) {
+          return;
+        }
+        if (ExtensionPoint == PipelineStart) {
+          addPipeline(MPM);
+        } else if (ExtensionPoint != OptimizerLast) {
+          // The function extension points can not run a module pass
+          addBudget(MPM);
+        }
+      });
+  PB.registerPeepholeEPCallback(
+      [IsCompileStep](FunctionPassManager &FPM, auto) {
+        if (ExtensionPoint == Peephole && !ThinLTOBackend && *IsCompileStep) {
+          addPipeline(FPM);
+        }
+      });
+  PB.registerScalarOptimizerLateEPCallback(
+      [IsCompileStep](FunctionPassManager &FPM, auto) {
+        if (ExtensionPoint == ScalarOptimizerLate && !ThinLTOBackend &&
+            *IsCompileStep) {
+          addPipeline(FPM);
+        }
+      });
+  PB.registerVectorizerStartEPCallback(
+      [IsCompileStep](FunctionPassManager &FPM, auto) {
+        if (ExtensionPoint == VectorizerStart && !ThinLTOBackend &&
+            *IsCompileStep) {
+          addPipeline(FPM);
+        }
+      });
+  PB.registerOptimizerLastEPCallback(
+      [IsCompileStep](ModulePassManager &MPM, auto) {
+        bool CompileStep = *IsCompileStep;
+        *IsCompileStep = false;
+        if (ThinLTOBackend) {
+          // Since LLVM 12 the ThinLTO compile steps reach optimizer-last too
+          if (!CompileStep) {
+            addPipeline(MPM);
+            addLateSubstitution(MPM);
+          }
+          return;
+        }
+        // The ThinLTO backends would obfuscate the functions of the compile
+        // steps again. Before LLVM 12 the compile steps do not reach
+        // optimizer-last, so the backends are left to do it.
+#if LLVM_VERSION_MAJOR >= 12
+        if (!CompileStep) {
+          return;
+        }
+#endif
+        if (ExtensionPoint == OptimizerLast) {
+          addPipeline(MPM);
+        } else if (ExtensionPoint != PipelineStart) {
+          addModulePasses(MPM);
+          MPM.addPass(ClearDonePass());
+        }
+        addLateSubstitution(MPM);
+      });
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Obfuscator", LLVM_VERSION_STRING,
+          registerCallbacks};
+}
@@ -0,0 +1,272 @@
+//===-- Policy.cpp - per function selection of the passes -----------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+#include "Policy.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "Budget.h"
+
+using namespace llvm;
+
+static cl::opt<std::string>
+    PolicyFile("obf-policy",
+               cl::desc("Select the passes and their intensity per function "
+                        "with the rules of this file"),
+               cl::value_desc("filename"));
+
+static cl::opt<bool>
+    OptIn("obf-opt-in",
+          cl::desc("Only obfuscate the functions enabled by an annotation "
+                   "or a rule of -obf-policy"),
+          cl::init(false), cl::Optional);
+
+/// The words naming each pass, the pass name first.
+static const char *const PassWords[][2] = {
+    {"flattening", "fla"},
+    {"boguscf", "bcf"},
+    {"subobf", "sub"},
+    {"obfstr", "str"},
+};
+
+/// The options an annotation or a rule can override.
+static const char *const ValueNames[] = {"bcf_prob", "sub_prob", "sub_loop"};
+
+static const char *const AnnotationAttribute = "obf-annotate";
+
+/// The pass named by \p Word, or an empty string.
+static StringRef getPassName(StringRef Word) {
+  for (const auto &Names : PassWords) {
+    if (Word == Names[0] || Word == Names[1]) {
+      return Names[0];
+    }
+  }
+  return StringRef();
+}
+
+namespace obf {
+
+StringRef PassPolicy::getSourceName() const {
+  switch (Source) {
+  case PolicySource::Default:
+    return "-obf-opt-in";
+  case PolicySource::Linkage:
+    return "its available_externally linkage";
+  case PolicySource::Annotation:
+    return "an annotation";
+  case PolicySource::Rule:
+    return "an -obf-policy rule";
+  case PolicySource::Budget:
+    return "the -obfbudget budget";
+  }
+  llvm_unreachable("unknown policy source");
+}
+
+const Policy &Policy::get() {
+  static const Policy P = []() {
+    if (PolicyFile.empty()) {
+      return Policy();
+    }
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+        MemoryBuffer::getFile(PolicyFile);
+    if (!Buffer) {
+      report_fatal_error(Twine(PolicyFile) + ": " +
+                         Buffer.getError().message());
+    }
+    Expected<Policy> Parsed = parse((*Buffer)->getBuffer(), PolicyFile);
+    if (!Parsed) {
+      report_fatal_error(Parsed.takeError());
+    }
+    return std::move(*Parsed);
+  }();
+  return P;
+}
+
+Expected<Policy> Policy::parse(StringRef Text, StringRef FileName) {
+  Policy Result;
+  Result.Text.reset(new std::string(Text.str()));
+  Text = *Result.Text;
+  SmallVector<StringRef, 0> Lines;
+  Text.split(Lines, '\n');
+  for (unsigned I = 0; I < Lines.size(); I++) {
+    auto fail = [&](const Twine &Message) {
+      return createStringError(inconvertibleErrorCode(),
+                               FileName + ":" + Twine(I + 1) + ": " +
+                                   Message);
+    };
+    StringRef Line = Lines[I].split('#').first.trim();
+    if (Line.empty()) {
+      continue;
+    }
+    size_t PatternEnd = Line.find_first_of(" \t");
+    StringRef Pattern = Line.substr(0, PatternEnd);
+    Rule R;
+    if (Pattern.consume_front("re:")) {
+      R.Regex.reset(new Regex(Pattern));
+      std::string Message;
+      if (!R.Regex->isValid(Message)) {
+        return fail(Message);
+      }
+    } else {
+      Expected<GlobPattern> Glob = GlobPattern::create(Pattern);
+      if (!Glob) {
+        return fail(toString(Glob.takeError()));
+      }
+      R.Glob = std::move(*Glob);
+    }
+    if (Error E = parseWords(Line.substr(PatternEnd), R.Words)) {
+      return fail(toString(std::move(E)));
+    }
+    Result.Rules.push_back(std::move(R));
+  }
+  return Result;
+}
+
+Error Policy::parseWords(StringRef Text, Settings &Words) {
+  SmallVector<StringRef, 8> List;
+  SplitString(Text, List);
+  for (StringRef Word : List) {
+    std::pair<StringRef, StringRef> Value = Word.split('=');
+    if (!Value.second.empty()) {
+      unsigned N;
+      if (!is_contained(ValueNames, Value.first) ||
+          Value.second.getAsInteger(10, N)) {
+        return createStringError(inconvertibleErrorCode(),
+                                 "invalid setting '" + Word + "'");
+      }
+      Words.Values[Value.first] = N;
+      continue;
+    }
+    bool Enabled = !Word.consume_front("no");
+    StringRef Pass = getPassName(Word);
+    if (Pass.empty()) {
+      return createStringError(inconvertibleErrorCode(),
+                               "unknown pass '" + Word + "'");
+    }
+    Words.Passes[Pass] = Enabled;
+  }
+  return Error::success();
+}
+
+bool Policy::Rule::matches(StringRef Name) const {
+  return Glob ? Glob->match(Name) : Regex->match(Name);
+}
+
+/// Append the annotations of \p F in llvm.global.annotations to \p Found.
+/// Each annotation is a struct of the function, possibly cast, and its
+/// string, so they are found through the users of the function.
+static void findAnnotations(const Function &F,
+                            SmallVectorImpl<StringRef> &Found) {
+  SmallVector<const User *, 4> Users(F.user_begin(), F.user_end());
+  while (!Users.empty()) {
+    const User *U = Users.pop_back_val();
+    if (auto *CE = dyn_cast<ConstantExpr>(U)) {
+      if (CE->isCast()) {
+        Users.append(CE->user_begin(), CE->user_end());
+      }
+      continue;
+    }
+    auto *Annotation = dyn_cast<ConstantStruct>(U);
+    if (Annotation == nullptr || Annotation->getNumOperands() < 2) {
+      continue;
+    }
+    bool InAnnotations = any_of(Annotation->users(), [](const User *Array) {
+      return any_of(Array->users(), [](const User *GV) {
+        return isa<GlobalVariable>(GV) &&
+               GV->getName() == "llvm.global.annotations";
+      });
+    });
+    StringRef Text;
+    if (InAnnotations &&
+        getConstantStringInfo(Annotation->getOperand(1), Text)) {
+      Found.push_back(Text);
+    }
+  }
+}
+
+Policy::Settings Policy::getAnnotations(const Function &F) {
+  SmallVector<StringRef, 2> Found;
+  if (F.hasFnAttribute(AnnotationAttribute)) {
+    Found.push_back(F.getFnAttribute(AnnotationAttribute).getValueAsString());
+  }
+  findAnnotations(F, Found);
+  // The annotations of other tools are not errors
+  Settings Words;
+  for (StringRef Text : Found) {
+    consumeError(parseWords(Text, Words));
+  }
+  return Words;
+}
+
+PassPolicy Policy::lookup(const Function &F, StringRef PassName) const {
+  PassPolicy Result;
+  if (F.hasAvailableExternallyLinkage()) {
+    Result.Enabled = false;
+    Result.Source = PolicySource::Linkage;
+    return Result;
+  }
+  Settings Annotations = getAnnotations(F);
+  auto It = Annotations.Passes.find(PassName);
+  if (It != Annotations.Passes.end()) {
+    Result.Enabled = It->second;
+    Result.Source = PolicySource::Annotation;
+    return Result;
+  }
+  for (const Rule &R : make_range(Rules.rbegin(), Rules.rend())) {
+    auto It = R.Words.Passes.find(PassName);
+    if (It != R.Words.Passes.end() && R.matches(F.getName())) {
+      Result.Enabled = It->second;
+      Result.Source = PolicySource::Rule;
+      return Result;
+    }
+  }
+  if (isSkippedByBudget(F, PassName)) {
+    Result.Enabled = false;
+    Result.Source = PolicySource::Budget;
+    return Result;
+  }
+  Result.Enabled = isEnabledByDefault(PassName);
+  return Result;
+}
+
+bool Policy::isEnabledByDefault(StringRef PassName) const { return !OptIn; }
+
+unsigned Policy::getValue(const Function &F, StringRef Name,
+                          unsigned Default) const {
+  Settings Annotations = getAnnotations(F);
+  auto It = Annotations.Values.find(Name);
+  if (It != Annotations.Values.end()) {
+    return It->second;
+  }
+  for (const Rule &R : make_range(Rules.rbegin(), Rules.rend())) {
+    auto It = R.Words.Values.find(Name);
+    if (It != R.Words.Values.end() && R.matches(F.getName())) {
+      return It->second;
+    }
+  }
+  return Default;
+}
+
+void copyAnnotations(Module &M) {
+  SmallVector<StringRef, 2> Found;
+  for (Function &F : M) {
+    Found.clear();
+    findAnnotations(F, Found);
+    if (!Found.empty()) {
+      F.addFnAttr(AnnotationAttribute, join(Found, " "));
+    }
+  }
+}
+
+} // namespace obf
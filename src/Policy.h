@@ -0,0 +1,128 @@
+//===-- Policy.h - per function selection of the passes ---------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Decides which passes obfuscate each function, and how hard. The settings
+/// come from, in decreasing priority:
+///
+/// - the linkage: the available_externally copies, e.g. the functions a ThinLTO
+///   backend imported, are never emitted, they are obfuscated in the module
+///   defining them or in the callers they are inlined into;
+/// - the annotations of the function, e.g.
+///   `__attribute__((annotate("nofla")))`, read from llvm.global.annotations;
+/// - the last rule of the -obf-policy file matching the function name;
+/// - the -obfbudget allocation;
+/// - the command line: every function, or none with -obf-opt-in.
+///
+/// An annotation or a rule is a list of words separated by spaces: a pass
+/// (`fla`, `bcf`, `sub`, `str` or the pass name) enables it, the same with a
+/// `no` prefix disables it, and `<option>=<n>` overrides -bcf_prob,
+/// -sub_prob or -sub_loop. Each line of a policy file is a glob, or a regex
+/// after `re:`, followed by its words:
+///
+///   # Protect the license checks harder, leave the codecs alone
+///   check_license*   fla bcf bcf_prob=100 sub_loop=3
+///   re:^(decode|encode)_   nofla nobcf nosub
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_POLICY_H
+#define BABY_OBFUSCATOR_POLICY_H
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/Regex.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace obf {
+
+/// What decided whether a pass runs on a function.
+enum class PolicySource { Default, Linkage, Annotation, Rule, Budget };
+
+struct PassPolicy {
+  bool Enabled = true;
+  PolicySource Source = PolicySource::Default;
+
+  /// Is it enabled by an annotation or a rule, not only by default?
+  bool isExplicit() const {
+    return Enabled && (Source == PolicySource::Annotation ||
+                       Source == PolicySource::Rule);
+  }
+
+  /// The source, for the remarks.
+  llvm::StringRef getSourceName() const;
+};
+
+class Policy {
+public:
+  /// The policy of the process, with the rules of -obf-policy. The file is
+  /// read on the first call, an invalid one is a fatal error.
+  static const Policy &get();
+
+  /// Parse the rules of a policy file.
+  static llvm::Expected<Policy> parse(llvm::StringRef Text,
+                                      llvm::StringRef FileName);
+
+  /// Does the pass \p PassName run on \p F?
+  PassPolicy lookup(const llvm::Function &F, llvm::StringRef PassName) const;
+
+  /// Does \p PassName run on code outside of any function, e.g. the strings
+  /// of global initializers?
+  bool isEnabledByDefault(llvm::StringRef PassName) const;
+
+  /// The value of the intensity option \p Name (e.g. bcf_prob) for \p F,
+  /// \p Default when neither its annotations nor a rule set it.
+  unsigned getValue(const llvm::Function &F, llvm::StringRef Name,
+                    unsigned Default) const;
+
+  /// The text of the -obf-policy file, empty without one.
+  llvm::StringRef getText() const {
+    return Text ? llvm::StringRef(*Text) : llvm::StringRef();
+  }
+
+private:
+  /// The words of an annotation or a rule.
+  struct Settings {
+    /// Pass name to enabled
+    llvm::StringMap<bool> Passes;
+    /// Intensity option name to value
+    llvm::StringMap<unsigned> Values;
+  };
+
+  struct Rule {
+    llvm::Optional<llvm::GlobPattern> Glob;
+    std::unique_ptr<llvm::Regex> Regex;
+    Settings Words;
+
+    bool matches(llvm::StringRef Name) const;
+  };
+
+  std::vector<Rule> Rules;
+  /// The parsed text, which the glob patterns refer to. It is on the heap so
+  /// it does not move with the policy.
+  std::unique_ptr<std::string> Text;
+
+  static llvm::Error parseWords(llvm::StringRef Text, Settings &Words);
+  /// The settings of the annotations of \p F.
+  static Settings getAnnotations(const llvm::Function &F);
+};
+
+/// Copy the annotations of the functions of \p M to an "obf-annotate"
+/// attribute, which the policy also reads, so they stay with the functions
+/// when the module is split.
+void copyAnnotations(llvm::Module &M);
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_POLICY_H
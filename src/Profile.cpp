@@ -0,0 +1,131 @@
+//===-- Profile.cpp - run-time counters of the obfuscation ----------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+#include "Profile.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+static cl::opt<bool> ProfileGen(
+    "obf-profile-gen",
+    cl::desc("Count at run time the dispatches, the opaque predicates and "
+             "the decrypted bytes of each function, for obf-profdata"),
+    cl::init(false), cl::Optional);
+
+/// The metadata of a counting function: the thread-local slot of its
+/// counters, its descriptor in the runtime, and whether its entry gets the
+/// counters before any of them is used. A counter added after finishProfile,
+/// e.g. by a later pass into the entry block, needs another check at the new
+/// entry.
+static const char *const ProfileMetadata = "obf.profile";
+
+static void setProfileMetadata(Function &F, GlobalVariable *Slot,
+                               GlobalVariable *Descriptor, bool Finished) {
+  LLVMContext &Ctx = F.getContext();
+  Metadata *Ops[] = {ValueAsMetadata::get(Slot),
+                     ValueAsMetadata::get(Descriptor),
+                     ConstantAsMetadata::get(
+                         ConstantInt::get(Type::getInt1Ty(Ctx), Finished))};
+  F.setMetadata(ProfileMetadata, MDNode::get(Ctx, Ops));
+}
+
+/// Create the slot of \p F, the thread-local pointer to its counters which
+/// is null until its first call in the thread, and its descriptor: the name,
+/// then the next descriptor, the counters of each thread and whether it is
+/// registered, which the runtime fills.
+static void createSlot(Function &F) {
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  PointerType *CountersTy = Type::getInt64PtrTy(Ctx);
+  auto *Slot = new GlobalVariable(
+      M, CountersTy, false, GlobalValue::PrivateLinkage,
+      ConstantPointerNull::get(CountersTy), "__obfprof_slot", nullptr,
+      GlobalValue::GeneralDynamicTLSModel);
+
+  PointerType *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+  Constant *NameData = ConstantDataArray::getString(Ctx, F.getName());
+  auto *Name = new GlobalVariable(M, NameData->getType(), true,
+                                  GlobalValue::PrivateLinkage, NameData,
+                                  "__obfprof_name");
+  Name->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  StructType *DescriptorTy = StructType::get(Int8PtrTy, Int8PtrTy, Int8PtrTy,
+                                             Type::getInt32Ty(Ctx));
+  Constant *Null = ConstantPointerNull::get(Int8PtrTy);
+  auto *Descriptor = new GlobalVariable(
+      M, DescriptorTy, false, GlobalValue::PrivateLinkage,
+      ConstantStruct::get(DescriptorTy,
+                          {ConstantExpr::getPointerCast(Name, Int8PtrTy), Null,
+                           Null, ConstantInt::get(Type::getInt32Ty(Ctx), 0)}),
+      "__obfprof_function");
+  setProfileMetadata(F, Slot, Descriptor, false);
+}
+
+namespace obf {
+
+bool isProfiling() { return ProfileGen; }
+
+void incrementCounter(IRBuilder<> &Builder, ProfileCounter Counter,
+                      uint64_t Amount) {
+  Function &F = *Builder.GetInsertBlock()->getParent();
+  if (F.getMetadata(ProfileMetadata) == nullptr) {
+    createSlot(F);
+  }
+  MDNode *N = F.getMetadata(ProfileMetadata);
+  auto *Slot = mdconst::extract<GlobalVariable>(N->getOperand(0));
+  setProfileMetadata(F, Slot,
+                     mdconst::extract<GlobalVariable>(N->getOperand(1)), false);
+  Type *Int64Ty = Builder.getInt64Ty();
+  Value *Counters = Builder.CreateLoad(Slot->getValueType(), Slot);
+  Value *Ptr = Builder.CreateConstInBoundsGEP1_32(Int64Ty, Counters, Counter);
+  Value *Count = Builder.CreateLoad(Int64Ty, Ptr);
+  Builder.CreateStore(Builder.CreateAdd(Count, Builder.getInt64(Amount)), Ptr);
+}
+
+void finishProfile(Function &F) {
+  MDNode *N = F.getMetadata(ProfileMetadata);
+  if (N == nullptr ||
+      mdconst::extract<ConstantInt>(N->getOperand(2))->isOne()) {
+    return;
+  }
+  auto *Slot = mdconst::extract<GlobalVariable>(N->getOperand(0));
+  auto *Descriptor = mdconst::extract<GlobalVariable>(N->getOperand(1));
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  Type *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+  FunctionCallee Register = M.getOrInsertFunction(
+      "__obfprof_register",
+      FunctionType::get(Slot->getValueType(), {Int8PtrTy}, false));
+
+  // The allocas stay in the entry block, the rest of it runs once the
+  // counters are there
+  BasicBlock *Entry = &F.getEntryBlock();
+  BasicBlock::iterator SplitPoint = Entry->getFirstInsertionPt();
+  while (isa<AllocaInst>(*SplitPoint)) {
+    ++SplitPoint;
+  }
+  BasicBlock *Body = Entry->splitBasicBlock(SplitPoint);
+  BasicBlock *RegisterBB =
+      BasicBlock::Create(Ctx, "obfprof.register", &F, Body);
+  Entry->getTerminator()->eraseFromParent();
+  IRBuilder<> Builder(Entry);
+  Value *Counters = Builder.CreateLoad(Slot->getValueType(), Slot);
+  Builder.CreateCondBr(Builder.CreateIsNull(Counters), RegisterBB, Body,
+                       MDBuilder(Ctx).createBranchWeights(1, 1000));
+  Builder.SetInsertPoint(RegisterBB);
+  Builder.CreateStore(
+      Builder.CreateCall(Register,
+                         {ConstantExpr::getPointerCast(Descriptor, Int8PtrTy)}),
+      Slot);
+  Builder.CreateBr(Body);
+  setProfileMetadata(F, Slot, Descriptor, true);
+}
+
+} // namespace obf
@@ -0,0 +1,52 @@
+//===-- Profile.h - run-time counters of the obfuscation --------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// With -obf-profile-gen, the passes count at run time what the obfuscation
+/// costs each function: the iterations of the -flattening dispatchers, the
+/// -boguscf opaque predicates evaluated and the bytes -obfstr decrypts.
+///
+/// Each thread has its own counters per function, so counting is a plain
+/// add. A function gets the counters of the running thread on entry: the
+/// first call in a thread asks the runtime of test/obfprof.c for them, which
+/// keeps them in lock-free lists and writes them all at exit for
+/// obf-profdata.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_PROFILE_H
+#define BABY_OBFUSCATOR_PROFILE_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+
+namespace obf {
+
+/// The counters of a function, in the order of the dump.
+enum ProfileCounter : unsigned {
+  DispatchCounter,
+  PredicateCounter,
+  DecryptedBytesCounter,
+  NumProfileCounters
+};
+
+/// Is -obf-profile-gen given?
+bool isProfiling();
+
+/// Add \p Amount to the counter \p Counter of the function \p Builder inserts
+/// into. The function must then be finished with finishProfile.
+void incrementCounter(llvm::IRBuilder<> &Builder, ProfileCounter Counter,
+                      uint64_t Amount = 1);
+
+/// Get the counters of the running thread on entry to \p F, if it counts
+/// anything and does not get them yet. It splits the entry block, so it is
+/// called once the pass is done with the CFG.
+void finishProfile(llvm::Function &F);
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_PROFILE_H
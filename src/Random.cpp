@@ -0,0 +1,64 @@
+//===-- Random.cpp - random numbers of the passes -------------------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+#include "Random.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned long long>
+    Seed("obf-seed",
+         cl::desc("Seed of the obfuscation passes, the output is reproducible "
+                  "when it is given"),
+         cl::value_desc("seed"), cl::Optional);
+
+namespace obf {
+
+uint64_t hashFunction(const Function &F) {
+  // Types are hashed through their printed form, their IDs are not stable
+  std::string Buffer;
+  raw_string_ostream OS(Buffer);
+  OS << F.getName() << ' ';
+  F.getFunctionType()->print(OS);
+  for (const Instruction &I : instructions(F)) {
+    OS << ' ' << I.getOpcodeName() << ' ' << I.getNumOperands() << ' ';
+    I.getType()->print(OS);
+    // Constants make functions with the same shape differ
+    for (const Value *Op : I.operand_values()) {
+      if (const ConstantInt *C = dyn_cast<ConstantInt>(Op)) {
+        OS << ' ' << C->getValue();
+      }
+    }
+  }
+  MD5 Hash;
+  Hash.update(OS.str());
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  return Result.low();
+}
+
+std::mt19937 createRNG(const Function &F, StringRef PassName) {
+  if (Seed.getNumOccurrences() == 0) {
+    return std::mt19937(std::random_device{}());
+  }
+  uint64_t FunctionHash = hashFunction(F);
+  MD5 Hash;
+  Hash.update(PassName);
+  MD5::MD5Result PassHash;
+  Hash.final(PassHash);
+  std::seed_seq Sequence{
+      uint32_t(Seed), uint32_t(Seed >> 32), uint32_t(FunctionHash),
+      uint32_t(FunctionHash >> 32), uint32_t(PassHash.low()),
+      uint32_t(PassHash.low() >> 32)};
+  return std::mt19937(Sequence);
+}
+
+} // namespace obf
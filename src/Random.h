@@ -0,0 +1,34 @@
+//===-- Random.h - random numbers of the passes -----------------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Seeds the random generators of the passes. With -obf-seed, each function
+/// gets its own stream derived from the seed, the pass and a stable hash of
+/// the function, so the output only depends on the input and the options.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_RANDOM_H
+#define BABY_OBFUSCATOR_RANDOM_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include <random>
+
+namespace obf {
+
+/// Hash of the name, the type and the instructions of \p F, which does not
+/// depend on the rest of the module nor on the process.
+uint64_t hashFunction(const llvm::Function &F);
+
+/// Generator for the pass \p PassName on \p F.
+/// Seeded from std::random_device unless -obf-seed is given.
+std::mt19937 createRNG(const llvm::Function &F, llvm::StringRef PassName);
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_RANDOM_H
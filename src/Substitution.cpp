@@ -1,14 +1,31 @@
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Timer.h"
 
+#include "Budget.h"
+#include "Passes.h"
+#include "Policy.h"
+#include "Transforms.h"
+#include "Utils.h"
+#include <cmath>
 #include <random>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "subobf"
+
+STATISTIC(NumSubstituted, "Number of instructions substituted");
+STATISTIC(NumBudgetExhausted,
+          "Number of functions which used up their growth budget");
+
 static cl::opt<int>
     ObfTimes("sub_loop",
              cl::desc("Choose how many time the -sub pass loops on a function"),
@@ -20,92 +37,354 @@ static cl::opt<unsigned int>
                          "obfuscated by the InstructioSubstitution pass"),
                 cl::value_desc("probability rate"), cl::init(50), cl::Optional);
 
-struct SubstitutionPass : public FunctionPass {
-  static char ID;
-  // Store the substitution function
-  SmallVector<void (SubstitutionPass::*)(Instruction *), 3> addFunc;
-  SmallVector<void (SubstitutionPass::*)(Instruction *), 2> subFunc;
-  std::mt19937 rng;
-
-  SubstitutionPass() : FunctionPass(ID), rng(std::random_device{}()) {
-    addFunc = {&SubstitutionPass::addNeg, &SubstitutionPass::addRand,
-               &SubstitutionPass::addDoubleNeg};
-    subFunc = {&SubstitutionPass::subNeg, &SubstitutionPass::subRand};
-  }
+static cl::opt<unsigned> GrowthBudget(
+    "sub_budget",
+    cl::desc("Stop substituting in a function once it grew by this "
+             "percentage of its size (0 is unlimited)"),
+    cl::value_desc("percent"), cl::init(300), cl::Optional);
+
+/// A rewrite of `a = b op c` into an equivalent sequence. \p r is a random
+/// constant of the type of the operands, splat when they are vectors. The
+/// rewrites only use lane-wise operations valid for any width, so vector
+/// code stays vector code.
+using RewriteFn = Value *(*)(IRBuilder<> &, Value *b, Value *c, Constant *r);
+
+struct SubstitutionRule {
+  unsigned Opcode;
+  /// Number of instructions the rewrite builds
+  unsigned Cost;
+  RewriteFn Rewrite;
+};
+
+/// a = b - (-c)
+static Value *addNeg(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateSub(b, builder.CreateNeg(c));
+}
+
+/// a = -(-b + (-c))
+static Value *addDoubleNeg(IRBuilder<> &builder, Value *b, Value *c,
+                           Constant *) {
+  Value *a = builder.CreateAdd(builder.CreateNeg(b), builder.CreateNeg(c));
+  return builder.CreateNeg(a);
+}
+
+/// a = b + r; a = a + c; a = a - r
+static Value *addRand(IRBuilder<> &builder, Value *b, Value *c, Constant *r) {
+  Value *a = builder.CreateAdd(b, r);
+  a = builder.CreateAdd(a, c);
+  return builder.CreateSub(a, r);
+}
+
+/// a = (b ^ c) + 2 * (b & c)
+static Value *addXorAnd(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  Value *carry = builder.CreateAnd(b, c);
+  carry = builder.CreateAdd(carry, carry);
+  return builder.CreateAdd(builder.CreateXor(b, c), carry);
+}
+
+/// a = (b | c) + (b & c)
+static Value *addOrAnd(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateAdd(builder.CreateOr(b, c), builder.CreateAnd(b, c));
+}
+
+/// a = b + (-c)
+static Value *subNeg(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateAdd(b, builder.CreateNeg(c));
+}
+
+/// a = b + r; a = a - c; a = a - r
+static Value *subRand(IRBuilder<> &builder, Value *b, Value *c, Constant *r) {
+  Value *a = builder.CreateAdd(b, r);
+  a = builder.CreateSub(a, c);
+  return builder.CreateSub(a, r);
+}
+
+/// a = (b & ~c) - (~b & c)
+static Value *subAndNot(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  Value *lhs = builder.CreateAnd(b, builder.CreateNot(c));
+  return builder.CreateSub(lhs, builder.CreateAnd(builder.CreateNot(b), c));
+}
+
+/// a = (b | c) - (b & c)
+static Value *xorOrAnd(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateSub(builder.CreateOr(b, c), builder.CreateAnd(b, c));
+}
+
+/// a = (~b & c) | (b & ~c)
+static Value *xorAndNot(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  Value *lhs = builder.CreateAnd(builder.CreateNot(b), c);
+  return builder.CreateOr(lhs, builder.CreateAnd(b, builder.CreateNot(c)));
+}
+
+/// a = (b + c) - 2 * (b & c)
+static Value *xorSumAnd(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  Value *carry = builder.CreateAnd(b, c);
+  carry = builder.CreateAdd(carry, carry);
+  return builder.CreateSub(builder.CreateAdd(b, c), carry);
+}
+
+/// a = (b + c) - (b | c)
+static Value *andSumOr(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateSub(builder.CreateAdd(b, c), builder.CreateOr(b, c));
+}
+
+/// a = ~(~b | ~c)
+static Value *andDeMorgan(IRBuilder<> &builder, Value *b, Value *c,
+                          Constant *) {
+  Value *a = builder.CreateOr(builder.CreateNot(b), builder.CreateNot(c));
+  return builder.CreateNot(a);
+}
+
+/// a = (b ^ ~c) & b
+static Value *andXorNot(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateAnd(builder.CreateXor(b, builder.CreateNot(c)), b);
+}
+
+/// a = (b & c) + (b ^ c)
+static Value *orAndXor(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateAdd(builder.CreateAnd(b, c), builder.CreateXor(b, c));
+}
+
+/// a = (b + c) - (b & c)
+static Value *orSumAnd(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateSub(builder.CreateAdd(b, c), builder.CreateAnd(b, c));
+}
+
+/// a = ~(~b & ~c)
+static Value *orDeMorgan(IRBuilder<> &builder, Value *b, Value *c,
+                         Constant *) {
+  Value *a = builder.CreateAnd(builder.CreateNot(b), builder.CreateNot(c));
+  return builder.CreateNot(a);
+}
+
+/// a = -(b * -c)
+static Value *mulNeg(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  return builder.CreateNeg(builder.CreateMul(b, builder.CreateNeg(c)));
+}
+
+/// a = b * (c + r) - b * r
+static Value *mulRand(IRBuilder<> &builder, Value *b, Value *c, Constant *r) {
+  Value *a = builder.CreateMul(b, builder.CreateAdd(c, r));
+  return builder.CreateSub(a, builder.CreateMul(b, r));
+}
 
-  virtual bool runOnFunction(Function &F) {
-    for (int i = 0; i < ObfTimes; i++) {
-      for (auto &&bb : F) {
-        for (auto &&inst : bb) {
-          if (rng() % 100 >= ObfProbRate && !inst.isBinaryOp()) {
+/// a = (b & c) * (b | c) + (b & ~c) * (~b & c)
+static Value *mulAndOr(IRBuilder<> &builder, Value *b, Value *c, Constant *) {
+  Value *lhs =
+      builder.CreateMul(builder.CreateAnd(b, c), builder.CreateOr(b, c));
+  Value *rhs = builder.CreateMul(builder.CreateAnd(b, builder.CreateNot(c)),
+                                 builder.CreateAnd(builder.CreateNot(b), c));
+  return builder.CreateAdd(lhs, rhs);
+}
+
+static constexpr SubstitutionRule Rules[] = {
+    {Instruction::Add, 2, addNeg},      {Instruction::Add, 4, addDoubleNeg},
+    {Instruction::Add, 3, addRand},     {Instruction::Add, 4, addXorAnd},
+    {Instruction::Add, 3, addOrAnd},    {Instruction::Sub, 2, subNeg},
+    {Instruction::Sub, 3, subRand},     {Instruction::Sub, 5, subAndNot},
+    {Instruction::Xor, 3, xorOrAnd},    {Instruction::Xor, 5, xorAndNot},
+    {Instruction::Xor, 4, xorSumAnd},   {Instruction::And, 3, andSumOr},
+    {Instruction::And, 4, andDeMorgan}, {Instruction::And, 3, andXorNot},
+    {Instruction::Or, 3, orAndXor},     {Instruction::Or, 3, orSumAnd},
+    {Instruction::Or, 4, orDeMorgan},   {Instruction::Mul, 3, mulNeg},
+    {Instruction::Mul, 4, mulRand},     {Instruction::Mul, 9, mulAndOr},
+};
+
+/// -sub_prob and -sub_loop, or their overrides for \p F.
+static unsigned getProbability(const Function &F) {
+  return obf::Policy::get().getValue(F, "sub_prob", ObfProbRate);
+}
+
+static unsigned getRounds(const Function &F) {
+  return obf::Policy::get().getValue(F, "sub_loop",
+                                     std::max(ObfTimes.getValue(), 0));
+}
+
+struct Substitution {
+  std::mt19937 &rng;
+  SmallVectorImpl<Instruction *> &worklist;
+
+  explicit Substitution(obf::TransformState &State)
+      : rng(State.RNG), worklist(State.Worklist) {}
+
+  bool runOnFunction(Function &F, OptimizationRemarkEmitter &ORE) {
+    obf::PassPolicy policy = obf::Policy::get().lookup(F, DEBUG_TYPE);
+    if (!policy.Enabled) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "Disabled", &F)
+               << "not substituted: disabled by " << policy.getSourceName();
+      });
+      return false;
+    }
+    unsigned instructionsBefore = obf::countInstructions(F, ORE, DEBUG_TYPE);
+    unsigned substituted = 0;
+    NamedRegionTimer timer("substitute", "Substitute the instructions",
+                           DEBUG_TYPE, "Instruction substitution",
+                           TimePassesIsEnabled);
+    // Each substitution replaces one instruction by Cost ones
+    uint64_t budget = GrowthBudget == 0
+                          ? UINT64_MAX
+                          : uint64_t(F.getInstructionCount()) * GrowthBudget /
+                                100;
+    uint64_t growth = 0;
+    bool exhausted = false;
+    SmallVector<const SubstitutionRule *, 8> candidates;
+    unsigned probability = getProbability(F);
+    unsigned rounds = getRounds(F);
+    for (unsigned i = 0; i < rounds && !exhausted; i++) {
+      // The instructions built in this round are only visited by the next
+      worklist.clear();
+      for (Instruction &inst : instructions(F)) {
+        if (isa<BinaryOperator>(inst) && inst.getType()->isIntOrIntVectorTy()) {
+          worklist.push_back(&inst);
+        }
+      }
+      for (Instruction *inst : worklist) {
+        if (rng() % 100 >= probability) {
+          continue;
+        }
+        candidates.clear();
+        bool supported = false;
+        for (const SubstitutionRule &rule : Rules) {
+          if (rule.Opcode != inst->getOpcode()) {
             continue;
           }
-          // Instruction replacement is based on the type of opcode.
-          switch (inst.getOpcode()) {
-          case Instruction::Add:
-            (this->*addFunc[rng() % addFunc.size()])(&inst);
-            break;
-          case Instruction::Sub:
-            (this->*subFunc[rng() % subFunc.size()])(&inst);
-            break;
-
-          default:
-            break;
+          supported = true;
+          if (growth + rule.Cost - 1 <= budget) {
+            candidates.push_back(&rule);
           }
         }
+        if (!supported) {
+          continue;
+        }
+        if (candidates.empty()) {
+          exhausted = true;
+          break;
+        }
+        const SubstitutionRule &rule = *candidates[rng() % candidates.size()];
+        IRBuilder<> builder(inst);
+        Constant *r = ConstantInt::get(inst->getType(), rng());
+        Value *a = rule.Rewrite(builder, inst->getOperand(0),
+                                inst->getOperand(1), r);
+        inst->replaceAllUsesWith(a);
+        inst->eraseFromParent();
+        growth += rule.Cost - 1;
+        substituted++;
       }
     }
-    return true;
+    worklist.clear();
+    NumSubstituted += substituted;
+    if (exhausted) {
+      NumBudgetExhausted++;
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "BudgetExhausted", &F)
+               << "stopped substituting at the -sub_budget limit, after "
+               << "adding " << ore::NV("Growth", growth) << " instructions";
+      });
+    }
+    ORE.emit([&]() {
+      OptimizationRemark remark(DEBUG_TYPE, "Substituted", &F);
+      remark << "substituted " << ore::NV("Instructions", substituted)
+             << " instructions";
+      obf::addInstructionDelta(remark, F, instructionsBefore);
+      return remark;
+    });
+    return substituted != 0;
   }
+};
 
-  /// a = b + c
-  /// a = b - (-c)
-  void addNeg(Instruction *I) {
-    IRBuilder<> builder(I);
-    Value *c = builder.CreateNeg(I->getOperand(1));
-    Value *a = builder.CreateSub(I->getOperand(0), c);
-    I->replaceAllUsesWith(a);
+/// Each round rewrites an operation with -sub_prob into the average number
+/// of instructions of its rules, which are operations again, so an operation
+/// grows geometrically with -sub_loop until -sub_budget stops it.
+obf::TransformCost
+obf::estimateSubstitution(obf::FunctionCostModel &Model) {
+  obf::TransformCost Cost;
+  double prob = std::min(getProbability(Model.getFunction()), 100u) / 100.0;
+  unsigned rounds = getRounds(Model.getFunction());
+  SmallVector<double, 16> blockGrowths;
+  double growth = 0;
+  for (const obf::BlockCost &block : Model.blocks()) {
+    double blockGrowth = 0;
+    for (const Instruction &inst : *block.BB) {
+      if (!isa<BinaryOperator>(inst) || !inst.getType()->isIntOrIntVectorTy()) {
+        continue;
+      }
+      unsigned rules = 0;
+      unsigned ruleCost = 0;
+      for (const SubstitutionRule &rule : Rules) {
+        if (rule.Opcode == inst.getOpcode()) {
+          rules++;
+          ruleCost += rule.Cost;
+        }
+      }
+      if (rules == 0) {
+        continue;
+      }
+      double factor = 1 + prob * (double(ruleCost) / rules - 1);
+      blockGrowth += std::pow(factor, rounds) - 1;
+      Cost.Coverage += 1 - std::pow(1 - prob, rounds);
+    }
+    blockGrowths.push_back(blockGrowth);
+    growth += blockGrowth;
   }
-
-  /// r = rand(); a = b + r; a = a + c; a = a - r
-  void addRand(Instruction *I) {
-    IRBuilder<> builder(I);
-    Constant *r = builder.getInt32(rng());
-    Value *a = builder.CreateAdd(I->getOperand(0), r);
-    a = builder.CreateAdd(a, I->getOperand(1));
-    a = builder.CreateSub(a, r);
-    I->replaceAllUsesWith(a);
+  double scale = 1;
+  if (GrowthBudget != 0 && growth > 0) {
+    double budget =
+        double(Model.getFunction().getInstructionCount()) * GrowthBudget / 100;
+    scale = std::min(1.0, budget / growth);
+  }
+  // The substituted blocks are the ones -boguscf clones
+  for (unsigned i = 0, e = blockGrowths.size(); i != e; ++i) {
+    obf::BlockCost &block = Model.blocks()[i];
+    double added = blockGrowths[i] * scale;
+    double cost = added * Model.getArithmeticCost();
+    Cost.Size += cost;
+    Cost.Time += block.Frequency * cost;
+    block.Instructions += added;
+    block.Size += cost;
+    block.Time += cost;
   }
+  Cost.Time *= Model.getCalls();
+  return Cost;
+}
+
+bool obf::substitute(Function &F, obf::TransformState &State,
+                     OptimizationRemarkEmitter &ORE) {
+  return Substitution(State).runOnFunction(F, ORE);
+}
 
-  /// a = -(-b + (-c))
-  void addDoubleNeg(Instruction *I) {
-    IRBuilder<> builder(I);
-    Value *c = builder.CreateNeg(I->getOperand(1));
-    Value *b = builder.CreateNeg(I->getOperand(0));
-    Value *a = builder.CreateAdd(b, c);
-    a = builder.CreateNeg(a);
-    I->replaceAllUsesWith(a);
+PreservedAnalyses obf::SubstitutionPass::run(Function &F,
+                                             FunctionAnalysisManager &AM) {
+  auto &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+  obf::TransformState State;
+  State.reset(F, DEBUG_TYPE);
+  if (!obf::substitute(F, State, ORE)) {
+    return PreservedAnalyses::all();
   }
+  // Only instructions are added, the CFG is unchanged
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+
+struct LegacySubstitutionPass : public FunctionPass {
+  static char ID;
+  obf::TransformState State;
+
+  LegacySubstitutionPass() : FunctionPass(ID) {}
 
-  /// a = b + (-c)
-  void subNeg(Instruction *I) {
-    IRBuilder<> builder(I);
-    Value *c = builder.CreateNeg(I->getOperand(1));
-    Value *a = builder.CreateAdd(I->getOperand(0), c);
-    I->replaceAllUsesWith(a);
+  bool runOnFunction(Function &F) override {
+    auto &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+    State.reset(F, DEBUG_TYPE);
+    return obf::substitute(F, State, ORE);
   }
 
-  /// r = rand(); a = b + r; a = a - c; a = a - r
-  void subRand(Instruction *I) {
-    IRBuilder<> builder(I);
-    Constant *r = builder.getInt32(rng());
-    Value *a = builder.CreateAdd(I->getOperand(0), r);
-    a = builder.CreateSub(a, I->getOperand(1));
-    a = builder.CreateSub(a, r);
-    I->replaceAllUsesWith(a);
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+    AU.setPreservesCFG();
   }
 };
 
-char SubstitutionPass::ID = 2;
-static RegisterPass<SubstitutionPass> X("subobf",
+char LegacySubstitutionPass::ID = 2;
+static RegisterPass<LegacySubstitutionPass> X("subobf",
                                         "Enable Instruction Substitution");
\ No newline at end of file
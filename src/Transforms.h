@@ -0,0 +1,65 @@
+//===-- Transforms.h - the function transforms ------------------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// The transforms behind -subobf, -boguscf and -flattening, and the state
+/// they share. Each pass runs its transform with a state of its own, and
+/// -obfuscate runs the three of them on each function with one state.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_TRANSFORMS_H
+#define BABY_OBFUSCATOR_TRANSFORMS_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+
+#include "Hotness.h"
+#include <random>
+
+namespace obf {
+
+/// The state of the transforms of a function: the random stream and the
+/// scratch containers. A pass keeps one for all the functions it runs on and
+/// resets it for each, so the containers keep their memory.
+struct TransformState {
+  std::mt19937 RNG;
+  /// The blocks of the function when it was reset, for the transforms which
+  /// do not change the CFG. A transform may reuse it once done with them.
+  llvm::SmallVector<llvm::BasicBlock *, 0> Blocks;
+  /// Instructions to rewrite, filled and emptied by each transform
+  llvm::SmallVector<llvm::Instruction *, 0> Worklist;
+  llvm::DominatorTree DT;
+  llvm::LoopInfo LI;
+
+  /// Start on \p F with the random stream of \p PassName.
+  void reset(llvm::Function &F, llvm::StringRef PassName);
+};
+
+/// Substitute the arithmetic instructions of \p F, see -subobf.
+bool substitute(llvm::Function &F, TransformState &State,
+                llvm::OptimizationRemarkEmitter &ORE);
+
+/// Add bogus control flow to the blocks of State.Blocks, see -boguscf.
+bool addBogusFlow(llvm::Function &F, TransformState &State,
+                  const HotnessInfo &Hotness,
+                  const llvm::TargetTransformInfo &TTI,
+                  llvm::OptimizationRemarkEmitter &ORE);
+
+/// Flatten \p F, see -flattening. \p LI is only used by -fla_loops.
+bool flatten(llvm::Function &F, TransformState &State,
+             const HotnessInfo &Hotness, llvm::LoopInfo &LI,
+             llvm::OptimizationRemarkEmitter &ORE);
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_TRANSFORMS_H
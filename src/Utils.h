@@ -0,0 +1,83 @@
+//===-- Utils.h - helpers shared by the obfuscation passes ------*- C++ -*-===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// Small helpers used by more than one pass.
+///
+//===----------------------------------------------------------------------===//
+#ifndef BABY_OBFUSCATOR_UTILS_H
+#define BABY_OBFUSCATOR_UTILS_H
+
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#if LLVM_VERSION_MAJOR >= 12
+#include "llvm/Support/InstructionCost.h"
+#endif
+
+namespace obf {
+
+/// Set the alignment of a load or store instruction.
+/// LLVM 10 replaced the `unsigned` alignment by `Align`, hide it here.
+template <typename MemInstTy>
+inline void setAlignment(MemInstTy *I, unsigned Alignment) {
+#if LLVM_VERSION_MAJOR >= 10
+  I->setAlignment(llvm::Align(Alignment));
+#else
+  I->setAlignment(Alignment);
+#endif
+}
+
+/// Create a strong `cmpxchg` on a naturally aligned \p Ptr.
+inline llvm::AtomicCmpXchgInst *
+createAtomicCmpXchg(llvm::IRBuilder<> &builder, llvm::Value *Ptr,
+                    llvm::Value *Cmp, llvm::Value *New,
+                    llvm::AtomicOrdering SuccessOrdering,
+                    llvm::AtomicOrdering FailureOrdering) {
+#if LLVM_VERSION_MAJOR >= 13
+  return builder.CreateAtomicCmpXchg(Ptr, Cmp, New, llvm::MaybeAlign(),
+                                     SuccessOrdering, FailureOrdering);
+#else
+  return builder.CreateAtomicCmpXchg(Ptr, Cmp, New, SuccessOrdering,
+                                     FailureOrdering);
+#endif
+}
+
+/// LLVM 12 started to return the TTI costs as InstructionCost. An invalid
+/// cost counts as very expensive.
+inline unsigned toCost(int Cost) { return Cost; }
+#if LLVM_VERSION_MAJOR >= 12
+inline unsigned toCost(const llvm::InstructionCost &Cost) {
+  return Cost.isValid() ? *Cost.getValue() : 1000;
+}
+#endif
+
+/// Count the instructions of \p F for the remarks of \p PassName. Counting
+/// walks the whole function, so it is only done when the remarks are enabled,
+/// 0 is returned otherwise.
+inline unsigned countInstructions(const llvm::Function &F,
+                                  const llvm::OptimizationRemarkEmitter &ORE,
+                                  const char *PassName) {
+  return ORE.allowExtraAnalysis(PassName) ? F.getInstructionCount() : 0;
+}
+
+/// Append the growth of \p F since it had \p Before instructions to \p R.
+template <typename RemarkT>
+void addInstructionDelta(RemarkT &R, const llvm::Function &F,
+                         unsigned Before) {
+  unsigned After = F.getInstructionCount();
+  R << " (" << llvm::ore::NV("InstructionsBefore", Before) << " -> "
+    << llvm::ore::NV("InstructionsAfter", After) << " instructions, "
+    << llvm::ore::NV("InstructionDelta", int64_t(After) - int64_t(Before))
+    << ")";
+}
+
+} // namespace obf
+
+#endif // BABY_OBFUSCATOR_UTILS_H
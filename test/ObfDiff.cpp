@@ -0,0 +1,530 @@
+//===-- ObfDiff.cpp - differential run of an obfuscated module ------------===//
+//
+// LLVM project is under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+///
+/// \file
+/// obf-diff checks that an obfuscated module behaves like the original one
+/// without building and running a program. Both modules are compiled by two
+/// ORC LLJITs in the same process; the exported functions of both are called
+/// with the same generated arguments, and their results and the globals they
+/// write are compared. The time of the calls on each side gives the overhead
+/// of the obfuscation per function.
+///
+///   obf-diff test.ll test_obfuscated.bc -inputs=1000 -repeat=10
+///
+/// __decrypt and __encrypt come from a runtime built into the tool, so
+/// encrypt.c is not needed; the other symbols are looked up in the process.
+/// The functions whose arguments and result are integers of at most 64 bits,
+/// float or double are called, through a wrapper added to both modules which
+/// takes them as 64-bit words. The others are skipped.
+///
+//===----------------------------------------------------------------------===//
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cstring>
+#include <random>
+
+using namespace llvm;
+
+static cl::opt<std::string> OriginalFilename(cl::Positional,
+                                             cl::desc("<original module>"),
+                                             cl::Required);
+
+static cl::opt<std::string> ObfuscatedFilename(cl::Positional,
+                                               cl::desc("<obfuscated module>"),
+                                               cl::Required);
+
+static cl::list<std::string>
+    EntryList("entry",
+              cl::desc("Functions to call (default: every exported function "
+                       "but main)"),
+              cl::CommaSeparated, cl::value_desc("function,..."));
+
+static cl::opt<unsigned>
+    NumInputs("inputs",
+              cl::desc("Argument lists each function is called with"),
+              cl::init(100));
+
+static cl::opt<unsigned>
+    Repeat("repeat",
+           cl::desc("Calls timed with each argument list, for the short "
+                    "functions"),
+           cl::init(1));
+
+static cl::opt<unsigned long long>
+    InputRange("input-range",
+               cl::desc("The generated arguments are in [-n, n], the first "
+                        "ones are 0, 1, -1, n and -n"),
+               cl::value_desc("n"), cl::init(1024));
+
+static cl::opt<unsigned> Seed("seed", cl::desc("Seed of the arguments"),
+                              cl::init(1));
+
+static cl::opt<unsigned>
+    MaxReports("max-reports",
+               cl::desc("Differences reported per function (default 5)"),
+               cl::init(5));
+
+static const char *ToolName;
+static ExitOnError ExitOnErr;
+
+static void error(const Twine &Message) {
+  WithColor::error(errs(), ToolName) << Message << "\n";
+  exit(1);
+}
+
+/// The runtime of the call mode of -obfstr, with the key of test/encrypt.c.
+static char *xorString(char *Str, uint64_t Length) {
+  for (uint64_t I = 0; I < Length; I++) {
+    Str[I] ^= 42;
+  }
+  return Str;
+}
+
+namespace {
+
+/// How an argument or a result is stored in a 64-bit word.
+struct WordKind {
+  enum { Void, Integer, Float, Double } Kind;
+  unsigned Bits;
+
+  /// The kind of \p Ty, false when it does not fit in a word.
+  static bool get(Type *Ty, WordKind &Result) {
+    if (Ty->isVoidTy()) {
+      Result = {Void, 0};
+    } else if (Ty->isIntegerTy() && Ty->getIntegerBitWidth() <= 64) {
+      Result = {Integer, Ty->getIntegerBitWidth()};
+    } else if (Ty->isFloatTy()) {
+      Result = {Float, 32};
+    } else if (Ty->isDoubleTy()) {
+      Result = {Double, 64};
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  /// The word of \p Value, which is in [-InputRange, InputRange].
+  uint64_t fromInteger(int64_t Value) const {
+    if (Kind == Float) {
+      float F = Value;
+      uint32_t Word;
+      memcpy(&Word, &F, sizeof(Word));
+      return Word;
+    }
+    if (Kind == Double) {
+      double D = Value;
+      uint64_t Word;
+      memcpy(&Word, &D, sizeof(Word));
+      return Word;
+    }
+    return Bits == 64 ? Value : Value & ((uint64_t(1) << Bits) - 1);
+  }
+
+  void print(raw_ostream &OS, uint64_t Word) const {
+    if (Kind == Float) {
+      float F;
+      uint32_t Low = Word;
+      memcpy(&F, &Low, sizeof(F));
+      OS << format("%g", F);
+    } else if (Kind == Double) {
+      double D;
+      memcpy(&D, &Word, sizeof(D));
+      OS << format("%g", D);
+    } else if (Kind == Integer) {
+      OS << APInt(Bits, Word).getSExtValue();
+    } else {
+      OS << "void";
+    }
+  }
+};
+
+/// A function called on both sides.
+struct Entry {
+  std::string Name;
+  SmallVector<WordKind, 4> Params;
+  WordKind Result;
+
+  void printCall(raw_ostream &OS, ArrayRef<uint64_t> Args) const {
+    OS << Name << '(';
+    for (unsigned I = 0; I < Params.size(); I++) {
+      OS << (I == 0 ? "" : ", ");
+      Params[I].print(OS, Args[I]);
+    }
+    OS << ')';
+  }
+};
+
+/// The wrapper of each entry takes the arguments and stores the result as
+/// 64-bit words.
+using WrapperFn = void (*)(const uint64_t *, uint64_t *);
+
+/// One of the two modules, compiled by its own JIT.
+struct Side {
+  std::unique_ptr<orc::LLJIT> JIT;
+  std::vector<WrapperFn> Wrappers;
+  /// Address and size of each compared global, null when it is missing
+  std::vector<std::pair<char *, uint64_t>> Globals;
+  /// Total time of the calls of each entry
+  std::vector<std::chrono::nanoseconds> Times;
+};
+
+} // namespace
+
+static std::unique_ptr<Module> loadModule(StringRef Path, LLVMContext &Ctx) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(Path, Err, Ctx);
+  if (!M) {
+    Err.print(ToolName, errs());
+    exit(1);
+  }
+  return M;
+}
+
+static std::string printType(Type *Ty) {
+  std::string Buffer;
+  raw_string_ostream OS(Buffer);
+  Ty->print(OS);
+  return OS.str();
+}
+
+static std::string getWrapperName(unsigned Index) {
+  return "__obfdiff_call_" + std::to_string(Index);
+}
+
+static Value *fromWord(IRBuilder<> &Builder, Value *Word, Type *Ty) {
+  if (Ty->isIntegerTy()) {
+    return Builder.CreateZExtOrTrunc(Word, Ty);
+  }
+  if (Ty->isFloatTy()) {
+    return Builder.CreateBitCast(
+        Builder.CreateTrunc(Word, Builder.getInt32Ty()), Ty);
+  }
+  return Builder.CreateBitCast(Word, Ty);
+}
+
+static Value *toWord(IRBuilder<> &Builder, Value *V) {
+  Type *Ty = V->getType();
+  if (Ty->isVoidTy()) {
+    return Builder.getInt64(0);
+  }
+  if (Ty->isIntegerTy()) {
+    return Builder.CreateZExtOrTrunc(V, Builder.getInt64Ty());
+  }
+  if (Ty->isFloatTy()) {
+    return Builder.CreateZExt(Builder.CreateBitCast(V, Builder.getInt32Ty()),
+                              Builder.getInt64Ty());
+  }
+  return Builder.CreateBitCast(V, Builder.getInt64Ty());
+}
+
+/// Add the wrapper calling \p F, which takes its arguments from an array of
+/// words and stores its result in a word.
+static void addWrapper(Function &F, const Twine &Name) {
+  Module &M = *F.getParent();
+  IRBuilder<> Builder(M.getContext());
+  Type *WordTy = Builder.getInt64Ty();
+  Type *WordPtrTy = WordTy->getPointerTo();
+  Function *Wrapper = Function::Create(
+      FunctionType::get(Builder.getVoidTy(), {WordPtrTy, WordPtrTy}, false),
+      GlobalValue::ExternalLinkage, Name, &M);
+  Builder.SetInsertPoint(BasicBlock::Create(M.getContext(), "", Wrapper));
+  Value *Args = Wrapper->arg_begin();
+  Value *Result = Wrapper->arg_begin() + 1;
+  SmallVector<Value *, 4> CallArgs;
+  for (unsigned I = 0; I < F.arg_size(); I++) {
+    Value *Word =
+        Builder.CreateLoad(WordTy, Builder.CreateConstGEP1_32(WordTy, Args, I));
+    CallArgs.push_back(
+        fromWord(Builder, Word, F.getFunctionType()->getParamType(I)));
+  }
+  CallInst *Call = Builder.CreateCall(F.getFunctionType(), &F, CallArgs);
+  // The extension attributes of the arguments are part of the ABI
+  Call->setAttributes(F.getAttributes());
+  Call->setCallingConv(F.getCallingConv());
+  Builder.CreateStore(toWord(Builder, Call), Result);
+  Builder.CreateRetVoid();
+}
+
+/// The functions of \p M called on both sides, and the number of exported
+/// functions skipped for their signature.
+static std::vector<Entry> findEntries(Module &M, unsigned &Skipped) {
+  std::vector<Entry> Entries;
+  Skipped = 0;
+  for (Function &F : M) {
+    bool Listed = is_contained(EntryList, F.getName());
+    if (F.isDeclaration() || F.hasLocalLinkage() ||
+        (EntryList.empty() ? F.getName() == "main" : !Listed)) {
+      continue;
+    }
+    Entry E;
+    E.Name = F.getName().str();
+    bool Supported =
+        !F.isVarArg() && WordKind::get(F.getReturnType(), E.Result);
+    for (Type *Ty : F.getFunctionType()->params()) {
+      WordKind Kind = {WordKind::Void, 0};
+      Supported = Supported && WordKind::get(Ty, Kind);
+      E.Params.push_back(Kind);
+    }
+    if (!Supported) {
+      if (Listed) {
+        error(F.getName() + " takes or returns a type obf-diff can not "
+                            "generate");
+      }
+      Skipped++;
+      continue;
+    }
+    Entries.push_back(std::move(E));
+  }
+  for (const std::string &Name : EntryList) {
+    if (none_of(Entries, [&](const Entry &E) { return E.Name == Name; })) {
+      error(Name + " is not an exported function of " + OriginalFilename);
+    }
+  }
+  return Entries;
+}
+
+/// Does \p Ty hold an address, which differs between the two JITs?
+static bool containsPointer(Type *Ty) {
+  if (Ty->isPointerTy()) {
+    return true;
+  }
+  return any_of(Ty->subtypes(), containsPointer);
+}
+
+/// Make the writable globals of the original module visible to the JIT in
+/// \p M, so they can be compared after each call. The globals holding
+/// addresses are left out.
+static std::vector<std::string> exposeGlobals(Module &M,
+                                              ArrayRef<std::string> Names) {
+  std::vector<std::string> Exposed;
+  for (GlobalVariable &GV : M.globals()) {
+    if (!GV.hasName() || GV.isConstant() || !GV.hasInitializer() ||
+        containsPointer(GV.getValueType()) ||
+        (!Names.empty() && !is_contained(Names, GV.getName()))) {
+      continue;
+    }
+    if (GV.hasLocalLinkage()) {
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+    }
+    Exposed.push_back(GV.getName().str());
+  }
+  return Exposed;
+}
+
+/// Compile \p M and look up the wrappers of \p Entries and the globals named
+/// \p GlobalNames.
+static Side createSide(std::unique_ptr<Module> M, orc::ThreadSafeContext Ctx,
+                       const std::vector<Entry> &Entries,
+                       ArrayRef<std::string> GlobalNames) {
+  Side S;
+  const DataLayout &DL = M->getDataLayout();
+  std::vector<uint64_t> GlobalSizes;
+  for (const std::string &Name : GlobalNames) {
+    GlobalVariable *GV = M->getGlobalVariable(Name, true);
+    GlobalSizes.push_back(GV == nullptr || GV->isDeclaration()
+                              ? 0
+                              : DL.getTypeAllocSize(GV->getValueType()));
+  }
+
+  S.JIT = ExitOnErr(orc::LLJITBuilder().create());
+  orc::JITDylib &JD = S.JIT->getMainJITDylib();
+  orc::SymbolMap Runtime;
+  for (const char *Name : {"__decrypt", "__encrypt"}) {
+    Runtime[S.JIT->mangleAndIntern(Name)] = JITEvaluatedSymbol(
+        pointerToJITTargetAddress(&xorString), JITSymbolFlags::Exported);
+  }
+  ExitOnErr(JD.define(orc::absoluteSymbols(std::move(Runtime))));
+  char Prefix = S.JIT->getDataLayout().getGlobalPrefix();
+#if LLVM_VERSION_MAJOR >= 10
+  JD.addGenerator(ExitOnErr(
+      orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(Prefix)));
+#else
+  (void)Prefix;
+  JD.setGenerator(ExitOnErr(
+      orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(DL)));
+#endif
+  ExitOnErr(S.JIT->addIRModule(orc::ThreadSafeModule(std::move(M), Ctx)));
+  // The constructors decrypt the strings of -obfstr used by global
+  // initializers
+#if LLVM_VERSION_MAJOR >= 11
+  ExitOnErr(S.JIT->initialize(JD));
+#else
+  ExitOnErr(S.JIT->runConstructors());
+#endif
+
+  for (unsigned I = 0; I < Entries.size(); I++) {
+    JITEvaluatedSymbol Sym = ExitOnErr(S.JIT->lookup(getWrapperName(I)));
+    S.Wrappers.push_back(
+        reinterpret_cast<WrapperFn>(static_cast<uintptr_t>(Sym.getAddress())));
+  }
+  for (unsigned I = 0; I < GlobalNames.size(); I++) {
+    if (GlobalSizes[I] == 0) {
+      S.Globals.emplace_back(nullptr, 0);
+      continue;
+    }
+    JITEvaluatedSymbol Sym = ExitOnErr(S.JIT->lookup(GlobalNames[I]));
+    S.Globals.emplace_back(reinterpret_cast<char *>(
+                               static_cast<uintptr_t>(Sym.getAddress())),
+                           GlobalSizes[I]);
+  }
+  S.Times.resize(Entries.size());
+  return S;
+}
+
+/// Call the wrapper \p Index of \p S -repeat times and add their time.
+static uint64_t call(Side &S, unsigned Index, ArrayRef<uint64_t> Args) {
+  uint64_t Result = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned I = 0; I < std::max(1u, Repeat.getValue()); I++) {
+    S.Wrappers[Index](Args.data(), &Result);
+  }
+  S.Times[Index] += std::chrono::steady_clock::now() - Start;
+  return Result;
+}
+
+/// The generator of the arguments of \p E, which only depends on -seed and
+/// the name of the function.
+static std::mt19937_64 createGenerator(const Entry &E) {
+  MD5 Hash;
+  Hash.update(E.Name);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  std::seed_seq Sequence{uint32_t(Seed), uint32_t(Result.low()),
+                         uint32_t(Result.low() >> 32)};
+  return std::mt19937_64(Sequence);
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  ToolName = argv[0];
+  ExitOnErr.setBanner(std::string(argv[0]) + ": ");
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  cl::ParseCommandLineOptions(
+      argc, argv, "differential run of an obfuscated module in a JIT\n");
+
+  orc::ThreadSafeContext OriginalCtx(std::make_unique<LLVMContext>());
+  orc::ThreadSafeContext ObfuscatedCtx(std::make_unique<LLVMContext>());
+  std::unique_ptr<Module> Original =
+      loadModule(OriginalFilename, *OriginalCtx.getContext());
+  std::unique_ptr<Module> Obfuscated =
+      loadModule(ObfuscatedFilename, *ObfuscatedCtx.getContext());
+
+  unsigned Skipped;
+  std::vector<Entry> Entries = findEntries(*Original, Skipped);
+  for (unsigned I = 0; I < Entries.size(); I++) {
+    Function *F = Original->getFunction(Entries[I].Name);
+    Function *G = Obfuscated->getFunction(Entries[I].Name);
+    if (G == nullptr || G->isDeclaration() ||
+        printType(G->getFunctionType()) != printType(F->getFunctionType())) {
+      error(Entries[I].Name + " is not defined with the same type in " +
+            ObfuscatedFilename);
+    }
+    addWrapper(*F, getWrapperName(I));
+    addWrapper(*G, getWrapperName(I));
+  }
+  std::vector<std::string> GlobalNames = exposeGlobals(*Original, {});
+  exposeGlobals(*Obfuscated, GlobalNames);
+
+  Side Sides[2] = {
+      createSide(std::move(Original), OriginalCtx, Entries, GlobalNames),
+      createSide(std::move(Obfuscated), ObfuscatedCtx, Entries, GlobalNames)};
+
+  unsigned Differences = 0;
+  uint64_t Range = InputRange;
+  for (unsigned I = 0; I < Entries.size(); I++) {
+    const Entry &E = Entries[I];
+    std::mt19937_64 Generator = createGenerator(E);
+    std::uniform_int_distribution<int64_t> Distribution(-int64_t(Range),
+                                                        int64_t(Range));
+    const int64_t Edges[] = {0, 1, -1, int64_t(Range), -int64_t(Range)};
+    SmallVector<uint64_t, 4> Args(E.Params.size());
+    unsigned Reports = 0;
+    for (unsigned Input = 0; Input < NumInputs; Input++) {
+      for (unsigned A = 0; A < Args.size(); A++) {
+        Args[A] = E.Params[A].fromInteger(
+            Input < array_lengthof(Edges) ? Edges[Input]
+                                          : Distribution(Generator));
+      }
+      uint64_t Expected = call(Sides[0], I, Args);
+      uint64_t Result = call(Sides[1], I, Args);
+      // The globals which differ are copied back, so they only fail once
+      SmallVector<StringRef, 2> Changed;
+      for (unsigned G = 0; G < GlobalNames.size(); G++) {
+        auto &Original = Sides[0].Globals[G];
+        auto &Obfuscated = Sides[1].Globals[G];
+        if (Original.first != nullptr && Obfuscated.first != nullptr &&
+            Original.second == Obfuscated.second &&
+            memcmp(Original.first, Obfuscated.first, Original.second) != 0) {
+          memcpy(Obfuscated.first, Original.first, Original.second);
+          Changed.push_back(GlobalNames[G]);
+        }
+      }
+      if (Expected == Result && Changed.empty()) {
+        continue;
+      }
+      if (Reports++ < MaxReports) {
+        WithColor::error(errs(), ToolName);
+        E.printCall(errs(), Args);
+        if (Expected != Result) {
+          errs() << " returned ";
+          E.Result.print(errs(), Expected);
+          errs() << ", the obfuscated module returned ";
+          E.Result.print(errs(), Result);
+        } else {
+          errs() << " left different values in @" << join(Changed, ", @");
+        }
+        errs() << "\n";
+      }
+    }
+    Differences += Reports;
+  }
+
+  outs() << left_justify("function", 32) << right_justify("inputs", 9)
+         << right_justify("original ns", 15)
+         << right_justify("obfuscated ns", 15) << right_justify("overhead", 10)
+         << "\n";
+  unsigned Calls = NumInputs * std::max(1u, Repeat.getValue());
+  for (unsigned I = 0; I < Entries.size(); I++) {
+    double Original = Sides[0].Times[I].count() / double(Calls);
+    double Obfuscated = Sides[1].Times[I].count() / double(Calls);
+    outs() << format("%-32s %8u %14.1f %14.1f %8.2fx\n",
+                     Entries[I].Name.c_str(), NumInputs.getValue(), Original,
+                     Obfuscated, Original == 0 ? 0.0 : Obfuscated / Original);
+  }
+  if (Skipped != 0) {
+    WithColor::note(errs(), ToolName)
+        << Skipped << " exported functions skipped for the types of their "
+        << "arguments or result\n";
+  }
+  if (Differences != 0) {
+    WithColor::error(errs(), ToolName)
+        << Differences << " calls differ between the modules\n";
+    return 1;
+  }
+  return 0;
+}
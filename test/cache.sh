@@ -0,0 +1,21 @@
+# Obfuscate a test program with obf-parallel twice with the same cache, and
+# check the second run, which takes every function from the cache, writes the
+# same bitcode as the first.
+# Usage: ./cache.sh test5.c
+fullname=${1}
+basename=${fullname/.c/}
+parallel=../build/src/obf-parallel
+clang-9 -emit-llvm -S ${fullname} -o ${basename}.ll
+rm -rf ${basename}_cache
+for run in cold warm; do
+  if ! ${parallel} -subobf -boguscf -flattening -obf-seed=9 \
+      -obf-cache-dir=${basename}_cache ${basename}.ll \
+      -o ${basename}_${run}.bc; then
+    echo "FAIL: the ${run} run of obf-parallel failed"
+    exit 1
+  fi
+done
+if ! cmp ${basename}_cold.bc ${basename}_warm.bc; then
+  echo "FAIL: the cached functions change the output"
+  exit 1
+fi
@@ -1,19 +1,37 @@
 #include <stdint.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-char *__decrypt(char *encStr, uint64_t length) {
-  char *curr = encStr;
-  for (uint16_t i = 0; i < length; i++) {
-    *curr ^= 42;
-    curr++;
+#define XOR_KEY 42
+
+static void xor_bytes(char *str, uint64_t length) {
+  uint64_t i = 0;
+#ifdef __AVX2__
+  const __m256i key32 = _mm256_set1_epi8(XOR_KEY);
+  for (; i + 32 <= length; i += 32) {
+    __m256i *p = (__m256i *)(str + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key32));
+  }
+#endif
+#ifdef __SSE2__
+  const __m128i key16 = _mm_set1_epi8(XOR_KEY);
+  for (; i + 16 <= length; i += 16) {
+    __m128i *p = (__m128i *)(str + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key16));
   }
+#endif
+  for (; i < length; i++) {
+    str[i] ^= XOR_KEY;
+  }
+}
+
+char *__decrypt(char *encStr, uint64_t length) {
+  xor_bytes(encStr, length);
   return encStr;
 }
 
 char *__encrypt(char *originStr, uint64_t length) {
-  char *curr = originStr;
-  for (uint16_t i = 0; i < length; i++) {
-    *curr ^= 42;
-    curr++;
-  }
+  xor_bytes(originStr, length);
   return originStr;
-}
\ No newline at end of file
+}
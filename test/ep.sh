@@ -0,0 +1,29 @@
+# Run -obf-pipeline at each -obf-ep of default<O2> on a test program and check
+# the output program prints what the original one prints.
+# Usage: ./ep.sh test5.c "3 4"
+fullname=${1}
+input=${2}
+basename=${fullname/.c/}
+plugin=../build/src/libObfuscator.so
+# Without optnone, so that default<O2> optimizes the obfuscated functions
+clang-9 -emit-llvm -S -Xclang -disable-O0-optnone ${fullname} \
+    -o ${basename}.ll
+clang-9 ${basename}.ll -o ${basename}_orig.out
+expected=$(echo "${input}" | ./${basename}_orig.out)
+status=0
+for ep in pipeline-start peephole scalar-late vectorizer-start optimizer-last; do
+  # Each function is obfuscated once, however often its extension point runs
+  if ! timeout 120 opt-9 -load ${plugin} -load-pass-plugin ${plugin} \
+      -obf-pipeline=obfstr,subobf,boguscf,flattening -obf-ep=${ep} \
+      -passes='default<O2>' ${basename}.ll -o ${basename}_${ep}.bc; then
+    echo "FAIL: -obf-ep=${ep}: opt failed or timed out"
+    status=1
+    continue
+  fi
+  clang-9 ${basename}_${ep}.bc encrypt.c -o ${basename}_${ep}.out
+  if [ "$(echo "${input}" | ./${basename}_${ep}.out)" != "${expected}" ]; then
+    echo "FAIL: -obf-ep=${ep}: wrong output"
+    status=1
+  fi
+done
+exit ${status}
@@ -0,0 +1,92 @@
+// Runtime of -obf-profile-gen, linked with the instrumented program.
+//
+// Each function registers a descriptor on its first call in a thread and
+// gets the counters of the thread, so the instrumented code counts with
+// plain adds. The counters of all the threads are summed at exit and written
+// to $OBFPROF_FILE, obfprof.raw by default, for obf-profdata:
+//
+//   "OBFPROF" 1, uleb counters per function,
+//   then per function: uleb name length, name, uleb counters.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OBFPROF_COUNTERS 3
+#define OBFPROF_VERSION 1
+
+struct obfprof_block {
+  uint64_t counters[OBFPROF_COUNTERS];
+  struct obfprof_block *next;
+};
+
+// Laid out as the { i8*, i8*, i8*, i32 } the passes emit
+struct obfprof_function {
+  const char *name;
+  struct obfprof_function *next;
+  struct obfprof_block *blocks;
+  int32_t registered;
+};
+
+static struct obfprof_function *functions;
+
+uint64_t *__obfprof_register(struct obfprof_function *function) {
+  struct obfprof_block *block = calloc(1, sizeof(*block));
+  if (block == NULL) {
+    abort();
+  }
+  block->next = __atomic_load_n(&function->blocks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&function->blocks, &block->next, block,
+                                      1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  if (__atomic_exchange_n(&function->registered, 1, __ATOMIC_ACQ_REL) == 0) {
+    function->next = __atomic_load_n(&functions, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&functions, &function->next, function,
+                                        1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+  }
+  return block->counters;
+}
+
+static void write_uleb(FILE *out, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) {
+      byte |= 0x80;
+    }
+    fputc(byte, out);
+  } while (value != 0);
+}
+
+__attribute__((destructor)) static void obfprof_write(void) {
+  const char *path = getenv("OBFPROF_FILE");
+  FILE *out = fopen(path != NULL ? path : "obfprof.raw", "wb");
+  if (out == NULL) {
+    perror("obfprof");
+    return;
+  }
+  fwrite("OBFPROF", 1, 7, out);
+  fputc(OBFPROF_VERSION, out);
+  write_uleb(out, OBFPROF_COUNTERS);
+  for (struct obfprof_function *function =
+           __atomic_load_n(&functions, __ATOMIC_ACQUIRE);
+       function != NULL; function = function->next) {
+    uint64_t sums[OBFPROF_COUNTERS] = {0};
+    for (struct obfprof_block *block =
+             __atomic_load_n(&function->blocks, __ATOMIC_ACQUIRE);
+         block != NULL; block = block->next) {
+      for (int i = 0; i < OBFPROF_COUNTERS; i++) {
+        sums[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+      }
+    }
+    size_t length = strlen(function->name);
+    write_uleb(out, length);
+    fwrite(function->name, 1, length, out);
+    for (int i = 0; i < OBFPROF_COUNTERS; i++) {
+      write_uleb(out, sums[i]);
+    }
+  }
+  fclose(out);
+}
@@ -0,0 +1,53 @@
+# Build the opaque predicates of -boguscf from each family alone and check
+# -O2 does not fold them: the bogus copy of the call to marker has to stay.
+# Usage: ./predicates.sh
+plugin=../build/src/libObfuscator.so
+cat > predicates.ll <<EOF
+declare void @marker(i32)
+
+define void @two_integers(i32 %x, i32 %y) {
+entry:
+  call void @marker(i32 1)
+  ret void
+}
+
+define void @one_integer(i64 %x) {
+entry:
+  call void @marker(i32 2)
+  ret void
+}
+
+define void @address(i8* %p, i8 %c) {
+entry:
+  call void @marker(i32 3)
+  ret void
+}
+
+define void @no_arguments() {
+entry:
+  call void @marker(i32 4)
+  ret void
+}
+EOF
+status=0
+for family in even-product square-mod-four odd-square four-consecutive \
+    seven-squares and-or-product xor-and-sum square-difference square-parity; do
+  for seed in 1 2 3 4 5; do
+    if ! opt-9 -load ${plugin} -boguscf -bcf_prob=100 \
+        -bcf_predicate=${family} -obf-seed=${seed} predicates.ll \
+        -o predicates_${family}.bc; then
+      echo "FAIL: ${family}: opt failed"
+      status=1
+      continue
+    fi
+    optimized=$(opt-9 -O2 predicates_${family}.bc -S -o -)
+    for marker in 1 2 3 4; do
+      calls=$(echo "${optimized}" | grep -c "call void @marker(i32 ${marker})")
+      if [ ${calls} -lt 2 ]; then
+        echo "FAIL: ${family} with -obf-seed=${seed} folded in function ${marker}"
+        status=1
+      fi
+    done
+  done
+done
+exit ${status}